@@ -1,57 +1,244 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define ARENA_DEFAULT_ALLOCS 1024
+#include <stddef.h>
+#include <pthread.h>
+
+// Chunks start small, for short lived parsers and generators,
+// and double in size up to the maximum
+#define ARENA_MIN_CHUNK 8192
+#define ARENA_MAX_CHUNK (64 * 1024)
+
+// Allocations larger than this get their own block
+#define ARENA_LARGE (ARENA_MAX_CHUNK / 4)
+
+#define ARENA_ALIGN (_Alignof(max_align_t))
+#define ARENA_ROUND(X) (((X) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
 
 // These are the low level allocators 
 // Default to malloc, realloc and free but can be replaced
+// Each parser or generator can also have its own jsonpg_allocator
 static void *(*pg_alloc)(size_t) = malloc;
 static void *(*pg_realloc)(void *, size_t) = realloc;
 static void (*pg_dealloc)(void *) = free;
 
+static void arena_cache_flush(void *);
+
 void jsonpg_set_allocators(
                 void *(*malloc)(size_t),
                 void *(*realloc)(void *, size_t),
                 void (*free)(void *))
 {
+        // Cached chunks came from the old allocators
+        arena_cache_flush(NULL);
+
         pg_alloc = malloc;
         pg_realloc = realloc;
         pg_dealloc = free;
 }
 
+// Arena memory comes from a caller supplied jsonpg_allocator,
+// or from the low level allocators if there is none
+
+static void *mem_alloc(jsonpg_allocator *al, size_t size)
+{
+        return al ? al->alloc(al->ctx, size) : pg_alloc(size);
+}
+
+static void *mem_realloc(jsonpg_allocator *al, void *p, size_t size)
+{
+        return al ? al->realloc(al->ctx, p, size) : pg_realloc(p, size);
+}
+
+static void mem_free(jsonpg_allocator *al, void *p)
+{
+        if(al)
+                al->free(al->ctx, p);
+        else
+                pg_dealloc(p);
+}
+
+
+// A bump allocator
+// Small allocations are carved from chunks, large ones get a block of
+// their own from pg_alloc, everything is freed with the arena
+//
+// Every allocation is preceded by its size, with the low bit set for
+// large blocks, so that arena_realloc can copy or reallocate it.
+// The most recent small allocation can grow or shrink in place
+
+typedef struct arena_chunk_s *arena_chunk;
+typedef struct arena_large_s *arena_large;
+
+struct arena_chunk_s {
+        arena_chunk next;
+        size_t size;
+};
+
+struct arena_large_s {
+        arena_large next;
+        arena_large prev;
+};
+
+#define ARENA_CHUNK_HDR ARENA_ROUND(sizeof(struct arena_chunk_s))
+#define ARENA_LARGE_HDR ARENA_ROUND(sizeof(struct arena_large_s) + sizeof(size_t))
+#define ARENA_SIZE_HDR  ARENA_ROUND(sizeof(size_t))
+#define ARENA_IS_LARGE  1
+
+// Without an allocator, freed chunks are kept in a per-thread cache
+// so that short lived parsers and generators can reuse them without
+// going back to malloc
+// Chunks are cached by size, ARENA_MIN_CHUNK << n for n < ARENA_CACHE_SIZES
+#define ARENA_CACHE_SIZES 4
+#define ARENA_CACHE_DEPTH 8
+
+struct arena_cache_s {
+        arena_chunk chunks[ARENA_CACHE_SIZES];
+        int count[ARENA_CACHE_SIZES];
+        bool registered;
+};
+
+static _Thread_local struct arena_cache_s arena_cache;
+static pthread_key_t arena_cache_key;
+static pthread_once_t arena_cache_once = PTHREAD_ONCE_INIT;
+
+// Frees the calling thread's cached chunks, also called at thread exit
+static void arena_cache_flush(void *unused)
+{
+        struct arena_cache_s *cache = &arena_cache;
+        for(int i = 0 ; i < ARENA_CACHE_SIZES ; i++) {
+                arena_chunk c = cache->chunks[i];
+                while(c) {
+                        arena_chunk next = c->next;
+                        pg_dealloc(c);
+                        c = next;
+                }
+                cache->chunks[i] = NULL;
+                cache->count[i] = 0;
+        }
+}
+
+static void arena_cache_key_create(void)
+{
+        pthread_key_create(&arena_cache_key, arena_cache_flush);
+}
 
-// This is not actually an arena allocator,
-// but it looks like one from the outside.
-// Internally it just keeps track of all allocations so that it can free
-// them when the arena is freed.
+static int arena_cache_index(size_t size)
+{
+        for(int i = 0 ; i < ARENA_CACHE_SIZES ; i++)
+                if(size == (size_t)ARENA_MIN_CHUNK << i)
+                        return i;
+        return -1;
+}
 
-typedef struct arena_s *arena;
+static arena_chunk chunk_alloc(jsonpg_allocator *al, size_t size)
+{
+        if(!al) {
+                int i = arena_cache_index(size);
+                if(i >= 0 && arena_cache.chunks[i]) {
+                        arena_chunk c = arena_cache.chunks[i];
+                        arena_cache.chunks[i] = c->next;
+                        arena_cache.count[i]--;
+                        return c;
+                }
+        }
+        return mem_alloc(al, size);
+}
+
+static void chunk_free(jsonpg_allocator *al, arena_chunk c)
+{
+        if(!al) {
+                int i = arena_cache_index(c->size);
+                if(i >= 0 && arena_cache.count[i] < ARENA_CACHE_DEPTH) {
+                        if(!arena_cache.registered) {
+                                // Have the cache flushed at thread exit
+                                pthread_once(&arena_cache_once, 
+                                                arena_cache_key_create);
+                                pthread_setspecific(arena_cache_key, &arena_cache);
+                                arena_cache.registered = true;
+                        }
+                        c->next = arena_cache.chunks[i];
+                        arena_cache.chunks[i] = c;
+                        arena_cache.count[i]++;
+                        return;
+                }
+        }
+        mem_free(al, c);
+}
 
 struct arena_s {
-        size_t used;
-        size_t capacity;
-        void ** allocs;
+        jsonpg_allocator *allocator; // NULL for the default
+        arena_chunk chunks;     // current chunk first
+        arena_large large;
+        uint8_t *next;          // free space in current chunk
+        uint8_t *end;
+        void *last;             // most recent small allocation
+        arena_chunk caller;     // caller's memory, not freed
+        bool fixed;             // only use the caller's memory
 };
 
-static arena arena_new()
+static size_t *arena_size_ptr(void *p)
 {
-        arena a = pg_alloc(sizeof(struct arena_s));
-        if(!a)
-                return NULL;
+        return (size_t *)p - 1;
+}
+
+static arena_large arena_large_block(void *p)
+{
+        return (arena_large)((uint8_t *)p - ARENA_LARGE_HDR);
+}
 
-        void **allocs = pg_alloc(ARENA_DEFAULT_ALLOCS * sizeof(void *));
-        if(!allocs) {
-                pg_dealloc(a);
+// The arena lives in its own first chunk
+static arena arena_setup(jsonpg_allocator *al, arena_chunk c, size_t size)
+{
+        c->next = NULL;
+        c->size = size;
+
+        arena a = (arena)((uint8_t *)c + ARENA_CHUNK_HDR);
+        a->allocator = al;
+        a->chunks = c;
+        a->large = NULL;
+        a->next = (uint8_t *)a + ARENA_ROUND(sizeof(struct arena_s));
+        a->end = (uint8_t *)c + size;
+        a->last = NULL;
+        a->caller = NULL;
+        a->fixed = false;
+
+        JSONPG_LOG("Arena %p created in chunk %p\n", a, c);
+
+        return a;
+}
+
+static arena arena_new(jsonpg_allocator *al)
+{
+        arena_chunk c = chunk_alloc(al, ARENA_MIN_CHUNK);
+        if(!c)
                 return NULL;
-        }
 
-        JSONPG_LOG("Arena %p created with allocation buffer %p\n", 
-                        a, ARENA_DEFAULT_ALLOCS, allocs);
+        return arena_setup(al, c, ARENA_MIN_CHUNK);
+}
 
-        a->used = 0;
-        a->capacity = ARENA_DEFAULT_ALLOCS;
-        a->allocs = allocs;
+/*
+ * Creates an arena in the caller's memory
+ * If fixed then allocations fail once the memory is used up,
+ * otherwise further chunks come from pg_alloc as usual
+ * Returns NULL if the memory is too small to hold the arena
+ */
+static arena arena_init(
+                jsonpg_allocator *al, 
+                void *memory, 
+                size_t size, 
+                bool fixed)
+{
+        uintptr_t start = ARENA_ROUND((uintptr_t)memory);
+        size_t skip = start - (uintptr_t)memory;
+        if(!memory || size < skip + ARENA_CHUNK_HDR 
+                        + ARENA_ROUND(sizeof(struct arena_s)))
+                return NULL;
 
+        arena_chunk c = (arena_chunk)start;
+        arena a = arena_setup(al, c, (size - skip) & ~(ARENA_ALIGN - 1));
+        a->caller = c;
+        a->fixed = fixed;
         return a;
 }
 
@@ -61,53 +248,165 @@ static void arena_free(void *p)
                 return;
         
         arena a = p;
+        jsonpg_allocator *al = a->allocator;
 
-        for(int i = 0 ; i < a->used ; i++) {
-                JSONPG_LOG("Allocation[%ld] %p freed\n", i, a->allocs[i]);
-                pg_dealloc(a->allocs[i]);
+        arena_large l = a->large;
+        while(l) {
+                arena_large next = l->next;
+                JSONPG_LOG("Large block %p freed\n", l);
+                mem_free(al, l);
+                l = next;
         }
 
-        JSONPG_LOG("Allocation buffer %p freed\n", a->allocs);
-        pg_dealloc(a->allocs);
+        // The last chunk holds the arena itself
+        arena_chunk caller = a->caller;
+        arena_chunk c = a->chunks;
+        while(c) {
+                arena_chunk next = c->next;
+                if(c != caller) {
+                        JSONPG_LOG("Chunk %p freed\n", c);
+                        chunk_free(al, c);
+                }
+                c = next;
+        }
+}
+
+static void *arena_alloc_large(arena a, size_t size)
+{
+        arena_large l = mem_alloc(a->allocator, ARENA_LARGE_HDR + size);
+        if(!l)
+                return NULL;
+
+        l->prev = NULL;
+        l->next = a->large;
+        if(l->next)
+                l->next->prev = l;
+        a->large = l;
 
-        JSONPG_LOG("Arena %p freed\n", a);
-        pg_dealloc(a);
+        void *p = (uint8_t *)l + ARENA_LARGE_HDR;
+        *arena_size_ptr(p) = size | ARENA_IS_LARGE;
+
+        JSONPG_LOG("Arena %p allocated %ld bytes to large block %p\n", a, size, l);
+
+        return p;
 }
 
-static void *arena_alloc(arena a, size_t size)
+static bool arena_new_chunk(arena a, size_t size)
 {
-        if(a->used == a->capacity) {
-                void **new_a = pg_realloc(a->allocs, a->capacity << 1);
-                if(!new_a)
-                        return NULL;
-                a->capacity <<= 1;
-                a->allocs = new_a;
+        if(a->fixed) {
+                JSONPG_LOG("Arena %p out of fixed memory\n", a);
+                return false;
         }
 
-        void *p = pg_alloc(size);
-        if(!p)
+        size_t chunk_size = a->chunks->size < ARENA_MAX_CHUNK
+                ? a->chunks->size << 1
+                : ARENA_MAX_CHUNK;
+        if(chunk_size < ARENA_MIN_CHUNK)
+                chunk_size = ARENA_MIN_CHUNK;
+        while(chunk_size < ARENA_CHUNK_HDR + size)
+                chunk_size <<= 1;
+
+        arena_chunk c = chunk_alloc(a->allocator, chunk_size);
+        if(!c)
+                return false;
+
+        JSONPG_LOG("Arena %p new chunk %p of %ld bytes\n", a, c, chunk_size);
+
+        c->next = a->chunks;
+        c->size = chunk_size;
+        a->chunks = c;
+        a->next = (uint8_t *)c + ARENA_CHUNK_HDR;
+        a->end = (uint8_t *)c + chunk_size;
+        return true;
+}
+
+static void *arena_alloc(arena a, size_t size)
+{
+        size = ARENA_ROUND(size);
+        if(size > ARENA_LARGE && !a->fixed)
+                return arena_alloc_large(a, size);
+
+        size_t required = ARENA_SIZE_HDR + size;
+        if(required > a->end - a->next && !arena_new_chunk(a, required))
                 return NULL;
 
-        JSONPG_LOG("Arena %p allocated %ld bytes to %p\n", a, size, p);
+        void *p = a->next + ARENA_SIZE_HDR;
+        *arena_size_ptr(p) = size;
+        a->next += required;
+        a->last = p;
 
-        a->allocs[a->used++] = p;
         return p;
 }
 
+// Large blocks are returned to the heap and the most recent allocation
+// to the arena, anything else stays allocated until the arena is freed
+static void arena_dealloc(arena a, void *p)
+{
+        size_t size = *arena_size_ptr(p);
+
+        if(size & ARENA_IS_LARGE) {
+                arena_large l = arena_large_block(p);
+                if(l->prev)
+                        l->prev->next = l->next;
+                else
+                        a->large = l->next;
+                if(l->next)
+                        l->next->prev = l->prev;
+
+                JSONPG_LOG("Arena %p freed large block %p\n", a, l);
+                mem_free(a->allocator, l);
+        } else if(p == a->last) {
+                a->next = (uint8_t *)p - ARENA_SIZE_HDR;
+                a->last = NULL;
+        }
+}
+
 static void *arena_realloc(arena a, void *p, size_t new_size)
 {
-        for(int i = 0 ; i < a->used ; i++) {
-                if(p == a->allocs[i]) {
-                        void *np = pg_realloc(p, new_size);
-                        if(!np)
-                                return NULL;
+        new_size = ARENA_ROUND(new_size);
+        size_t size = *arena_size_ptr(p);
 
-                        JSONPG_LOG("Arena %p reallocated %ld bytes from %p to %p\n",
-                                        a, new_size, p, np);
+        if(size & ARENA_IS_LARGE) {
+                arena_large l = arena_large_block(p);
+                arena_large prev = l->prev;
+                arena_large next = l->next;
+                arena_large nl = mem_realloc(a->allocator, l, ARENA_LARGE_HDR + new_size);
+                if(!nl)
+                        return NULL;
 
-                        a->allocs[i] = np;
-                        return np;
-                }
+                if(prev)
+                        prev->next = nl;
+                else
+                        a->large = nl;
+                if(next)
+                        next->prev = nl;
+
+                void *np = (uint8_t *)nl + ARENA_LARGE_HDR;
+                *arena_size_ptr(np) = new_size | ARENA_IS_LARGE;
+
+                JSONPG_LOG("Arena %p reallocated %ld bytes from %p to %p\n",
+                                a, new_size, p, np);
+
+                return np;
         }
-        return NULL;
+
+        // Most recent allocation, grow or shrink in place
+        if(p == a->last 
+                        && (new_size <= ARENA_LARGE || a->fixed)
+                        && new_size <= a->end - (uint8_t *)p) {
+                *arena_size_ptr(p) = new_size;
+                a->next = (uint8_t *)p + new_size;
+                return p;
+        }
+
+        if(new_size <= size) {
+                *arena_size_ptr(p) = new_size;
+                return p;
+        }
+
+        void *np = arena_alloc(a, new_size);
+        if(!np)
+                return NULL;
+        memcpy(np, p, size);
+        return np;
 }
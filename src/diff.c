@@ -0,0 +1,417 @@
+/*
+ * diff.c
+ *   Writing the differences between two DOMs as an RFC 6902 JSON Patch
+ *
+ *   Both DOMs are hashed first, values with different hashes differ and
+ *   values with the same hash are compared to be sure, so arrays and
+ *   objects that have not changed are passed over without looking for
+ *   changes inside them. Object members are matched by key lookup,
+ *   array elements by a longest common subsequence of their hashes
+ *   found with Myers' algorithm. That gives up after DIFF_MAX_EDITS
+ *   insertions and removals, leaving elements compared by index
+ */
+#include <stdio.h>
+
+#define DIFF_MAX_EDITS 512
+#define DIFF_PATH_MIN 256
+
+// Array elements are matched as a script of steps from the start
+// of both arrays, keeping, removing or adding an element
+#define DIFF_KEEP 'k'
+#define DIFF_REMOVE 'r'
+#define DIFF_ADD 'a'
+
+typedef struct diff_s {
+        jsonpg_generator g;
+        arena arena;
+        uint8_t *path;          // JSON pointer to the values being compared
+        size_t path_count;
+        size_t path_size;
+} *diff;
+
+// An element of an array being compared
+typedef struct {
+        dom_pos at;
+        uint64_t hash;
+} diff_element;
+
+static bool diff_path_grow(diff d, size_t count)
+{
+        if(d->path_count + count <= d->path_size)
+                return true;
+
+        size_t size = 2 * d->path_size;
+        while(size < d->path_count + count)
+                size <<= 1;
+        uint8_t *path = arena_realloc(d->arena, d->path, size);
+        if(!path)
+                return false;
+        d->path = path;
+        d->path_size = size;
+        return true;
+}
+
+static bool diff_path_key(diff d, jsonpg_string_value key)
+{
+        // Escaping at most doubles the key's length
+        if(!diff_path_grow(d, 1 + 2 * key.length))
+                return false;
+
+        uint8_t *p = d->path + d->path_count;
+        *p++ = '/';
+        for(size_t i = 0 ; i < key.length ; i++) {
+                if(key.bytes[i] == '~') {
+                        *p++ = '~';
+                        *p++ = '0';
+                } else if(key.bytes[i] == '/') {
+                        *p++ = '~';
+                        *p++ = '1';
+                } else {
+                        *p++ = key.bytes[i];
+                }
+        }
+        d->path_count = p - d->path;
+        return true;
+}
+
+static bool diff_path_index(diff d, size_t index)
+{
+        char digits[24];
+        int count = snprintf(digits, sizeof(digits), "/%zu", index);
+        if(!diff_path_grow(d, count))
+                return false;
+        memcpy(d->path + d->path_count, digits, count);
+        d->path_count += count;
+        return true;
+}
+
+// Writes an operation on the value at the path, with a value if
+// value is not none
+static int diff_op(diff d, const char *op, jsonpg_cursor value)
+{
+        jsonpg_generator g = d->g;
+        if(jsonpg_begin_object(g)
+                        || jsonpg_key(g, (uint8_t *)"op", 2)
+                        || jsonpg_string(g, (uint8_t *)op, strlen(op))
+                        || jsonpg_key(g, (uint8_t *)"path", 4)
+                        || jsonpg_string(g, d->path, d->path_count))
+                return -1;
+        if(value.at != DOM_NO_POS
+                        && (jsonpg_key(g, (uint8_t *)"value", 5)
+                                || dom_generate(g, value)))
+                return -1;
+        return jsonpg_end_object(g) ? -1 : 0;
+}
+
+static int diff_value(diff d, jsonpg_cursor a, jsonpg_cursor b);
+
+static int diff_member(diff d, jsonpg_string_value key, const char *op,
+                jsonpg_cursor a, jsonpg_cursor b)
+{
+        size_t path_count = d->path_count;
+        if(!diff_path_key(d, key))
+                return -1;
+        int r = op ? diff_op(d, op, b) : diff_value(d, a, b);
+        d->path_count = path_count;
+        return r;
+}
+
+// Members in the same order are paired without lookups, as when
+// comparing objects, the rest are found by key
+static int diff_object(diff d, jsonpg_cursor a, jsonpg_cursor b)
+{
+        jsonpg_cursor m = cursor_first(a), n = cursor_first(b);
+        for( ; m.at != DOM_NO_POS && n.at != DOM_NO_POS ; 
+                        m = cursor_next(m), n = cursor_next(n)) {
+                jsonpg_string_value key = cursor_key_string(m);
+                if(!dom_key_equal(dom_node_at(b.dom, n.key), key.bytes, key.length))
+                        break;
+                if(diff_member(d, key, NULL, m, n))
+                        return -1;
+        }
+
+        // Only the first of duplicate keys is found by lookups, but
+        // removing a key removes each of them so none takes its place
+        for( ; m.at != DOM_NO_POS ; m = cursor_next(m)) {
+                jsonpg_string_value key = cursor_key_string(m);
+                jsonpg_cursor found = cursor_get(b, key.bytes, key.length);
+                if(found.at != DOM_NO_POS
+                                && cursor_get(a, key.bytes, key.length).at != m.at)
+                        continue;
+                if(diff_member(d, key, found.at == DOM_NO_POS ? "remove" : NULL,
+                                        m, found))
+                        return -1;
+        }
+
+        for( ; n.at != DOM_NO_POS ; n = cursor_next(n)) {
+                jsonpg_string_value key = cursor_key_string(n);
+                if(cursor_get(b, key.bytes, key.length).at != n.at)
+                        continue;
+                if(cursor_get(a, key.bytes, key.length).at == DOM_NO_POS
+                                && diff_member(d, key, "add", m, n))
+                        return -1;
+        }
+        return 0;
+}
+
+static diff_element *diff_elements(diff d, jsonpg_cursor c, size_t count)
+{
+        diff_element *elements = arena_alloc(d->arena,
+                        (count ? count : 1) * sizeof(diff_element));
+        if(!elements)
+                return NULL;
+
+        size_t i = 0;
+        for(c = cursor_first(c) ; c.at != DOM_NO_POS ; c = cursor_next(c))
+                elements[i++] = (diff_element){ c.at, cursor_hash(c) };
+        return elements;
+}
+
+/*
+ * Myers' algorithm, finds the fewest removals and additions that turn
+ * a into b by following the matching elements along each diagonal
+ * k = x - y. The furthest x reached on each diagonal after e edits is
+ * kept for every e so that the path can be traced back
+ */
+
+// Furthest x on diagonal k after e edits, before following matches,
+// or -1 if it cannot be reached. add is set if the last edit is adding
+// an element of b, otherwise it is removing an element of a
+static ptrdiff_t diff_myers_start(
+                ptrdiff_t *prev,
+                ptrdiff_t e,
+                ptrdiff_t k,
+                size_t n,
+                size_t m,
+                bool *add)
+{
+        ptrdiff_t x = -1;
+        *add = false;
+        if(k + 1 <= e - 1) {
+                ptrdiff_t down = prev[k + 1 + e - 1];
+                if(down >= 0 && down - k <= (ptrdiff_t)m) {
+                        x = down;
+                        *add = true;
+                }
+        }
+        if(k - 1 >= 1 - e) {
+                ptrdiff_t right = prev[k - 1 + e - 1];
+                if(right >= 0 && right < (ptrdiff_t)n && right + 1 > x) {
+                        x = right + 1;
+                        *add = false;
+                }
+        }
+        return x;
+}
+
+// Writes the steps to script, in order, and returns how many there are
+// Returns 0 if more than DIFF_MAX_EDITS are needed or memory cannot
+// be allocated
+static size_t diff_myers(
+                diff d,
+                diff_element *a, size_t n,
+                diff_element *b, size_t m,
+                uint8_t *script)
+{
+        // Row e holds diagonals -e to e at offsets 0 to 2e, it starts at e * e
+        ptrdiff_t max = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS;
+        ptrdiff_t rows = max < 16 ? max + 1 : 16;
+        ptrdiff_t *furthest = arena_alloc(d->arena, rows * rows * sizeof(ptrdiff_t));
+        if(!furthest)
+                return 0;
+
+        ptrdiff_t e, k, x = 0;
+        size_t count = 0;
+        bool add;
+        for(e = 0 ; e <= max ; e++) {
+                if(e == rows) {
+                        rows = 2 * rows < max + 1 ? 2 * rows : max + 1;
+                        ptrdiff_t *grown = arena_realloc(d->arena, furthest,
+                                        rows * rows * sizeof(ptrdiff_t));
+                        if(!grown)
+                                break;
+                        furthest = grown;
+                }
+                ptrdiff_t *row = furthest + e * e;
+                ptrdiff_t *prev = furthest + (e - 1) * (e - 1);
+                for(k = -e ; k <= e ; k += 2) {
+                        x = e ? diff_myers_start(prev, e, k, n, m, &add) : 0;
+                        row[k + e] = x;
+                        if(x < 0)
+                                continue;
+                        while(x < (ptrdiff_t)n && x - k < (ptrdiff_t)m
+                                        && a[x].hash == b[x - k].hash)
+                                x++;
+                        row[k + e] = x;
+                        if(x == (ptrdiff_t)n && x - k == (ptrdiff_t)m)
+                                goto found;
+                }
+        }
+        arena_dealloc(d->arena, furthest);
+        return 0;
+
+found:
+        // Traced back from the end so the steps are written backwards
+        for( ; e > 0 ; e--) {
+                ptrdiff_t *prev = furthest + (e - 1) * (e - 1);
+                ptrdiff_t start = diff_myers_start(prev, e, k, n, m, &add);
+                while(x > start) {
+                        script[count++] = DIFF_KEEP;
+                        x--;
+                }
+                script[count++] = add ? DIFF_ADD : DIFF_REMOVE;
+                k = add ? k + 1 : k - 1;
+                x = prev[k + e - 1];
+        }
+        while(x--)
+                script[count++] = DIFF_KEEP;
+        arena_dealloc(d->arena, furthest);
+
+        for(size_t i = 0, j = count - 1 ; i < j ; i++, j--) {
+                uint8_t step = script[i];
+                script[i] = script[j];
+                script[j] = step;
+        }
+        return count;
+}
+
+// Steps that match arrays of n and m elements, returns how many
+static size_t diff_script(
+                diff d,
+                diff_element *a, size_t n,
+                diff_element *b, size_t m,
+                uint8_t *script)
+{
+        size_t count = 0;
+        while(count < n && count < m && a[count].hash == b[count].hash)
+                script[count++] = DIFF_KEEP;
+
+        size_t same = 0;
+        while(same < n - count && same < m - count
+                        && a[n - same - 1].hash == b[m - same - 1].hash)
+                same++;
+
+        size_t rest_a = n - count - same, rest_b = m - count - same;
+        size_t steps = rest_a && rest_b
+                ? diff_myers(d, a + count, rest_a, b + count, rest_b, script + count)
+                : 0;
+        if(!steps) {
+                // Compared by index, see diff_array
+                memset(script + count, DIFF_REMOVE, rest_a);
+                memset(script + count + rest_a, DIFF_ADD, rest_b);
+                steps = rest_a + rest_b;
+        }
+        count += steps;
+
+        memset(script + count, DIFF_KEEP, same);
+        return count + same;
+}
+
+// Compares elements, or writes an operation for one, at index
+static int diff_element_op(
+                diff d,
+                size_t index,
+                const char *op,
+                jsonpg_cursor a,
+                jsonpg_cursor b)
+{
+        size_t path_count = d->path_count;
+        if(!diff_path_index(d, index))
+                return -1;
+        int r = op ? diff_op(d, op, b) : diff_value(d, a, b);
+        d->path_count = path_count;
+        return r;
+}
+
+/*
+ * Elements kept are compared in case they only have the same hash
+ * Between elements kept, those removed are paired with those added
+ * and compared, so an element that has changed is patched rather
+ * than replaced. Elements left over are removed or added
+ * Indexes are of the array as patched so far
+ */
+static int diff_array(diff d, jsonpg_cursor a, jsonpg_cursor b)
+{
+        size_t n = cursor_count(a), m = cursor_count(b);
+        diff_element *ea = diff_elements(d, a, n);
+        diff_element *eb = ea ? diff_elements(d, b, m) : NULL;
+        uint8_t *script = eb ? arena_alloc(d->arena, n + m ? n + m : 1) : NULL;
+        if(!script)
+                return -1;
+
+        size_t count = diff_script(d, ea, n, eb, m, script);
+        jsonpg_cursor ca = { .dom = a.dom, .key = DOM_NO_POS };
+        jsonpg_cursor cb = { .dom = b.dom, .key = DOM_NO_POS };
+        size_t i = 0, j = 0, index = 0;
+        for(size_t s = 0 ; s < count ; ) {
+                if(script[s] == DIFF_KEEP) {
+                        ca.at = ea[i++].at;
+                        cb.at = eb[j++].at;
+                        if(diff_element_op(d, index++, NULL, ca, cb))
+                                return -1;
+                        s++;
+                        continue;
+                }
+
+                size_t removed = 0, added = 0;
+                for( ; s < count && script[s] != DIFF_KEEP ; s++) {
+                        if(script[s] == DIFF_REMOVE)
+                                removed++;
+                        else
+                                added++;
+                }
+                for(size_t p = 0 ; p < removed || p < added ; p++) {
+                        ca.at = p < removed ? ea[i + p].at : DOM_NO_POS;
+                        cb.at = p < added ? eb[j + p].at : DOM_NO_POS;
+                        if(p >= added ? diff_element_op(d, index, "remove", ca, cb)
+                                        : p >= removed
+                                        ? diff_element_op(d, index++, "add", ca, cb)
+                                        : diff_element_op(d, index++, NULL, ca, cb))
+                                return -1;
+                }
+                i += removed;
+                j += added;
+        }
+        return 0;
+}
+
+static int diff_value(diff d, jsonpg_cursor a, jsonpg_cursor b)
+{
+        if(cursor_equal(a, b))
+                return 0;
+
+        jsonpg_type type = cursor_type(a);
+        if(type == cursor_type(b)) {
+                if(type == JSONPG_BEGIN_OBJECT)
+                        return diff_object(d, a, b);
+                if(type == JSONPG_BEGIN_ARRAY)
+                        return diff_array(d, a, b);
+        }
+        return diff_op(d, "replace", b);
+}
+
+int jsonpg_dom_diff(jsonpg_dom a, jsonpg_dom b, jsonpg_generator g)
+{
+        jsonpg_cursor ra = jsonpg_dom_root(a);
+        jsonpg_cursor rb = jsonpg_dom_root(b);
+        if(ra.at == DOM_NO_POS || rb.at == DOM_NO_POS
+                        || dom_hash_build(a) || dom_hash_build(b))
+                return -1;
+
+        struct diff_s d = {
+                .g = g,
+                .arena = arena_new(a->arena->allocator),
+                .path_size = DIFF_PATH_MIN
+        };
+        if(!d.arena)
+                return -1;
+        d.path = arena_alloc(d.arena, d.path_size);
+
+        int r = !d.path
+                || jsonpg_begin_array(g)
+                || diff_value(&d, ra, rb)
+                || jsonpg_end_array(g)
+                ? -1 : 0;
+        arena_free(d.arena);
+        return r;
+}
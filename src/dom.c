@@ -2,38 +2,151 @@
 
 #define DOM_MIN_SIZE 8192
 #define NODE_SIZE (sizeof(struct dom_node_s))
+#define DOM_BLOCK_SHIFT 32
+#define DOM_MAX_BLOCK UINT32_MAX
+#define DOM_INDEX_MIN 16        // members before an object is indexed
+#define DOM_DELETED (DOM_NO_POS - 1)
 
-typedef struct jsonpg_dom_s *dom_hdr;
 typedef struct dom_node_s *dom_node;
-typedef struct dom_type_s dom_type;
+typedef struct dom_block_s *dom_block;
+typedef struct dom_open_s *dom_open;
+typedef struct dom_index_s *dom_index;
+typedef struct dom_hash_s *dom_hash;
 
+// The DOM is a tape of 8 byte nodes held in a list of blocks
+// Every item starts with a header node, the low 5 bits are the item's
+// kind and the rest hold a length, child count or small integer
+// Items are:
+//   null, false, true, end array/object: header
+//   integer: header holding a 56 bit integer
+//   long, unsigned, real: header, value
+//   number, string: header holding length, bytes
+//   key: header holding length, hash of the key, bytes
+//   short number/string/key: header holding up to 7 bytes
+//   begin array/object: header holding child count, end position
+//   jump: header holding the position to carry on from, see Editing
+// Short strings have their length in the top 3 bits of the header's
+// first byte and their bytes in the remaining 7
+typedef enum {
+        DOM_NULL = 1,
+        DOM_FALSE,
+        DOM_TRUE,
+        DOM_INTEGER,
+        DOM_LONG,
+        DOM_UNSIGNED,
+        DOM_REAL,
+        DOM_NUMBER,
+        DOM_STRING,
+        DOM_KEY,
+        DOM_SHORT_NUMBER,
+        DOM_SHORT_STRING,
+        DOM_SHORT_KEY,
+        DOM_BEGIN_ARRAY,
+        DOM_END_ARRAY,
+        DOM_BEGIN_OBJECT,
+        DOM_END_OBJECT,
+        DOM_JUMP
+} dom_kind;
+
+#define DOM_KIND_MASK   0x1F
+#define DOM_SHORT_SHIFT 5
+#define DOM_SHORT_MAX   7
+#define DOM_HDR_SHIFT   8
+#define DOM_INLINE_MIN  (-(1L << 55))
+#define DOM_INLINE_MAX  ((1L << 55) - 1)
+#define DOM_JUMP_END    ((1UL << 56) - 1)        // jump to the end of the tape
+
+// The header's first byte is its low byte
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The DOM encoding requires a little endian target"
+#endif
+
+static const jsonpg_type dom_types[] = {
+        [DOM_NULL] = JSONPG_NULL,
+        [DOM_FALSE] = JSONPG_FALSE,
+        [DOM_TRUE] = JSONPG_TRUE,
+        [DOM_INTEGER] = JSONPG_INTEGER,
+        [DOM_LONG] = JSONPG_INTEGER,
+        [DOM_UNSIGNED] = JSONPG_UNSIGNED,
+        [DOM_REAL] = JSONPG_REAL,
+        [DOM_NUMBER] = JSONPG_NUMBER,
+        [DOM_STRING] = JSONPG_STRING,
+        [DOM_KEY] = JSONPG_KEY,
+        [DOM_SHORT_NUMBER] = JSONPG_NUMBER,
+        [DOM_SHORT_STRING] = JSONPG_STRING,
+        [DOM_SHORT_KEY] = JSONPG_KEY,
+        [DOM_BEGIN_ARRAY] = JSONPG_BEGIN_ARRAY,
+        [DOM_END_ARRAY] = JSONPG_END_ARRAY,
+        [DOM_BEGIN_OBJECT] = JSONPG_BEGIN_OBJECT,
+        [DOM_END_OBJECT] = JSONPG_END_OBJECT,
+        [DOM_JUMP] = JSONPG_NONE
+};
+
+struct dom_block_s {
+        uint8_t *bytes;
+        size_t count;           // bytes used
+        size_t size;
+        bool shared;            // not ours to free, see domfile.c
+};
+
+// Array or object still being written
+struct dom_open_s {
+        dom_pos begin;
+        size_t children;
+};
+
+// Hash index of the members of an object, built on first lookup
+// The slots are open addressed key positions, DOM_NO_POS if empty
+// and DOM_DELETED if the key has been deleted
+struct dom_index_s {
+        dom_pos object;         // DOM_NO_POS if unused, DOM_DELETED if dropped
+        size_t first;           // first slot in the DOM's slots
+        size_t mask;            // slot count - 1
+        size_t used;            // slots not DOM_NO_POS
+};
+
+// Structural hash of an array or object, see Hashing
+struct dom_hash_s {
+        dom_pos pos;            // DOM_NO_POS if unused
+        uint64_t hash;
+};
 
 struct jsonpg_dom_s {
         arena arena;
-        dom_hdr next;
-        dom_hdr current;
-        size_t count;
-        size_t size;
+        dom_block blocks;       // in tape order
+        size_t block_count;
+        size_t block_size;      // blocks allocated
+        size_t current;         // block being written
+        dom_open open;
+        size_t open_count;
+        size_t open_size;
+        dom_index indexes;      // open addressed by object position
+        size_t index_count;
+        size_t index_size;
+        dom_pos *slots;         // for all indexes
+        size_t slot_count;
+        size_t slot_size;
+        dom_hash hashes;        // open addressed by array or object position
+        size_t hash_count;
+        size_t hash_size;
+        bool hashed;            // every array and object has its hash
+        void *map;              // mapped DOM file, if any
+        size_t map_size;
+        bool edited;            // tape ends with a jump, edits follow it
 };
 
 struct dom_node_s {
         union {
-                jsonpg_type type;
-                size_t count;
+                uint64_t header;
+                uint64_t hash;
                 double real;
                 long integer;
+                unsigned long uinteger;
+                dom_pos pos;
                 uint8_t bytes[sizeof(size_t)];
         } is;
 };
 
-static dom_info dom_parser_info(jsonpg_dom dom)
-{
-        dom_info di;
-        di.hdr = dom;
-        di.offset = sizeof(struct jsonpg_dom_s);
-        return di;
-}
-
 // Ensure all sizes align with structure size
 static size_t dom_size_align(size_t size)
 {
@@ -44,154 +157,458 @@ static size_t dom_size_align(size_t size)
 // Ensure minimum size
 static size_t dom_alloc_size(size_t size)
 {
-        size = size < DOM_MIN_SIZE 
-                ? DOM_MIN_SIZE 
+        size = size < DOM_MIN_SIZE
+                ? DOM_MIN_SIZE
                 : size;
         return dom_size_align(size);
 }
 
-static dom_hdr dom_hdr_new(arena a, size_t size)
+static uint64_t dom_hash_bytes(const uint8_t *bytes, size_t count)
 {
-        size = dom_alloc_size(size + sizeof(struct jsonpg_dom_s));
+        uint64_t h = 0x9E3779B97F4A7C15ULL ^ count;
+        uint64_t w;
+        while(count >= sizeof(w)) {
+                memcpy(&w, bytes, sizeof(w));
+                h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+                h ^= h >> 31;
+                bytes += sizeof(w);
+                count -= sizeof(w);
+        }
+        if(count) {
+                w = 0;
+                memcpy(&w, bytes, count);
+                h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+                h ^= h >> 31;
+        }
+        h *= 0x94D049BB133111EBULL;
+        return h ^ (h >> 32);
+}
 
-        dom_hdr hdr = arena_alloc(a, size);
+static dom_pos dom_pos_make(size_t block, size_t offset)
+{
+        return ((dom_pos)block << DOM_BLOCK_SHIFT) | offset;
+}
 
-        if(!hdr)
-                return NULL;
+static dom_node dom_node_at(jsonpg_dom dom, dom_pos pos)
+{
+        return (dom_node)(dom->blocks[pos >> DOM_BLOCK_SHIFT].bytes
+                        + (uint32_t)pos);
+}
+
+static dom_kind dom_node_kind(dom_node node)
+{
+        return node->is.header & DOM_KIND_MASK;
+}
 
-        hdr->next = NULL;
-        hdr->current = NULL;
-        hdr->size = size;
-        hdr->count = sizeof(struct jsonpg_dom_s);
+static jsonpg_type dom_node_type(dom_node node)
+{
+        return dom_types[dom_node_kind(node)];
+}
 
-        return hdr;
+// Length, child count or integer held in a header
+static uint64_t dom_node_count(dom_node node)
+{
+        return node->is.header >> DOM_HDR_SHIFT;
 }
 
-static dom_node dom_node_next(dom_hdr root, size_t count)
+static jsonpg_string_value dom_node_string(dom_node node)
 {
-        size_t required = dom_size_align(count + 2 * NODE_SIZE);
-        dom_hdr hdr = root->current;
-        if(required > hdr->size - hdr->count) {
-                dom_hdr new = dom_hdr_new(root->arena, required);
+        switch(dom_node_kind(node)) {
+        case DOM_NUMBER:
+        case DOM_STRING:
+                return (jsonpg_string_value){
+                        node[1].is.bytes, dom_node_count(node) };
+        case DOM_KEY:
+                return (jsonpg_string_value){
+                        node[2].is.bytes, dom_node_count(node) };
+        default:
+                return (jsonpg_string_value){
+                        node->is.bytes + 1,
+                        node->is.bytes[0] >> DOM_SHORT_SHIFT };
+        }
+}
 
-                if(!new)
-                        return NULL;
+static uint64_t dom_key_hash(dom_node node)
+{
+        if(dom_node_kind(node) == DOM_KEY)
+                return node[1].is.hash;
+        jsonpg_string_value s = dom_node_string(node);
+        return dom_hash_bytes(s.bytes, s.length);
+}
+
+// Bytes taken by each kind of item, excluding the bytes of
+// long numbers, strings and keys
+static const uint8_t dom_sizes[] = {
+        [DOM_NULL] = NODE_SIZE,
+        [DOM_FALSE] = NODE_SIZE,
+        [DOM_TRUE] = NODE_SIZE,
+        [DOM_INTEGER] = NODE_SIZE,
+        [DOM_LONG] = 2 * NODE_SIZE,
+        [DOM_UNSIGNED] = 2 * NODE_SIZE,
+        [DOM_REAL] = 2 * NODE_SIZE,
+        [DOM_NUMBER] = NODE_SIZE,
+        [DOM_STRING] = NODE_SIZE,
+        [DOM_KEY] = 2 * NODE_SIZE,
+        [DOM_SHORT_NUMBER] = NODE_SIZE,
+        [DOM_SHORT_STRING] = NODE_SIZE,
+        [DOM_SHORT_KEY] = NODE_SIZE,
+        [DOM_BEGIN_ARRAY] = 2 * NODE_SIZE,
+        [DOM_END_ARRAY] = NODE_SIZE,
+        [DOM_BEGIN_OBJECT] = 2 * NODE_SIZE,
+        [DOM_END_OBJECT] = NODE_SIZE,
+        [DOM_JUMP] = NODE_SIZE
+};
+
+// Bytes taken by the item starting at node
+static size_t dom_node_size(dom_node node)
+{
+        dom_kind kind = dom_node_kind(node);
+        size_t size = dom_sizes[kind];
+        if(kind >= DOM_NUMBER && kind <= DOM_KEY)
+                size += dom_size_align(dom_node_count(node));
+        return size;
+}
 
-                hdr->next = new;
-                root->current = new;
-                hdr = new;
+static dom_pos dom_jump_target(dom_node node)
+{
+        uint64_t target = dom_node_count(node);
+        return target == DOM_JUMP_END ? DOM_NO_POS : target;
+}
+
+// Follows any jumps left at pos by edits
+static dom_pos dom_pos_resolve(jsonpg_dom dom, dom_pos pos)
+{
+        dom_node node;
+        while(pos != DOM_NO_POS
+                        && dom_node_kind(node = dom_node_at(dom, pos)) == DOM_JUMP)
+                pos = dom_jump_target(node);
+        return pos;
+}
+
+// Position of the first item at or after offset in block,
+// or DOM_NO_POS at the end of the tape
+// Blocks beyond the last used one may be empty after a reset
+static dom_pos dom_pos_skip(jsonpg_dom dom, size_t block, size_t offset)
+{
+        while(offset >= dom->blocks[block].count) {
+                if(++block >= dom->block_count)
+                        return DOM_NO_POS;
+                offset = 0;
         }
-        size_t offset = hdr->count;
-        hdr->count += required;
-        return (dom_node)(offset + (void *)hdr);
+        return dom_pos_resolve(dom, dom_pos_make(block, offset));
 }
 
-static dom_node dom_add_type(dom_hdr root, jsonpg_type type, size_t count)
+static dom_pos dom_pos_first(jsonpg_dom dom)
 {
-        dom_node node = dom_node_next(root, count);
+        return dom->block_count ? dom_pos_skip(dom, 0, 0) : DOM_NO_POS;
+}
+
+// Position of the item after the one at pos
+static dom_pos dom_pos_next(jsonpg_dom dom, dom_pos pos)
+{
+        return dom_pos_skip(dom,
+                        pos >> DOM_BLOCK_SHIFT,
+                        (uint32_t)pos + dom_node_size(dom_node_at(dom, pos)));
+}
+
+// Position of the item after the value at pos, skipping
+// the contents of an array or object
+static dom_pos dom_pos_after(jsonpg_dom dom, dom_pos pos)
+{
+        dom_node node = dom_node_at(dom, pos);
+        switch(dom_node_kind(node)) {
+        case DOM_BEGIN_ARRAY:
+        case DOM_BEGIN_OBJECT:
+                pos = node[1].is.pos;
+                break;
+        default:
+        }
+        return dom_pos_next(dom, pos);
+}
+
+// Adds a block of at least size bytes after the current one
+// Blocks kept from before a reset are reused if big enough
+// New blocks double in size so that a DOM has few blocks
+static bool dom_block_next(jsonpg_dom dom, size_t size)
+{
+        size_t next = dom->block_count ? dom->current + 1 : 0;
+        if(next < dom->block_count && size <= dom->blocks[next].size) {
+                dom->current = next;
+                return true;
+        }
+
+        if(size > DOM_MAX_BLOCK)
+                return false;
+        if(dom->block_count) {
+                size_t double_size = 2 * dom->blocks[dom->current].size;
+                if(size < double_size)
+                        size = double_size < DOM_MAX_BLOCK 
+                                ? double_size 
+                                : DOM_MAX_BLOCK;
+        }
+        size = dom_alloc_size(size);
+
+        if(dom->block_count == dom->block_size) {
+                size_t block_size = dom->block_size ? 2 * dom->block_size : 8;
+                dom_block blocks = dom->blocks
+                        ? arena_realloc(dom->arena, dom->blocks,
+                                        block_size * sizeof(struct dom_block_s))
+                        : arena_alloc(dom->arena,
+                                        block_size * sizeof(struct dom_block_s));
+                if(!blocks)
+                        return false;
+                dom->blocks = blocks;
+                dom->block_size = block_size;
+        }
+
+        uint8_t *bytes = arena_alloc(dom->arena, size);
+        if(!bytes)
+                return false;
+
+        // Any later blocks are empty so can move along
+        memmove(dom->blocks + next + 1, dom->blocks + next,
+                        (dom->block_count - next) * sizeof(struct dom_block_s));
+        dom->blocks[next] = (struct dom_block_s){
+                .bytes = bytes,
+                .count = 0,
+                .size = size,
+                .shared = false
+        };
+        dom->block_count++;
+        dom->current = next;
+        return true;
+}
+
+// Returns space for an item of size bytes
+static dom_node dom_node_next(jsonpg_dom dom, size_t size)
+{
+        dom_block block = dom->blocks + dom->current;
+        if(!dom->block_count || size > block->size - block->count) {
+                if(!dom_block_next(dom, size))
+                        return NULL;
+                block = dom->blocks + dom->current;
+        }
+        size_t offset = block->count;
+        block->count += size;
+        return (dom_node)(block->bytes + offset);
+}
+
+// Position of a node just added
+static dom_pos dom_pos_added(jsonpg_dom dom, dom_node node)
+{
+        return dom_pos_make(dom->current,
+                        (uint8_t *)node - dom->blocks[dom->current].bytes);
+}
+
+static dom_node dom_add_header(
+                jsonpg_dom dom,
+                dom_kind kind,
+                uint64_t count,
+                size_t size)
+{
+        dom_node node = dom_node_next(dom, size);
         if(!node)
                 return NULL;
-        node->is.type = type;
-        node++;
-        node->is.count = count;
+        node->is.header = kind | count << DOM_HDR_SHIFT;
 
         return node;
 }
 
-static dom_node dom_add_integer(dom_hdr root, long integer)
+// Every value, including arrays and objects, is a child
+// of the enclosing array or object
+static jsonpg_dom dom_add_value(jsonpg_dom dom)
 {
-        dom_node node = dom_add_type(root, JSONPG_INTEGER, NODE_SIZE);
+        if(dom->open_count)
+                dom->open[dom->open_count - 1].children++;
+        return dom;
+}
+
+static dom_node dom_add_integer(jsonpg_dom dom, long integer)
+{
+        if(integer >= DOM_INLINE_MIN && integer <= DOM_INLINE_MAX)
+                return dom_add_header(dom, DOM_INTEGER, integer, NODE_SIZE);
+
+        dom_node node = dom_add_header(dom, DOM_LONG, 0, 2 * NODE_SIZE);
         if(!node)
                 return NULL;
 
-        node++;
-        node->is.integer = integer;
+        node[1].is.integer = integer;
 
         return node;
 }
 
-static dom_node dom_add_real(dom_hdr root, double real)
+static dom_node dom_add_uinteger(jsonpg_dom dom, unsigned long uinteger)
 {
-        dom_node node = dom_add_type(root, JSONPG_REAL, NODE_SIZE);
+        dom_node node = dom_add_header(dom, DOM_UNSIGNED, 0, 2 * NODE_SIZE);
         if(!node)
                 return NULL;
 
-        node++;
-        node->is.real = real;
+        node[1].is.uinteger = uinteger;
 
         return node;
 }
 
-static dom_node dom_add_bytes(dom_hdr root, jsonpg_type type, uint8_t *bytes, size_t count)
+static dom_node dom_add_real(jsonpg_dom dom, double real)
 {
-        dom_node node = dom_add_type(root, type, count);
+        dom_node node = dom_add_header(dom, DOM_REAL, 0, 2 * NODE_SIZE);
         if(!node)
                 return NULL;
 
-        node++;
-        memcpy(node->is.bytes, bytes, count);
+        node[1].is.real = real;
+
+        return node;
+}
+
+// Adds a number, string or key, short ones are kept in the header
+// Keys longer than that are followed by their hash
+static dom_node dom_add_bytes(
+                jsonpg_dom dom, 
+                dom_kind kind, 
+                dom_kind short_kind,
+                uint8_t *bytes, 
+                size_t count)
+{
+        dom_node node;
+        if(count <= DOM_SHORT_MAX) {
+                node = dom_add_header(dom, 0, 0, NODE_SIZE);
+                if(!node)
+                        return NULL;
+                node->is.bytes[0] = short_kind | count << DOM_SHORT_SHIFT;
+                if(count)
+                        memcpy(node->is.bytes + 1, bytes, count);
+                return node;
+        }
+
+        size_t hashed = kind == DOM_KEY;
+        node = dom_add_header(dom, kind, count, 
+                        (1 + hashed) * NODE_SIZE + dom_size_align(count));
+        if(!node)
+                return NULL;
+
+        // Keys are hashed once here for use by any index of the object
+        if(hashed)
+                node[1].is.hash = dom_hash_bytes(bytes, count);
+        memcpy(node[1 + hashed].is.bytes, bytes, count);
+
+        return node;
+}
+
+// Begin nodes are completed by the matching dom_add_end
+static dom_node dom_add_begin(jsonpg_dom dom, dom_kind kind)
+{
+        if(dom->open_count == dom->open_size) {
+                size_t open_size = dom->open_size ? 2 * dom->open_size : 16;
+                dom_open open = dom->open
+                        ? arena_realloc(dom->arena, dom->open,
+                                        open_size * sizeof(struct dom_open_s))
+                        : arena_alloc(dom->arena,
+                                        open_size * sizeof(struct dom_open_s));
+                if(!open)
+                        return NULL;
+                dom->open = open;
+                dom->open_size = open_size;
+        }
+
+        dom_node node = dom_add_header(dom, kind, 0, 2 * NODE_SIZE);
+        if(!node)
+                return NULL;
+
+        node[1].is.pos = DOM_NO_POS;
+        dom->open[dom->open_count++] = (struct dom_open_s){
+                .begin = dom_pos_added(dom, node),
+                .children = 0
+        };
+
+        return node;
+}
+
+static dom_node dom_add_end(jsonpg_dom dom, dom_kind kind)
+{
+        if(!dom->open_count)
+                return NULL;
+
+        dom_node node = dom_add_header(dom, kind, 0, NODE_SIZE);
+        if(!node)
+                return NULL;
+
+        dom_open open = dom->open + --dom->open_count;
+        dom_node begin = dom_node_at(dom, open->begin);
+        begin->is.header |= open->children << DOM_HDR_SHIFT;
+        begin[1].is.pos = dom_pos_added(dom, node);
 
         return node;
 }
 
 static int dom_boolean(void *ctx, bool is_true)
 {
-        dom_hdr root = ctx;
-        return !dom_add_type(root, is_true ? JSONPG_TRUE : JSONPG_FALSE, 0);
+        jsonpg_dom dom = dom_add_value(ctx);
+        return !dom_add_header(dom, is_true ? DOM_TRUE : DOM_FALSE, 0, NODE_SIZE);
 }
 
 static int dom_null(void *ctx)
 {
-        dom_hdr root = ctx;
-        return !dom_add_type(root, JSONPG_NULL, 0);
+        jsonpg_dom dom = dom_add_value(ctx);
+        return !dom_add_header(dom, DOM_NULL, 0, NODE_SIZE);
 }
 
 static int dom_integer(void *ctx, long integer)
 {
-        dom_hdr root = ctx;
-        return !dom_add_integer(root, integer);
+        jsonpg_dom dom = dom_add_value(ctx);
+        return !dom_add_integer(dom, integer);
+}
+
+static int dom_uinteger(void *ctx, unsigned long uinteger)
+{
+        jsonpg_dom dom = dom_add_value(ctx);
+        return !dom_add_uinteger(dom, uinteger);
 }
 
 static int dom_real(void *ctx, double real)
 {
-        dom_hdr root = ctx;
-        return !dom_add_real(root, real);
+        jsonpg_dom dom = dom_add_value(ctx);
+        return !dom_add_real(dom, real);
+}
+
+static int dom_number(void *ctx, uint8_t *bytes, size_t count)
+{
+        jsonpg_dom dom = dom_add_value(ctx);
+        return !dom_add_bytes(dom, DOM_NUMBER, DOM_SHORT_NUMBER, bytes, count);
 }
 
 static int dom_string(void *ctx, uint8_t *bytes, size_t count)
 {
-        dom_hdr root = ctx;
-        return !dom_add_bytes(root, JSONPG_STRING, bytes, count);
+        jsonpg_dom dom = dom_add_value(ctx);
+        return !dom_add_bytes(dom, DOM_STRING, DOM_SHORT_STRING, bytes, count);
 }
 
 static int dom_key(void *ctx, uint8_t *bytes, size_t count)
 {
-        dom_hdr root = ctx;
-        return !dom_add_bytes(root, JSONPG_KEY, bytes, count);
+        jsonpg_dom dom = ctx;
+        return !dom_add_bytes(dom, DOM_KEY, DOM_SHORT_KEY, bytes, count);
 }
 
 static int dom_begin_array(void *ctx)
 {
-        dom_hdr root = ctx;
-        return !dom_add_type(root, JSONPG_BEGIN_ARRAY, 0);
+        jsonpg_dom dom = dom_add_value(ctx);
+        return !dom_add_begin(dom, DOM_BEGIN_ARRAY);
 }
 
 static int dom_end_array(void *ctx)
 {
-        dom_hdr root = ctx;
-        return !dom_add_type(root, JSONPG_END_ARRAY, 0);
+        jsonpg_dom dom = ctx;
+        return !dom_add_end(dom, DOM_END_ARRAY);
 }
 
 static int dom_begin_object(void *ctx)
 {
-        dom_hdr root = ctx;
-        return !dom_add_type(root, JSONPG_BEGIN_OBJECT, 0);
+        jsonpg_dom dom = dom_add_value(ctx);
+        return !dom_add_begin(dom, DOM_BEGIN_OBJECT);
 }
 
 static int dom_end_object(void *ctx)
 {
-        dom_hdr root = ctx;
-        return !dom_add_type(root, JSONPG_END_OBJECT, 0);
+        jsonpg_dom dom = ctx;
+        return !dom_add_end(dom, DOM_END_OBJECT);
 }
 
 
@@ -199,7 +616,9 @@ static jsonpg_callbacks dom_callbacks = {
         .boolean = dom_boolean,
         .null = dom_null,
         .integer = dom_integer,
+        .uinteger = dom_uinteger,
         .real = dom_real,
+        .number = dom_number,
         .string = dom_string,
         .key = dom_key,
         .begin_array = dom_begin_array,
@@ -208,15 +627,14 @@ static jsonpg_callbacks dom_callbacks = {
         .end_object = dom_end_object,
 };
 
-jsonpg_dom dom_new(arena a, size_t size)
+static jsonpg_dom dom_new(arena a)
 {
-        jsonpg_dom root = dom_hdr_new(a, size);
-        if(!root)
+        jsonpg_dom dom = arena_alloc(a, sizeof(struct jsonpg_dom_s));
+        if(!dom)
                 return NULL;
 
-        root->arena = a;
-        root->current = root;
-        return root;
+        *dom = (struct jsonpg_dom_s){ .arena = a };
+        return dom;
 }
 
 jsonpg_dom jsonpg_result_dom(jsonpg_generator g)
@@ -224,54 +642,1269 @@ jsonpg_dom jsonpg_result_dom(jsonpg_generator g)
         return g->ctx;
 }
 
+// Drops all object indexes, they are rebuilt when next needed
+static void dom_index_clear(jsonpg_dom dom)
+{
+        for(size_t i = 0 ; i < dom->index_size ; i++)
+                dom->indexes[i].object = DOM_NO_POS;
+        dom->index_count = 0;
+        dom->slot_count = 0;
+}
+
+// Drops all hashes, any edit can change them
+static void dom_hash_clear(jsonpg_dom dom)
+{
+        if(dom->hashes)
+                arena_dealloc(dom->arena, dom->hashes);
+        dom->hashes = NULL;
+        dom->hash_count = 0;
+        dom->hash_size = 0;
+        dom->hashed = false;
+}
+
+/*
+ * Empties a DOM generator's DOM, keeping its blocks for reuse
+ */
+static void dom_generator_reset(jsonpg_generator g)
+{
+        if(g->callbacks != &dom_callbacks)
+                return;
+
+        jsonpg_dom dom = g->ctx;
+        for(size_t i = 0 ; i < dom->block_count ; i++)
+                dom->blocks[i].count = 0;
+        dom->current = 0;
+        dom->open_count = 0;
+        dom->edited = false;
+        dom_index_clear(dom);
+        dom_hash_clear(dom);
+}
+
 static jsonpg_generator dom_generator(jsonpg_generator g)
 {
-        jsonpg_dom root = dom_new(g->arena, 0);
-        if(!root)
+        jsonpg_dom dom = dom_new(g->arena);
+        if(!dom) {
+                jsonpg_generator_free(g);
                 return NULL;
+        }
 
-        return generator_set_callbacks(g, &dom_callbacks, root);
+        return generator_set_callbacks(g, &dom_callbacks, dom);
 }
 
-static jsonpg_type dom_parse_next(jsonpg_parser p)
+// Bytes used by a DOM's items
+static size_t dom_size(jsonpg_dom dom)
+{
+        size_t size = 0;
+        for(size_t i = 0 ; i < dom->block_count ; i++)
+                size += dom->blocks[i].count;
+        return size;
+}
+
+// JSON input of count bytes usually needs less DOM than this
+#define DOM_ESTIMATE(count) ((count) + (count) / 2)
+
+/*
+ * Makes the first block of an empty DOM at least size bytes
+ * so that all of a DOM of known size is in one block
+ * If memory cannot be allocated then the DOM grows as usual
+ */
+static void dom_reserve(jsonpg_dom dom, size_t size)
 {
-        jsonpg_dom hdr = p->dom_info.hdr;
-        size_t offset = p->dom_info.offset;
+        if(!size || (dom->block_count && (dom->current || dom->blocks[0].count)))
+                return;
 
-        if(offset >= hdr->count) {
-                hdr = hdr->next;
-                if(!hdr)
-                        return JSONPG_EOF;
-                offset = sizeof(struct jsonpg_dom_s);
+        size = dom_alloc_size(size < DOM_MAX_BLOCK ? size : DOM_MAX_BLOCK);
+        if(!dom->block_count) {
+                dom_block_next(dom, size);
+        } else if(size > dom->blocks[0].size) {
+                uint8_t *bytes = arena_realloc(dom->arena, dom->blocks[0].bytes, size);
+                if(bytes) {
+                        dom->blocks[0].bytes = bytes;
+                        dom->blocks[0].size = size;
+                }
         }
+}
 
-        dom_node node = (dom_node)(offset + (void *)hdr);
-        offset += NODE_SIZE;
-        jsonpg_type type = node->is.type;
-        node++;
-        offset += NODE_SIZE;
-        size_t count = node->is.count;
-        switch(type) {
-        case JSONPG_INTEGER:
-                node++;
-                offset += NODE_SIZE;
-                p->result.number.integer = node->is.integer;
+/*
+ * Copies all of a DOM's items into a single block of the right size,
+ * or trims the first block if they are all there already,
+ * and frees all other blocks
+ * Items are copied in tape order, following any jumps, so anything
+ * left behind by edits is dropped
+ * Positions held in items, object indexes and containers still being
+ * written are all updated to match
+ */
+int jsonpg_dom_compact(jsonpg_dom dom)
+{
+        if(!dom->block_count)
+                return 0;
+
+        size_t size = dom_size(dom);
+        if(size > DOM_MAX_BLOCK)
+                return -1;
+
+        // Already in one block of our own, just trim it
+        if(size == dom->blocks[0].count && !dom->blocks[0].shared && !dom->edited) {
+                if(size && size < dom->blocks[0].size) {
+                        uint8_t *bytes = arena_realloc(dom->arena,
+                                        dom->blocks[0].bytes, size);
+                        if(!bytes)
+                                return -1;
+                        dom->blocks[0].bytes = bytes;
+                        dom->blocks[0].size = size;
+                }
+                for(size_t i = 1 ; i < dom->block_count ; i++)
+                        if(!dom->blocks[i].shared)
+                                arena_dealloc(dom->arena, dom->blocks[i].bytes);
+                dom->block_count = 1;
+                dom->current = 0;
+                return 0;
+        }
+
+        // Offsets of the begin nodes of containers not yet ended
+        size_t begin_size = 64;
+        size_t begin_count = 0;
+        size_t *begins = arena_alloc(dom->arena, begin_size * sizeof(size_t));
+        uint8_t *bytes = arena_alloc(dom->arena, size ? size : NODE_SIZE);
+        if(!begins || !bytes)
+                goto fail;
+
+        size_t count = 0;
+        for(dom_pos pos = dom_pos_first(dom) ; pos != DOM_NO_POS ; pos = dom_pos_next(dom, pos)) {
+                dom_node node = dom_node_at(dom, pos);
+                size_t n = dom_node_size(node);
+                memcpy(bytes + count, node, n);
+                switch(dom_node_kind(node)) {
+                case DOM_BEGIN_ARRAY:
+                case DOM_BEGIN_OBJECT:
+                        if(begin_count == begin_size) {
+                                size_t *b = arena_realloc(dom->arena, begins,
+                                                2 * begin_size * sizeof(size_t));
+                                if(!b)
+                                        goto fail;
+                                begins = b;
+                                begin_size *= 2;
+                        }
+                        begins[begin_count++] = count;
+                        break;
+                case DOM_END_ARRAY:
+                case DOM_END_OBJECT:
+                        ((dom_node)(bytes + begins[--begin_count]))[1].is.pos = count;
+                        break;
+                default:
+                }
+                count += n;
+        }
+
+        // Containers not ended are those still being written
+        for(size_t i = 0 ; i < dom->open_count ; i++)
+                dom->open[i].begin = begins[i];
+        dom_index_clear(dom);
+        dom_hash_clear(dom);
+
+        for(size_t i = 0 ; i < dom->block_count ; i++)
+                if(!dom->blocks[i].shared)
+                        arena_dealloc(dom->arena, dom->blocks[i].bytes);
+        arena_dealloc(dom->arena, begins);
+
+        // Less is used if edits left items behind
+        size_t used = count ? count : NODE_SIZE;
+        if(used < size) {
+                uint8_t *trimmed = arena_realloc(dom->arena, bytes, used);
+                if(trimmed) {
+                        bytes = trimmed;
+                        size = used;
+                }
+        }
+
+        dom->blocks[0] = (struct dom_block_s){
+                .bytes = bytes,
+                .count = count,
+                .size = size ? size : NODE_SIZE,
+                .shared = false
+        };
+        dom->block_count = 1;
+        dom->current = 0;
+        dom->edited = false;
+
+        return 0;
+
+fail:
+        if(bytes)
+                arena_dealloc(dom->arena, bytes);
+        if(begins)
+                arena_dealloc(dom->arena, begins);
+        return -1;
+}
+
+static dom_info dom_parser_info(jsonpg_dom dom)
+{
+        dom_info di;
+        di.dom = dom;
+        di.pos = dom_pos_first(dom);
+        return di;
+}
+
+// The value of the item at node
+static jsonpg_value dom_node_value(dom_node node)
+{
+        jsonpg_value value;
+        dom_kind kind = dom_node_kind(node);
+        value.type = dom_types[kind];
+        switch(kind) {
+        case DOM_INTEGER:
+                value.number.integer = (int64_t)node->is.header >> DOM_HDR_SHIFT;
                 break;
-        case JSONPG_REAL:
-                node++;
-                offset += NODE_SIZE;
-                p->result.number.real = node->is.real;
+        case DOM_LONG:
+                value.number.integer = node[1].is.integer;
+                break;
+        case DOM_UNSIGNED:
+                value.number.uinteger = node[1].is.uinteger;
+                break;
+        case DOM_REAL:
+                value.number.real = node[1].is.real;
                 break;
+        case DOM_NUMBER:
+        case DOM_STRING:
+        case DOM_KEY:
+        case DOM_SHORT_NUMBER:
+        case DOM_SHORT_STRING:
+        case DOM_SHORT_KEY:
+                value.string = dom_node_string(node);
+                break;
+        default:
+        }
+        return value;
+}
+
+static jsonpg_type dom_parse_next(jsonpg_parser p)
+{
+        jsonpg_dom dom = p->dom_info.dom;
+        dom_pos pos = p->dom_info.pos;
+        if(!dom || pos == DOM_NO_POS)
+                return JSONPG_EOF;
+
+        p->result = dom_node_value(dom_node_at(dom, pos));
+        p->dom_info.pos = dom_pos_next(dom, pos);
+        return p->result.type;
+}
+
+/*
+ * Cursors
+ *
+ * A cursor is the position of a value and, for object members,
+ * the position of its key. Arrays and objects record the position
+ * of their end so moving to the next value is O(1)
+ */
+
+static jsonpg_cursor cursor_none(jsonpg_dom dom)
+{
+        return (jsonpg_cursor){ .dom = dom, .at = DOM_NO_POS, .key = DOM_NO_POS };
+}
+
+// The cursor for the member or element at pos, if any
+static jsonpg_cursor cursor_at(jsonpg_dom dom, dom_pos pos)
+{
+        if(pos == DOM_NO_POS)
+                return cursor_none(dom);
+
+        switch(dom_node_type(dom_node_at(dom, pos))) {
+        case JSONPG_END_ARRAY:
+        case JSONPG_END_OBJECT:
+                return cursor_none(dom);
+        case JSONPG_KEY:
+                return (jsonpg_cursor){
+                        .dom = dom,
+                        .at = dom_pos_next(dom, pos),
+                        .key = pos
+                };
+        default:
+                return (jsonpg_cursor){ .dom = dom, .at = pos, .key = DOM_NO_POS };
+        }
+}
+
+jsonpg_cursor jsonpg_dom_root(jsonpg_dom dom)
+{
+        return cursor_at(dom, dom_pos_first(dom));
+}
+
+// A value replaced by an edit leaves a jump to its replacement
+// Public functions resolve a cursor once, cursors made here from
+// positions on the tape are already resolved
+static jsonpg_cursor cursor_resolve(jsonpg_cursor c)
+{
+        c.at = dom_pos_resolve(c.dom, c.at);
+        return c;
+}
+
+static jsonpg_type cursor_type(jsonpg_cursor c)
+{
+        return c.at == DOM_NO_POS
+                ? JSONPG_NONE
+                : dom_node_type(dom_node_at(c.dom, c.at));
+}
+
+static size_t cursor_count(jsonpg_cursor c)
+{
+        switch(cursor_type(c)) {
+        case JSONPG_BEGIN_ARRAY:
+        case JSONPG_BEGIN_OBJECT:
+                return dom_node_count(dom_node_at(c.dom, c.at));
+        default:
+                return 0;
+        }
+}
+
+static jsonpg_cursor cursor_first(jsonpg_cursor c)
+{
+        switch(cursor_type(c)) {
+        case JSONPG_BEGIN_ARRAY:
+        case JSONPG_BEGIN_OBJECT:
+                return cursor_at(c.dom, dom_pos_next(c.dom, c.at));
+        default:
+                return cursor_none(c.dom);
+        }
+}
+
+static jsonpg_cursor cursor_next(jsonpg_cursor c)
+{
+        if(c.at == DOM_NO_POS)
+                return c;
+
+        return cursor_at(c.dom, dom_pos_after(c.dom, c.at));
+}
+
+static jsonpg_cursor cursor_index(jsonpg_cursor c, size_t index)
+{
+        if(index >= cursor_count(c))
+                return cursor_none(c.dom);
+
+        c = cursor_first(c);
+        while(index--)
+                c = cursor_next(c);
+        return c;
+}
+
+jsonpg_type jsonpg_cursor_type(jsonpg_cursor c)
+{
+        return cursor_type(cursor_resolve(c));
+}
+
+jsonpg_value jsonpg_cursor_value(jsonpg_cursor c)
+{
+        c = cursor_resolve(c);
+        return c.at == DOM_NO_POS
+                ? (jsonpg_value){ .type = JSONPG_NONE }
+                : dom_node_value(dom_node_at(c.dom, c.at));
+}
+
+jsonpg_string_value jsonpg_cursor_key(jsonpg_cursor c)
+{
+        return c.key == DOM_NO_POS
+                ? (jsonpg_string_value){}
+                : dom_node_string(dom_node_at(c.dom, c.key));
+}
+
+size_t jsonpg_cursor_count(jsonpg_cursor c)
+{
+        return cursor_count(cursor_resolve(c));
+}
+
+jsonpg_cursor jsonpg_cursor_first(jsonpg_cursor c)
+{
+        return cursor_first(cursor_resolve(c));
+}
+
+jsonpg_cursor jsonpg_cursor_next(jsonpg_cursor c)
+{
+        return cursor_next(cursor_resolve(c));
+}
+
+jsonpg_cursor jsonpg_cursor_index(jsonpg_cursor c, size_t index)
+{
+        return cursor_index(cursor_resolve(c), index);
+}
+
+/*
+ * Object indexes
+ *
+ * Objects with at least DOM_INDEX_MIN members get a hash index the
+ * first time a key is looked up in them. Indexes are kept outside the
+ * tape, found by object position, so the tape is the same whether
+ * or not an object has been indexed
+ */
+
+static size_t dom_pos_hash(dom_pos pos)
+{
+        return (pos * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static bool dom_key_equal(dom_node node, uint8_t *key, size_t length)
+{
+        jsonpg_string_value s = dom_node_string(node);
+        return s.length == length && (!length || !memcmp(s.bytes, key, length));
+}
+
+// Only long keys have a hash to compare first
+static bool dom_key_hash_equal(
+                dom_node node, 
+                uint64_t hash, 
+                uint8_t *key, 
+                size_t length)
+{
+        return (dom_node_kind(node) != DOM_KEY || node[1].is.hash == hash)
+                && dom_key_equal(node, key, length);
+}
+
+static dom_index dom_index_find(jsonpg_dom dom, dom_pos object)
+{
+        if(!dom->index_count)
+                return NULL;
+
+        size_t mask = dom->index_size - 1;
+        for(size_t i = dom_pos_hash(object) & mask ; ; i = (i + 1) & mask) {
+                dom_index ix = dom->indexes + i;
+                if(ix->object == object)
+                        return ix;
+                if(ix->object == DOM_NO_POS)
+                        return NULL;
+        }
+}
+
+// Returns an unused entry for object, growing the table if needed
+static dom_index dom_index_add(jsonpg_dom dom, dom_pos object)
+{
+        if(2 * (dom->index_count + 1) > dom->index_size) {
+                size_t index_size = dom->index_size ? 2 * dom->index_size : 16;
+                dom_index indexes = arena_alloc(dom->arena,
+                                index_size * sizeof(struct dom_index_s));
+                if(!indexes)
+                        return NULL;
+                for(size_t i = 0 ; i < index_size ; i++)
+                        indexes[i].object = DOM_NO_POS;
+
+                dom_index old = dom->indexes;
+                size_t old_size = dom->index_size;
+                dom->indexes = indexes;
+                dom->index_size = index_size;
+                dom->index_count = 0;
+                for(size_t i = 0 ; i < old_size ; i++)
+                        if(old[i].object != DOM_NO_POS && old[i].object != DOM_DELETED)
+                                *dom_index_add(dom, old[i].object) = old[i];
+                if(old)
+                        arena_dealloc(dom->arena, old);
+        }
+
+        size_t mask = dom->index_size - 1;
+        size_t i = dom_pos_hash(object) & mask;
+        while(dom->indexes[i].object != DOM_NO_POS)
+                i = (i + 1) & mask;
+        dom->index_count++;
+        dom->indexes[i].object = object;
+        return dom->indexes + i;
+}
+
+static dom_index dom_index_build(jsonpg_cursor c, size_t count)
+{
+        jsonpg_dom dom = c.dom;
+        size_t size = 2 * DOM_INDEX_MIN;
+        while(size < 2 * count)
+                size <<= 1;
+
+        if(dom->slot_count + size > dom->slot_size) {
+                size_t slot_size = dom->slot_size ? dom->slot_size : 1024;
+                while(slot_size < dom->slot_count + size)
+                        slot_size <<= 1;
+                dom_pos *slots = dom->slots
+                        ? arena_realloc(dom->arena, dom->slots,
+                                        slot_size * sizeof(dom_pos))
+                        : arena_alloc(dom->arena, slot_size * sizeof(dom_pos));
+                if(!slots)
+                        return NULL;
+                dom->slots = slots;
+                dom->slot_size = slot_size;
+        }
+
+        dom_index ix = dom_index_add(dom, c.at);
+        if(!ix)
+                return NULL;
+
+        ix->first = dom->slot_count;
+        ix->mask = size - 1;
+        ix->used = 0;
+        dom->slot_count += size;
+
+        dom_pos *slots = dom->slots + ix->first;
+        for(size_t i = 0 ; i < size ; i++)
+                slots[i] = DOM_NO_POS;
+
+        for(c = cursor_first(c) ; c.at != DOM_NO_POS ; c = cursor_next(c)) {
+                dom_node node = dom_node_at(dom, c.key);
+                uint64_t hash = dom_key_hash(node);
+                jsonpg_string_value key = dom_node_string(node);
+                size_t i = hash & ix->mask;
+                while(slots[i] != DOM_NO_POS) {
+                        // Only the first of duplicate keys is found
+                        if(dom_key_hash_equal(dom_node_at(dom, slots[i]),
+                                        hash, key.bytes, key.length))
+                                break;
+                        i = (i + 1) & ix->mask;
+                }
+                if(slots[i] == DOM_NO_POS) {
+                        slots[i] = c.key;
+                        ix->used++;
+                }
+        }
+
+        return ix;
+}
+
+static jsonpg_cursor cursor_get(jsonpg_cursor c, uint8_t *key, size_t length)
+{
+        if(cursor_type(c) != JSONPG_BEGIN_OBJECT)
+                return cursor_none(c.dom);
+
+        jsonpg_dom dom = c.dom;
+        size_t count = cursor_count(c);
+        if(count >= DOM_INDEX_MIN) {
+                uint64_t hash = dom_hash_bytes(key, length);
+                dom_index ix = dom_index_find(dom, c.at);
+                if(!ix)
+                        ix = dom_index_build(c, count);
+                // Without memory for an index the members are searched
+                if(ix) {
+                        dom_pos *slots = dom->slots + ix->first;
+                        size_t i = hash & ix->mask;
+                        while(slots[i] != DOM_NO_POS) {
+                                if(slots[i] != DOM_DELETED
+                                                && dom_key_hash_equal(
+                                                        dom_node_at(dom, slots[i]),
+                                                        hash, key, length))
+                                        return cursor_at(dom, slots[i]);
+                                i = (i + 1) & ix->mask;
+                        }
+                        return cursor_none(dom);
+                }
+        }
+
+        for(c = cursor_first(c) ; c.at != DOM_NO_POS ; c = cursor_next(c)) {
+                if(dom_key_equal(dom_node_at(dom, c.key), key, length))
+                        break;
+        }
+        return c;
+}
+
+jsonpg_cursor jsonpg_cursor_get(jsonpg_cursor c, uint8_t *key, size_t length)
+{
+        return cursor_get(cursor_resolve(c), key, length);
+}
+
+/*
+ * Comparison
+ *
+ * Values are equal as JSON: numbers by value whatever their
+ * representation, objects regardless of the order of their members
+ */
+
+// Unconverted numbers are converted, or left as text if they cannot be
+static jsonpg_value dom_number_value(jsonpg_value v)
+{
+        if(v.type == JSONPG_NUMBER) {
+                jsonpg_value n = jsonpg_convert_number(v.string.bytes, v.string.length);
+                if(n.type != JSONPG_ERROR)
+                        return n;
+        }
+        return v;
+}
+
+// A converted number as a real
+static double dom_number_real(jsonpg_value v)
+{
+        return v.type == JSONPG_REAL ? v.number.real
+                : v.type == JSONPG_INTEGER ? (double)v.number.integer
+                : (double)v.number.uinteger;
+}
+
+// Integers above 2^53 do not all convert to a real exactly, so the
+// real has to be a whole number in range to compare them as integers
+static bool dom_real_integer_equal(double real, jsonpg_value v)
+{
+        if(v.type == JSONPG_INTEGER)
+                return real >= -0x1p63 && real < 0x1p63
+                        && real == (double)(long)real
+                        && (long)real == v.number.integer;
+        return real >= 0 && real < 0x1p64
+                && real == (double)(unsigned long)real
+                && (unsigned long)real == v.number.uinteger;
+}
+
+static bool dom_number_equal(jsonpg_value a, jsonpg_value b)
+{
+        a = dom_number_value(a);
+        b = dom_number_value(b);
+        if(a.type == JSONPG_NUMBER || b.type == JSONPG_NUMBER)
+                return a.type == b.type
+                        && a.string.length == b.string.length
+                        && !memcmp(a.string.bytes, b.string.bytes, a.string.length);
+        if(a.type == JSONPG_REAL && b.type == JSONPG_REAL)
+                return a.number.real == b.number.real;
+        if(a.type == JSONPG_REAL)
+                return dom_real_integer_equal(a.number.real, b);
+        if(b.type == JSONPG_REAL)
+                return dom_real_integer_equal(b.number.real, a);
+        // Unsigned values are all greater than any integer
+        return a.type == b.type && a.number.integer == b.number.integer;
+}
+
+static bool dom_is_number(jsonpg_type type)
+{
+        return type >= JSONPG_INTEGER && type <= JSONPG_NUMBER;
+}
+
+static bool cursor_equal(jsonpg_cursor a, jsonpg_cursor b);
+static bool cursor_hash_differs(jsonpg_cursor a, jsonpg_cursor b);
+
+// Members in the same order are compared without lookups, the rest
+// by key where only the first of duplicate keys counts, so every key
+// in b must also be in a and the objects may have different counts
+static bool cursor_object_equal(jsonpg_cursor a, jsonpg_cursor b)
+{
+        jsonpg_cursor m = cursor_first(a);
+        jsonpg_cursor n = cursor_first(b);
+        for( ; m.at != DOM_NO_POS && n.at != DOM_NO_POS ;
+                        m = cursor_next(m), n = cursor_next(n)) {
+                jsonpg_string_value key = jsonpg_cursor_key(m);
+                if(!dom_key_equal(dom_node_at(b.dom, n.key), key.bytes, key.length))
+                        break;
+                if(!cursor_equal(m, n))
+                        return false;
+        }
+        for( ; m.at != DOM_NO_POS ; m = cursor_next(m)) {
+                jsonpg_string_value key = jsonpg_cursor_key(m);
+                if(cursor_get(a, key.bytes, key.length).at != m.at)
+                        continue;
+                jsonpg_cursor v = cursor_get(b, key.bytes, key.length);
+                if(v.at == DOM_NO_POS || !cursor_equal(m, v))
+                        return false;
+        }
+        for( ; n.at != DOM_NO_POS ; n = cursor_next(n)) {
+                jsonpg_string_value key = jsonpg_cursor_key(n);
+                if(cursor_get(a, key.bytes, key.length).at == DOM_NO_POS)
+                        return false;
+        }
+        return true;
+}
+
+static bool cursor_equal(jsonpg_cursor a, jsonpg_cursor b)
+{
+        jsonpg_value va = dom_node_value(dom_node_at(a.dom, a.at));
+        jsonpg_value vb = dom_node_value(dom_node_at(b.dom, b.at));
+        if(dom_is_number(va.type) && dom_is_number(vb.type))
+                return dom_number_equal(va, vb);
+        if(va.type != vb.type)
+                return false;
+
+        switch(va.type) {
+        case JSONPG_STRING:
+                return va.string.length == vb.string.length
+                        && !memcmp(va.string.bytes, vb.string.bytes, va.string.length);
+        case JSONPG_BEGIN_ARRAY:
+                if(cursor_count(a) != cursor_count(b) || cursor_hash_differs(a, b))
+                        return false;
+                for(a = cursor_first(a), b = cursor_first(b) ;
+                                a.at != DOM_NO_POS ; 
+                                a = cursor_next(a), b = cursor_next(b))
+                        if(!cursor_equal(a, b))
+                                return false;
+                return true;
+        case JSONPG_BEGIN_OBJECT:
+                // Counts include later duplicate keys, which do not count
+                if(cursor_hash_differs(a, b))
+                        return false;
+                return cursor_object_equal(a, b);
+        default:
+                return true;
+        }
+}
+
+/*
+ * Hashing
+ *
+ * Values that are equal have the same hash: numbers are hashed by
+ * their value as a real and objects by a sum over their members, so
+ * the order of the members does not matter, skipping later members
+ * with a key that is already in the object
+ * Hashing a DOM stores the hash of each array and object outside the
+ * tape, found by position like object indexes. Editing the DOM drops
+ * them, they are only rebuilt by hashing it again
+ * Comparing arrays or objects that both have stored hashes only looks
+ * inside them if their hashes are the same
+ */
+
+static uint64_t dom_hash_mix(uint64_t h)
+{
+        h ^= h >> 30;
+        h *= 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 27;
+        h *= 0x94D049BB133111EBULL;
+        return h ^ (h >> 31);
+}
+
+static uint64_t dom_scalar_hash(dom_node node)
+{
+        jsonpg_value v = dom_node_value(node);
+        if(dom_is_number(v.type))
+                v = dom_number_value(v);
+
+        double real;
+        uint64_t bits;
+        switch(v.type) {
         case JSONPG_STRING:
+        case JSONPG_NUMBER:
+                return dom_hash_mix(v.type
+                                ^ dom_hash_bytes(v.string.bytes, v.string.length));
+        case JSONPG_INTEGER:
+        case JSONPG_UNSIGNED:
+        case JSONPG_REAL:
+                real = dom_number_real(v);
+                if(real == 0)
+                        real = 0;       // -0 == 0
+                memcpy(&bits, &real, sizeof(bits));
+                return dom_hash_mix(JSONPG_REAL ^ bits);
+        default:
+                return dom_hash_mix(v.type);
+        }
+}
+
+static dom_hash dom_hash_find(jsonpg_dom dom, dom_pos pos)
+{
+        if(!dom->hash_count)
+                return NULL;
+
+        size_t mask = dom->hash_size - 1;
+        for(size_t i = dom_pos_hash(pos) & mask ; ; i = (i + 1) & mask) {
+                dom_hash h = dom->hashes + i;
+                if(h->pos == pos)
+                        return h;
+                if(h->pos == DOM_NO_POS)
+                        return NULL;
+        }
+}
+
+static bool dom_hash_add(jsonpg_dom dom, dom_pos pos, uint64_t hash)
+{
+        if(2 * (dom->hash_count + 1) > dom->hash_size) {
+                size_t hash_size = dom->hash_size ? 2 * dom->hash_size : 64;
+                dom_hash hashes = arena_alloc(dom->arena,
+                                hash_size * sizeof(struct dom_hash_s));
+                if(!hashes)
+                        return false;
+                for(size_t i = 0 ; i < hash_size ; i++)
+                        hashes[i].pos = DOM_NO_POS;
+
+                dom_hash old = dom->hashes;
+                size_t old_size = dom->hash_size;
+                dom->hashes = hashes;
+                dom->hash_size = hash_size;
+                dom->hash_count = 0;
+                for(size_t i = 0 ; i < old_size ; i++)
+                        if(old[i].pos != DOM_NO_POS)
+                                dom_hash_add(dom, old[i].pos, old[i].hash);
+                if(old)
+                        arena_dealloc(dom->arena, old);
+        }
+
+        size_t mask = dom->hash_size - 1;
+        size_t i = dom_pos_hash(pos) & mask;
+        while(dom->hashes[i].pos != DOM_NO_POS)
+                i = (i + 1) & mask;
+        dom->hash_count++;
+        dom->hashes[i] = (struct dom_hash_s){ .pos = pos, .hash = hash };
+        return true;
+}
+
+static uint64_t cursor_hash(jsonpg_cursor c);
+
+// Hashes an array or object from the hashes of its values, storing
+// its hash and the hashes of all arrays and objects in it if store
+static bool dom_hash_container(jsonpg_cursor c, bool store, uint64_t *hash)
+{
+        jsonpg_type type = cursor_type(c);
+        uint64_t h = 0;
+        for(jsonpg_cursor m = cursor_first(c) ; m.at != DOM_NO_POS ; m = cursor_next(m)) {
+                uint64_t v;
+                jsonpg_type t = cursor_type(m);
+                if(!store || (t != JSONPG_BEGIN_ARRAY && t != JSONPG_BEGIN_OBJECT))
+                        v = cursor_hash(m);
+                else if(!dom_hash_container(m, true, &v))
+                        return false;
+
+                if(type == JSONPG_BEGIN_ARRAY) {
+                        h = dom_hash_mix(h ^ v);
+                        continue;
+                }
+                // Only the first of duplicate keys counts, as in equality
+                jsonpg_string_value key = jsonpg_cursor_key(m);
+                if(cursor_get(c, key.bytes, key.length).at == m.at)
+                        h += dom_hash_mix(dom_key_hash(dom_node_at(c.dom, m.key))
+                                        ^ dom_hash_mix(v));
+        }
+
+        h = dom_hash_mix(h ^ type);
+        if(store && !dom_hash_add(c.dom, c.at, h))
+                return false;
+        *hash = h;
+        return true;
+}
+
+// Hash of the value at a cursor, arrays and objects in a DOM that
+// has not been hashed are hashed from all of their values
+static uint64_t cursor_hash(jsonpg_cursor c)
+{
+        jsonpg_type type = cursor_type(c);
+        if(type != JSONPG_BEGIN_ARRAY && type != JSONPG_BEGIN_OBJECT)
+                return dom_scalar_hash(dom_node_at(c.dom, c.at));
+
+        uint64_t h;
+        dom_hash stored = dom_hash_find(c.dom, c.at);
+        if(stored)
+                return stored->hash;
+        dom_hash_container(c, false, &h);
+        return h;
+}
+
+// Stores the hash of every array and object in a complete DOM
+static int dom_hash_build(jsonpg_dom dom)
+{
+        if(dom->open_count)
+                return -1;
+        if(dom->hashed)
+                return 0;
+
+        uint64_t h;
+        jsonpg_cursor root = jsonpg_dom_root(dom);
+        jsonpg_type type = cursor_type(root);
+        if((type == JSONPG_BEGIN_ARRAY || type == JSONPG_BEGIN_OBJECT)
+                        && !dom_hash_container(root, true, &h)) {
+                dom_hash_clear(dom);
+                return -1;
+        }
+        dom->hashed = true;
+        return 0;
+}
+
+// Only stored hashes are compared, working out a hash takes as long
+// as comparing the values
+static bool cursor_hash_differs(jsonpg_cursor a, jsonpg_cursor b)
+{
+        dom_hash ha = dom_hash_find(a.dom, a.at);
+        dom_hash hb = ha ? dom_hash_find(b.dom, b.at) : NULL;
+        return hb && ha->hash != hb->hash;
+}
+
+int jsonpg_dom_store_hashes(jsonpg_dom dom)
+{
+        return dom_hash_build(dom);
+}
+
+uint64_t jsonpg_dom_hash(jsonpg_cursor c)
+{
+        c = cursor_resolve(c);
+        return c.at == DOM_NO_POS ? 0 : cursor_hash(c);
+}
+
+bool jsonpg_dom_equal(jsonpg_cursor a, jsonpg_cursor b)
+{
+        a = cursor_resolve(a);
+        b = cursor_resolve(b);
+        if(a.at == DOM_NO_POS || b.at == DOM_NO_POS)
+                return a.at == b.at;
+        return cursor_equal(a, b);
+}
+
+/*
+ * Editing
+ *
+ * Edits never move the items already in a DOM. New items are added
+ * after the end of the tape and linked in by overwriting the item
+ * they replace with a jump to them, they finish with a jump back to
+ * the item after the ones replaced. Removing items is a jump over them.
+ * Only the replaced item and the header of the enclosing array or
+ * object are written, so an edit touches memory in proportion to its
+ * own size, and a mapped DOM file only has those pages copied
+ * Items jumped over are garbage until the DOM is compacted
+ */
+
+// Items for an edit, a key if key is not NULL then either value
+// or, if from.dom is not NULL, a copy of the value at from
+typedef struct {
+        uint8_t *key;
+        size_t length;
+        jsonpg_value value;
+        jsonpg_cursor from;
+} dom_edit;
+
+static void dom_jump(dom_node node, dom_pos to)
+{
+        node->is.header = DOM_JUMP
+                | (to == DOM_NO_POS ? DOM_JUMP_END : to) << DOM_HDR_SHIFT;
+}
+
+static dom_node dom_add_jump(jsonpg_dom dom, dom_pos to)
+{
+        dom_node node = dom_node_next(dom, NODE_SIZE);
+        if(node)
+                dom_jump(node, to);
+        return node;
+}
+
+// The first edit ends the tape with a jump so that the items
+// added by edits are only reached through their jumps
+static bool dom_edit_start(jsonpg_dom dom)
+{
+        // Arrays and objects must all be complete
+        if(dom->open_count)
+                return false;
+        dom_hash_clear(dom);
+        if(!dom->edited) {
+                if(!dom_add_jump(dom, DOM_NO_POS))
+                        return false;
+                dom->edited = true;
+        }
+        return true;
+}
+
+// Adds an item with value as the DOM generator would
+static dom_node dom_add_item(jsonpg_dom dom, jsonpg_value *v)
+{
+        switch(v->type) {
         case JSONPG_KEY:
-                node++;
-                offset += dom_size_align(count);
-                p->result.string.bytes = node->is.bytes;
-                p->result.string.length = count;
-                break;
+                return dom_add_bytes(dom, DOM_KEY, DOM_SHORT_KEY,
+                                v->string.bytes, v->string.length);
+        case JSONPG_END_ARRAY:
+                return dom_add_end(dom, DOM_END_ARRAY);
+        case JSONPG_END_OBJECT:
+                return dom_add_end(dom, DOM_END_OBJECT);
         default:
         }
-        p->dom_info.hdr = hdr;
-        p->dom_info.offset = offset;
-        return type;
+
+        dom_add_value(dom);
+        switch(v->type) {
+        case JSONPG_NULL:
+                return dom_add_header(dom, DOM_NULL, 0, NODE_SIZE);
+        case JSONPG_FALSE:
+                return dom_add_header(dom, DOM_FALSE, 0, NODE_SIZE);
+        case JSONPG_TRUE:
+                return dom_add_header(dom, DOM_TRUE, 0, NODE_SIZE);
+        case JSONPG_INTEGER:
+                return dom_add_integer(dom, v->number.integer);
+        case JSONPG_UNSIGNED:
+                return dom_add_uinteger(dom, v->number.uinteger);
+        case JSONPG_REAL:
+                return dom_add_real(dom, v->number.real);
+        case JSONPG_NUMBER:
+                return dom_add_bytes(dom, DOM_NUMBER, DOM_SHORT_NUMBER,
+                                v->string.bytes, v->string.length);
+        case JSONPG_STRING:
+                return dom_add_bytes(dom, DOM_STRING, DOM_SHORT_STRING,
+                                v->string.bytes, v->string.length);
+        case JSONPG_BEGIN_ARRAY:
+                return dom_add_begin(dom, DOM_BEGIN_ARRAY);
+        case JSONPG_BEGIN_OBJECT:
+                return dom_add_begin(dom, DOM_BEGIN_OBJECT);
+        default:
+                return NULL;
+        }
+}
+
+// Adds the items of an edit, returns the position of the first
+// or DOM_NO_POS if they cannot be added
+static dom_pos dom_add_edit(jsonpg_dom dom, dom_edit *e)
+{
+        dom_pos first = DOM_NO_POS;
+        dom_node node;
+        if(e->key) {
+                node = dom_add_bytes(dom, DOM_KEY, DOM_SHORT_KEY, e->key, e->length);
+                if(!node)
+                        goto fail;
+                first = dom_pos_added(dom, node);
+        }
+
+        // The value copied can be in this DOM, it is read before
+        // anything that refers to the new items is written
+        jsonpg_dom from = e->from.dom;
+        dom_pos pos = DOM_NO_POS;
+        dom_pos end = DOM_NO_POS;
+        jsonpg_value v = e->value;
+        if(from) {
+                pos = dom_pos_resolve(from, e->from.at);
+                if(pos == DOM_NO_POS)
+                        goto fail;
+                end = dom_pos_after(from, pos);
+                v = dom_node_value(dom_node_at(from, pos));
+        } else if(v.type == JSONPG_KEY) {
+                goto fail;
+        }
+
+        for( ; ; ) {
+                node = dom_add_item(dom, &v);
+                if(!node)
+                        goto fail;
+                if(first == DOM_NO_POS)
+                        first = dom_pos_added(dom, node);
+
+                if(from) {
+                        pos = dom_pos_next(from, pos);
+                        if(pos == end)
+                                break;
+                        v = dom_node_value(dom_node_at(from, pos));
+                } else if(dom->open_count) {
+                        // Arrays and objects are added empty
+                        v.type = v.type == JSONPG_BEGIN_ARRAY
+                                ? JSONPG_END_ARRAY
+                                : JSONPG_END_OBJECT;
+                } else {
+                        break;
+                }
+        }
+        return first;
+
+fail:
+        dom->open_count = 0;
+        return DOM_NO_POS;
+}
+
+// Adds a copy of the item at pos
+static dom_node dom_add_copy(jsonpg_dom dom, dom_pos pos)
+{
+        size_t size = dom_node_size(dom_node_at(dom, pos));
+        dom_node node = dom_node_next(dom, size);
+        if(node)
+                memcpy(node, dom_node_at(dom, pos), size);
+        return node;
+}
+
+static void dom_add_count(jsonpg_dom dom, dom_pos begin, int64_t count)
+{
+        dom_node_at(dom, dom_pos_resolve(dom, begin))->is.header += (uint64_t)count << DOM_HDR_SHIFT;
+}
+
+// Replaces the value at pos with the items of e
+static int dom_replace(jsonpg_dom dom, dom_pos pos, dom_edit *e)
+{
+        dom_kind kind = dom_node_kind(dom_node_at(dom, pos));
+        size_t size = dom_node_size(dom_node_at(dom, pos));
+        dom_pos after = dom_pos_after(dom, pos);
+        dom_pos first = dom_add_edit(dom, e);
+        if(first == DOM_NO_POS)
+                return -1;
+
+        // A value replaced by one of the same size is overwritten,
+        // unless either is an array or object, and the new one dropped
+        dom_block block = dom->blocks + (first >> DOM_BLOCK_SHIFT);
+        dom_node node = dom_node_at(dom, first);
+        if(kind != DOM_BEGIN_ARRAY && kind != DOM_BEGIN_OBJECT
+                        && dom_node_size(node) == size
+                        && (uint32_t)first + size == block->count) {
+                memcpy(dom_node_at(dom, pos), node, size);
+                block->count -= size;
+                return 0;
+        }
+
+        if(!dom_add_jump(dom, after))
+                return -1;
+        dom_jump(dom_node_at(dom, pos), first);
+        return 0;
+}
+
+// Adds the items of e to the end of the array or object at begin
+// by moving its end item after them
+// Returns the position of the first item added or DOM_NO_POS
+static dom_pos dom_append(jsonpg_dom dom, dom_pos begin, dom_edit *e)
+{
+        dom_pos end = dom_node_at(dom, begin)[1].is.pos;
+        dom_pos after = dom_pos_next(dom, end);
+        dom_pos first = dom_add_edit(dom, e);
+        if(first == DOM_NO_POS)
+                return DOM_NO_POS;
+
+        dom_node node = dom_add_copy(dom, end);
+        if(!node)
+                return DOM_NO_POS;
+        dom_pos moved = dom_pos_added(dom, node);
+        if(!dom_add_jump(dom, after))
+                return DOM_NO_POS;
+
+        dom_jump(dom_node_at(dom, end), first);
+        dom_node_at(dom, begin)[1].is.pos = moved;
+        dom_add_count(dom, begin, 1);
+        return first;
+}
+
+// Adds the items of e to the array at begin after the element at prev,
+// or first if prev is DOM_NO_POS, by moving the item before them
+// (the element, its end item or the array's begin) ahead of them
+static int dom_insert_after(jsonpg_dom dom, dom_pos begin, dom_pos prev, dom_edit *e)
+{
+        dom_pos before = begin;
+        dom_kind kind = DOM_NULL;
+        if(prev != DOM_NO_POS) {
+                kind = dom_node_kind(dom_node_at(dom, prev));
+                before = kind == DOM_BEGIN_ARRAY || kind == DOM_BEGIN_OBJECT
+                        ? dom_node_at(dom, prev)[1].is.pos
+                        : prev;
+        }
+
+        dom_pos after = dom_pos_next(dom, before);
+        dom_node node = dom_add_copy(dom, before);
+        if(!node)
+                return -1;
+        dom_pos moved = dom_pos_added(dom, node);
+        if(dom_add_edit(dom, e) == DOM_NO_POS || !dom_add_jump(dom, after))
+                return -1;
+
+        dom_jump(dom_node_at(dom, before), moved);
+        if(before != prev && prev != DOM_NO_POS)
+                dom_node_at(dom, prev)[1].is.pos = moved;
+        dom_add_count(dom, begin, 1);
+        return 0;
+}
+
+// Jumps over the items from pos up to to, which belong to the array
+// or object at begin
+static void dom_remove(jsonpg_dom dom, dom_pos begin, dom_pos pos, dom_pos to)
+{
+        dom_jump(dom_node_at(dom, pos), to);
+        dom_add_count(dom, begin, -1);
+}
+
+static dom_pos *dom_index_slot(jsonpg_dom dom, dom_index ix, dom_pos key)
+{
+        dom_pos *slots = dom->slots + ix->first;
+        size_t i = dom_key_hash(dom_node_at(dom, key)) & ix->mask;
+        while(slots[i] != DOM_NO_POS && slots[i] != key)
+                i = (i + 1) & ix->mask;
+        return slots + i;
+}
+
+// Keeps any index of the object at begin up to date with an added key
+// An index that would become too full is dropped, to be rebuilt
+// bigger when next needed
+static void dom_index_insert(jsonpg_dom dom, dom_pos begin, dom_pos key)
+{
+        dom_index ix = dom_index_find(dom, begin);
+        if(!ix)
+                return;
+        if(2 * (ix->used + 1) > ix->mask + 1) {
+                ix->object = DOM_DELETED;
+                return;
+        }
+
+        dom_pos *slots = dom->slots + ix->first;
+        size_t i = dom_key_hash(dom_node_at(dom, key)) & ix->mask;
+        while(slots[i] != DOM_NO_POS && slots[i] != DOM_DELETED)
+                i = (i + 1) & ix->mask;
+        if(slots[i] == DOM_NO_POS)
+                ix->used++;
+        slots[i] = key;
+}
+
+static void dom_index_delete(jsonpg_dom dom, dom_pos begin, dom_pos key)
+{
+        dom_index ix = dom_index_find(dom, begin);
+        if(ix) {
+                dom_pos *slot = dom_index_slot(dom, ix, key);
+                if(*slot == key)
+                        *slot = DOM_DELETED;
+        }
+}
+
+static int dom_set(jsonpg_cursor c, dom_edit *e)
+{
+        c = cursor_resolve(c);
+        if(c.at == DOM_NO_POS || !dom_edit_start(c.dom))
+                return -1;
+
+        return dom_replace(c.dom, c.at, e);
+}
+
+static int dom_insert(jsonpg_cursor c, size_t index, dom_edit *e)
+{
+        c = cursor_resolve(c);
+        size_t count = cursor_count(c);
+        if(cursor_type(c) != JSONPG_BEGIN_ARRAY
+                        || index > count
+                        || !dom_edit_start(c.dom))
+                return -1;
+
+        if(index == count)
+                return dom_append(c.dom, c.at, e) == DOM_NO_POS ? -1 : 0;
+
+        dom_pos prev = index
+                ? cursor_index(c, index - 1).at
+                : DOM_NO_POS;
+        return dom_insert_after(c.dom, c.at, prev, e);
+}
+
+static int dom_put(jsonpg_cursor c, uint8_t *key, size_t length, dom_edit *e)
+{
+        c = cursor_resolve(c);
+        if(cursor_type(c) != JSONPG_BEGIN_OBJECT || !dom_edit_start(c.dom))
+                return -1;
+
+        jsonpg_cursor member = cursor_get(c, key, length);
+        if(member.at != DOM_NO_POS)
+                return dom_replace(c.dom, member.at, e);
+
+        e->key = key;
+        e->length = length;
+        dom_pos added = dom_append(c.dom, c.at, e);
+        if(added == DOM_NO_POS)
+                return -1;
+        dom_index_insert(c.dom, c.at, added);
+        return 0;
+}
+
+int jsonpg_dom_set(jsonpg_cursor c, jsonpg_value value)
+{
+        return dom_set(c, &(dom_edit){ .value = value });
+}
+
+int jsonpg_dom_insert(jsonpg_cursor c, size_t index, jsonpg_value value)
+{
+        return dom_insert(c, index, &(dom_edit){ .value = value });
+}
+
+int jsonpg_dom_remove(jsonpg_cursor c, size_t index)
+{
+        c = cursor_resolve(c);
+        if(cursor_type(c) != JSONPG_BEGIN_ARRAY || !dom_edit_start(c.dom))
+                return -1;
+
+        jsonpg_cursor element = cursor_index(c, index);
+        if(element.at == DOM_NO_POS)
+                return -1;
+
+        dom_remove(c.dom, c.at, element.at, dom_pos_after(c.dom, element.at));
+        return 0;
+}
+
+int jsonpg_dom_put(jsonpg_cursor c, uint8_t *key, size_t length, jsonpg_value value)
+{
+        return dom_put(c, key, length, &(dom_edit){ .value = value });
+}
+
+int jsonpg_dom_delete(jsonpg_cursor c, uint8_t *key, size_t length)
+{
+        c = cursor_resolve(c);
+        if(cursor_type(c) != JSONPG_BEGIN_OBJECT || !dom_edit_start(c.dom))
+                return -1;
+
+        jsonpg_cursor member = cursor_get(c, key, length);
+        if(member.at == DOM_NO_POS)
+                return -1;
+
+        dom_index_delete(c.dom, c.at, member.key);
+        dom_remove(c.dom, c.at, member.key, dom_pos_after(c.dom, member.at));
+        return 0;
 }
@@ -2,8 +2,15 @@
 
 static jsonpg_dom dom_generator_ctx(arena a);
 static jsonpg_generator dom_generator(jsonpg_generator);
+static void dom_generator_reset(jsonpg_generator);
+
+// Position of a node in a DOM, block index in the high 32 bits
+// and byte offset within the block in the low 32 bits
+typedef uint64_t dom_pos;
+
+#define DOM_NO_POS UINT64_MAX
 
 typedef struct dom_info_s {
-        jsonpg_dom hdr;
-        size_t offset;
+        jsonpg_dom dom;
+        dom_pos pos;
 } dom_info;
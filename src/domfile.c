@@ -0,0 +1,185 @@
+/*
+ * domfile.c
+ *   Saving a DOM to a file and mapping it back into memory
+ *
+ *   DOM items only refer to each other by position, block index and
+ *   offset within the block, so a saved DOM is its blocks as they are
+ *   plus a table of where each block is in the file. Opening one maps
+ *   the file and points a block table at it, nothing is parsed or copied
+ *   The mapping is private and writable so that editing a mapped DOM
+ *   only copies the pages that the edit writes to, the file is unchanged
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DOM_FILE_MAGIC "JSONPGD"
+#define DOM_FILE_VERSION 1
+
+#define DOM_FILE_EDITED 1       // tape ends with a jump, edits follow it
+
+// All values are little endian, as is the DOM encoding
+// The header is followed by the block table and then the blocks,
+// each block starts on a NODE_SIZE boundary
+struct dom_file_hdr_s {
+        char magic[8];
+        uint32_t version;
+        uint32_t node_size;
+        uint64_t block_count;
+        uint64_t flags;
+};
+
+struct dom_file_block_s {
+        uint64_t offset;        // from the start of the file
+        uint64_t count;
+};
+
+static int dom_write(int fd, const void *bytes, size_t count)
+{
+        while(count) {
+                ssize_t w = write(fd, bytes, count);
+                if(w < 0) {
+                        if(errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                bytes = (const uint8_t *)bytes + w;
+                count -= w;
+        }
+        return 0;
+}
+
+int jsonpg_dom_save(jsonpg_dom dom, int fd)
+{
+        // Arrays and objects must all be complete
+        if(dom->open_count)
+                return -1;
+
+        struct dom_file_hdr_s hdr = {
+                .magic = DOM_FILE_MAGIC,
+                .version = DOM_FILE_VERSION,
+                .node_size = NODE_SIZE,
+                .block_count = dom->block_count,
+                .flags = dom->edited ? DOM_FILE_EDITED : 0
+        };
+        if(dom_write(fd, &hdr, sizeof(hdr)))
+                return -1;
+
+        uint64_t offset = sizeof(hdr)
+                + dom->block_count * sizeof(struct dom_file_block_s);
+        for(size_t i = 0 ; i < dom->block_count ; i++) {
+                struct dom_file_block_s fb = {
+                        .offset = offset,
+                        .count = dom->blocks[i].count
+                };
+                if(dom_write(fd, &fb, sizeof(fb)))
+                        return -1;
+                offset += dom->blocks[i].count;
+        }
+
+        for(size_t i = 0 ; i < dom->block_count ; i++)
+                if(dom_write(fd, dom->blocks[i].bytes, dom->blocks[i].count))
+                        return -1;
+
+        return 0;
+}
+
+static bool dom_file_valid(uint8_t *map, size_t size)
+{
+        struct dom_file_hdr_s *hdr = (struct dom_file_hdr_s *)map;
+        if(size < sizeof(*hdr)
+                        || memcmp(hdr->magic, DOM_FILE_MAGIC, sizeof(hdr->magic))
+                        || hdr->version != DOM_FILE_VERSION
+                        || hdr->node_size != NODE_SIZE
+                        || hdr->block_count > DOM_MAX_BLOCK
+                        || hdr->block_count * sizeof(struct dom_file_block_s)
+                                > size - sizeof(*hdr))
+                return false;
+
+        struct dom_file_block_s *fb = (struct dom_file_block_s *)(hdr + 1);
+        for(size_t i = 0 ; i < hdr->block_count ; i++)
+                if(fb[i].offset % NODE_SIZE
+                                || fb[i].count % NODE_SIZE
+                                || fb[i].count > DOM_MAX_BLOCK
+                                || fb[i].offset > size
+                                || fb[i].count > size - fb[i].offset)
+                        return false;
+
+        return true;
+}
+
+static jsonpg_dom dom_file_dom(uint8_t *map, size_t size)
+{
+        struct dom_file_hdr_s *hdr = (struct dom_file_hdr_s *)map;
+        struct dom_file_block_s *fb = (struct dom_file_block_s *)(hdr + 1);
+
+        arena a = arena_new(NULL);
+        if(!a)
+                return NULL;
+
+        jsonpg_dom dom = dom_new(a);
+        size_t count = hdr->block_count;
+        dom_block blocks = dom
+                ? arena_alloc(a, (count ? count : 1) * sizeof(struct dom_block_s))
+                : NULL;
+        if(!blocks) {
+                arena_free(a);
+                return NULL;
+        }
+
+        for(size_t i = 0 ; i < count ; i++)
+                blocks[i] = (struct dom_block_s){
+                        .bytes = map + fb[i].offset,
+                        .count = fb[i].count,
+                        .size = fb[i].count,
+                        .shared = true
+                };
+
+        dom->blocks = blocks;
+        dom->block_count = count;
+        dom->block_size = count ? count : 1;
+        dom->current = count ? count - 1 : 0;
+        dom->map = map;
+        dom->map_size = size;
+        dom->edited = hdr->flags & DOM_FILE_EDITED;
+
+        return dom;
+}
+
+jsonpg_dom jsonpg_dom_open_mmap(const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        if(fd < 0)
+                return NULL;
+
+        struct stat st;
+        if(fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+                close(fd);
+                return NULL;
+        }
+
+        size_t size = st.st_size;
+        void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED)
+                return NULL;
+
+        jsonpg_dom dom = dom_file_valid(map, size)
+                ? dom_file_dom(map, size)
+                : NULL;
+        if(!dom)
+                munmap(map, size);
+
+        return dom;
+}
+
+void jsonpg_dom_close(jsonpg_dom dom)
+{
+        if(!dom || !dom->map)
+                return;
+
+        munmap(dom->map, dom->map_size);
+        arena_free(dom->arena);
+}
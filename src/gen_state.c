@@ -20,10 +20,16 @@ typedef struct gen_rule_list_s *gen_rule_list;
 typedef struct gen_match_list_s *gen_match_list;
 typedef struct gen_action_list_s *gen_action_list;
 typedef struct gen_renderer_s *gen_renderer;
+typedef struct gen_machine_s *gen_machine;
 
 #define MAX_CHARS_IN_CLASS 22
 #define CODE_START_LEVEL 3
 
+// States that loop back to themselves on at least this many bytes
+// get a SIMD scan, see scan.c
+#define SCAN_MIN_BYTES 64
+#define SCAN_MAX_EXCLUDED 3
+
 struct gen_state_s {
         gen_class_list classes;
         gen_rule_list rules;
@@ -215,6 +221,20 @@ struct gen_renderer_s {
         str_buf sbuf;
 };
 
+// The state machine's state map, action code and dispatch table
+struct gen_machine_s {
+        gen_renderer map;
+        gen_renderer enum_names;
+        gen_renderer cases;
+        gen_renderer gotos;
+        gen_renderer code;
+        gen_renderer classes;           // byte => equivalence class
+        gen_renderer class_map;         // [state][class] => state/action
+        gen_renderer class_count;
+        int nrows;
+        uint8_t rows[0x80][256];        // state_map, kept to find classes
+};
+
 static uint8_t gen_rule_id = 0;
 static uint8_t gen_action_id = 0x80;
 static char *gen_hex_chars = "0123456789ABCDEF";
@@ -1304,14 +1324,59 @@ uint8_t render_rule_default_state(gen_rule r, gen_renderer gotos, gen_renderer c
 
 
 
+void render_scan(gen_rule r, uint8_t *rule_states, gen_renderer scans)
+{
+        // Self looping bytes must be a range with a few exclusions
+        int lo = -1;
+        int hi = -1;
+        int count = 0;
+        for(int i = 0 ; i < 256 ; i++) {
+                if(rule_states[i] == r->id) {
+                        if(lo < 0)
+                                lo = i;
+                        hi = i;
+                        count++;
+                }
+        }
+        if(count < SCAN_MIN_BYTES)
+                return;
+
+        uint8_t excluded[SCAN_MAX_EXCLUDED];
+        int n = 0;
+        for(int i = lo ; i <= hi ; i++) {
+                if(rule_states[i] != r->id) {
+                        if(n == SCAN_MAX_EXCLUDED) {
+                                warn("State '%s' has too many exclusions to scan", r->name);
+                                return;
+                        }
+                        excluded[n++] = i;
+                }
+        }
+        // repeat an exclusion to fill unused arguments
+        for(int i = n ; i < SCAN_MAX_EXCLUDED ; i++)
+                excluded[i] = n ? excluded[0] : lo;
+
+        render_indent(scans, "case state_");
+        render(scans, r->name);
+        render(scans, ":");
+        render_level(scans, 1);
+        render_indent(scans, "return scan_range(current, last, ");
+        render_x(scans, lo);
+        render(scans, ", ");
+        render_x(scans, hi);
+        for(int i = 0 ; i < SCAN_MAX_EXCLUDED ; i++) {
+                render(scans, ", ");
+                render_x(scans, excluded[i]);
+        }
+        render(scans, ");");
+        render_level(scans, -1);
+}
+
 void render_rule(
                 gen_rule r, 
-                gen_renderer map, 
+                gen_machine mc,
                 gen_renderer enums, 
-                gen_renderer enum_names,
-                gen_renderer gotos,
-                gen_renderer code, 
-                gen_renderer cases,
+                gen_renderer scans,
                 int first)
 {
         if(r->id < 0)
@@ -1319,9 +1384,9 @@ void render_rule(
 
         static uint8_t rule_states[256];
 
-        render_enum(r, enums, enum_names, first);
+        render_enum(r, enums, mc->enum_names, first);
         gen_match_list ml = r->matches;
-        uint8_t def_state = render_rule_default_state(r, gotos, code, cases);
+        uint8_t def_state = render_rule_default_state(r, mc->gotos, mc->code, mc->cases);
         memset(rule_states, def_state, 256);
 
         while(ml) {
@@ -1330,18 +1395,21 @@ void render_rule(
                 uint8_t match_state;
                 switch(m->type) {
                         case MATCH_CLASS:
-                                match_state = render_match_action(false, r, m, gotos, code, cases);
+                                match_state = render_match_action(false, r, m, 
+                                                mc->gotos, mc->code, mc->cases);
                                 uint8_t *chars = m->match.class->chars;
                                 len = strlen((char *)chars);
                                 for(int i = 0 ; i < len ; i++)
                                         rule_states[chars[i]] = match_state;
                                 break;
                         case MATCH_CHAR:
-                                match_state = render_match_action(false, r, m, gotos, code, cases);
+                                match_state = render_match_action(false, r, m, 
+                                                mc->gotos, mc->code, mc->cases);
                                 rule_states[m->match.character] = match_state;
                                 break;
                         case MATCH_RANGE:
-                                match_state = render_match_action(false, r, m, gotos, code, cases);
+                                match_state = render_match_action(false, r, m, 
+                                                mc->gotos, mc->code, mc->cases);
                                 gen_range *rg = &m->match.range;
                                 len = rg->end - rg->start;
                                 for(int i = 0 ; i <= len ; i++)
@@ -1356,7 +1424,63 @@ void render_rule(
                 }
                 ml = ml->next;
         }
-        render_map_values(r, rule_states, map, first);
+        render_map_values(r, rule_states, mc->map, first);
+        memcpy(mc->rows[mc->nrows++], rule_states, 256);
+        render_scan(r, rule_states, scans);
+}
+
+// Bytes are equivalent if every state maps them to the same
+// state or action, so the 256 columns of the state map can be
+// replaced by one column per class
+int byte_classes(gen_machine mc, uint8_t *byte_class)
+{
+        int count = 0;
+        for(int b = 0 ; b < 256 ; b++) {
+                int c = b;
+                for(int e = 0 ; e < b && c == b ; e++) {
+                        int r = 0;
+                        while(r < mc->nrows && mc->rows[r][e] == mc->rows[r][b])
+                                r++;
+                        if(r == mc->nrows)
+                                c = e;
+                }
+                byte_class[b] = (c == b) ? count++ : byte_class[c];
+        }
+        return count;
+}
+
+void render_classes(gen_machine mc)
+{
+        uint8_t byte_class[256];
+        uint8_t class_byte[256];
+        int count = byte_classes(mc, byte_class);
+
+        for(int b = 255 ; b >= 0 ; b--)
+                class_byte[byte_class[b]] = b;
+
+        for(int b = 0 ; b < 256 ; b++) {
+                if(b % 16 == 0)
+                        render_indent(mc->classes, "");
+                else
+                        render(mc->classes, " ");
+                render_x(mc->classes, byte_class[b]);
+                if(b < 255)
+                        render(mc->classes, ",");
+        }
+
+        for(int r = 0 ; r < mc->nrows ; r++) {
+                render_indent(mc->class_map, "{");
+                for(int c = 0 ; c < count ; c++) {
+                        if(c)
+                                render(mc->class_map, ", ");
+                        render_x(mc->class_map, mc->rows[r][class_byte[c]]);
+                }
+                render(mc->class_map, r < mc->nrows - 1 ? "}," : "}");
+        }
+
+        char line[64];
+        snprintf(line, sizeof(line), "#define BYTE_CLASSES %d", count);
+        render_indent(mc->class_count, line);
 }
 
 gen_renderer renderer_new(int level)
@@ -1364,7 +1488,7 @@ gen_renderer renderer_new(int level)
         gen_renderer r = fmalloc(sizeof(struct gen_renderer_s));
         r->level = level;
         r->startlevel = level;
-        r->sbuf = str_buf_new(0);
+        r->sbuf = str_buf_new(arena_new(NULL), 0);
         return r;
 }
 
@@ -1390,25 +1514,43 @@ void merge_renderer(FILE *in, FILE *out, gen_renderer r, char *tag)
         write_renderer(out, r);
 }
 
-void render_state(gen_state states)
+gen_machine machine_new(void)
 {
-        gen_rule_list rl = states->rules;
-        gen_renderer map = renderer_new(1);
-        gen_renderer enums = renderer_new(1);
-        gen_renderer enum_names = renderer_new(1);
-        gen_renderer cases = renderer_new(1);
-        gen_renderer gotos = renderer_new(CODE_START_LEVEL);
-        gen_renderer code = renderer_new(CODE_START_LEVEL);
+        gen_machine mc = fmalloc(sizeof(struct gen_machine_s));
+        mc->map = renderer_new(1);
+        mc->enum_names = renderer_new(1);
+        mc->cases = renderer_new(1);
+        mc->gotos = renderer_new(CODE_START_LEVEL);
+        mc->code = renderer_new(CODE_START_LEVEL);
+        mc->classes = renderer_new(1);
+        mc->class_map = renderer_new(1);
+        mc->class_count = renderer_new(0);
+        mc->nrows = 0;
+        return mc;
+}
 
+void render_machine(gen_state states, gen_machine mc, gen_renderer enums, gen_renderer scans)
+{
+        gen_rule_list rl = states->rules;
         int first = 1;
         while(rl) {
-                render_rule(rl->rule, map, enums, enum_names, gotos, code, cases, first);
+                render_rule(rl->rule, mc, enums, scans, first);
                 first = 0;
                 rl = rl->next;
         }
 
         // drop last comma from cases
-        cases->sbuf->count--;
+        mc->cases->sbuf->count--;
+
+        render_classes(mc);
+}
+
+void render_state(gen_state states)
+{
+        gen_renderer enums = renderer_new(1);
+        gen_renderer scans = renderer_new(1);
+        gen_machine mc = machine_new();
+        render_machine(states, mc, enums, scans);
 
         FILE *skelfile = fopen(SKELETON_FILE, "r");
         if(!skelfile)
@@ -1418,12 +1560,16 @@ void render_state(gen_state states)
         if(!cfile)
                 fail("Failed to create %s", OUTPUT_FILE);
 
-        merge_renderer(skelfile, cfile, map, "<= map");
         merge_renderer(skelfile, cfile, enums, "<= enums");
-        merge_renderer(skelfile, cfile, enum_names, "<= enum_names");
-        merge_renderer(skelfile, cfile, cases, "<= cases");
-        merge_renderer(skelfile, cfile, gotos, "<= gotos");
-        merge_renderer(skelfile, cfile, code, "<= code");
+        merge_renderer(skelfile, cfile, scans, "<= scans");
+        merge_renderer(skelfile, cfile, mc->class_count, "<= class_count");
+        merge_renderer(skelfile, cfile, mc->classes, "<= classes");
+        merge_renderer(skelfile, cfile, mc->class_map, "<= class_map");
+        merge_renderer(skelfile, cfile, mc->map, "<= map");
+        merge_renderer(skelfile, cfile, mc->enum_names, "<= enum_names");
+        merge_renderer(skelfile, cfile, mc->cases, "<= cases");
+        merge_renderer(skelfile, cfile, mc->gotos, "<= gotos");
+        merge_renderer(skelfile, cfile, mc->code, "<= code");
         copy_until(skelfile, cfile, NULL);
 
         fclose(cfile);
@@ -88,6 +88,16 @@ int jsonpg_integer(jsonpg_generator g, long integer)
                         && g->callbacks->integer(g->ctx, integer));
 }
 
+// Callbacks without uinteger get the value as a real
+int jsonpg_uinteger(jsonpg_generator g, unsigned long uinteger)
+{
+        if(!g->callbacks->uinteger)
+                return jsonpg_real(g, (double)uinteger);
+
+        return  cannot_value(g)
+                || g->callbacks->uinteger(g->ctx, uinteger);
+}
+
 int jsonpg_real(jsonpg_generator g, double real)
 {
         return  cannot_value(g)
@@ -95,6 +105,32 @@ int jsonpg_real(jsonpg_generator g, double real)
                         && g->callbacks->real(g->ctx, real));
 }
 
+// Callbacks without number get the converted value
+int jsonpg_number(jsonpg_generator g, uint8_t *bytes, size_t count)
+{
+        if(!g->callbacks->number) {
+                jsonpg_value v = jsonpg_convert_number(bytes, count);
+                switch(v.type) {
+                case JSONPG_INTEGER:
+                        return jsonpg_integer(g, v.number.integer);
+                case JSONPG_UNSIGNED:
+                        return jsonpg_uinteger(g, v.number.uinteger);
+                case JSONPG_REAL:
+                        return jsonpg_real(g, v.number.real);
+                default:
+                        set_generator_error(g, v.error.code);
+                        return 1;
+                }
+        }
+
+        if(NUMBER_RANGE == number_check(bytes, bytes + count)) {
+                set_generator_error(g, JSONPG_ERROR_NUMBER);
+                return 1;
+        }
+        return  cannot_value(g)
+                || g->callbacks->number(g->ctx, bytes, count);
+}
+
 int jsonpg_string(jsonpg_generator g, uint8_t *bytes, size_t count)
 {
         return cannot_value(g)
@@ -151,8 +187,31 @@ static jsonpg_generator generator_reset(jsonpg_generator g)
         return g;
 }
 
-static int generate(jsonpg_generator g, jsonpg_type type, jsonpg_value *value)
+/*
+ * Writes a string or key that is known to need no escaping or
+ * UTF-8 validation, printers copy it as it is
+ */
+static int generate_plain(jsonpg_generator g, jsonpg_type type, jsonpg_value *value)
 {
+        uint8_t *bytes = value->string.bytes;
+        size_t length = value->string.length;
+        if(g->callbacks != &printer_callbacks)
+                return JSONPG_KEY == type
+                        ? jsonpg_key(g, bytes, length)
+                        : jsonpg_string(g, bytes, length);
+
+        return JSONPG_KEY == type
+                ? cannot_key(g) || print_plain_key(g->ctx, bytes, length)
+                : cannot_value(g) || print_plain_string(g->ctx, bytes, length);
+}
+
+static int generate(jsonpg_generator g, jsonpg_type type, jsonpg_value *value, bool plain)
+{
+        if(plain && (JSONPG_STRING == type || JSONPG_KEY == type)) {
+                g->count++;
+                return generate_plain(g, type, value);
+        }
+
         g->count++;
         switch(type) {
         case JSONPG_NULL:
@@ -162,8 +221,12 @@ static int generate(jsonpg_generator g, jsonpg_type type, jsonpg_value *value)
                 return jsonpg_boolean(g, JSONPG_TRUE == type);
         case JSONPG_INTEGER:
                 return jsonpg_integer(g, value->number.integer);
+        case JSONPG_UNSIGNED:
+                return jsonpg_uinteger(g, value->number.uinteger);
         case JSONPG_REAL:
                 return jsonpg_real(g, value->number.real);
+        case JSONPG_NUMBER:
+                return jsonpg_number(g, value->string.bytes, value->string.length);
         case JSONPG_STRING:
                 return jsonpg_string(g, value->string.bytes, value->string.length);
         case JSONPG_KEY:
@@ -184,18 +247,19 @@ static int generate(jsonpg_generator g, jsonpg_type type, jsonpg_value *value)
         }
 }
 
-static jsonpg_generator generator_new(uint16_t stack_size)
+static jsonpg_generator generator_new(arena a, uint16_t stack_size)
 {
-        arena a = arena_new();
         if(!a)
                 return NULL;
         jsonpg_generator g = arena_alloc(a, sizeof(struct jsonpg_generator_s)
-                        + (stack_size >> 3));
-        if(!g)
+                        + ((stack_size + 7) >> 3));
+        if(!g) {
+                arena_free(a);
                 return NULL;
+        }
 
+        *g = (struct jsonpg_generator_s){};
         g->arena = a;
-        g->key_next = false;
 
         g->stack = (struct stack_s) {
                 .ptr = 0,
@@ -207,6 +271,13 @@ static jsonpg_generator generator_new(uint16_t stack_size)
         return g;
 }
 
+// A generator without arena or nesting stack, for callbacks
+static jsonpg_generator generator_init(jsonpg_generator g)
+{
+        *g = (struct jsonpg_generator_s){};
+        return g;
+}
+
 static jsonpg_generator generator_set_callbacks(
                 jsonpg_generator g,
                 jsonpg_callbacks *callbacks, 
@@ -222,37 +293,77 @@ void jsonpg_generator_free(jsonpg_generator g)
         if(!g)
                 return;
 
+        jsonpg_generator_flush(g);
         arena_free(g->arena);
 }
 
-jsonpg_generator jsonpg_generator_new_opt(jsonpg_generator_opts opts)
+int jsonpg_generator_reset(jsonpg_generator g)
 {
-        if(1 != (opts.fd > 0) 
+        int r = 0;
+        if(g->callbacks == &printer_callbacks)
+                r = print_reset(g->ctx);
+        else
+                dom_generator_reset(g);
+
+        g->key_next = false;
+        g->error = (jsonpg_error_value){};
+        g->count = 0;
+        g->stack.ptr = g->stack.ptr_min;
+
+        return r;
+}
+
+static bool generator_opts_valid(jsonpg_generator_opts opts)
+{
+        return 1 == (opts.fd > 0) 
                         + (opts.buffer == true)
                         + (opts.dom == true)
                         + (opts.writer != NULL)
-                        + (opts.callbacks != NULL))
-                return NULL;
-        
+                        + (opts.callbacks != NULL);
+}
+
+static jsonpg_generator generator_create(arena a, jsonpg_generator_opts opts)
+{
         int indent = opts.indent;
         if(indent < 0)
                 indent = 0;
         else if (indent > 8)
                 indent = 8;
 
-        jsonpg_generator g = generator_new(opts.max_nesting);
+        jsonpg_generator g = generator_new(a, opts.max_nesting);
         if(!g)
                 return NULL;
 
         if(opts.fd > 0)
-                return file_printer(g, opts.fd, indent);
+                return file_printer(g, opts.fd, indent, opts.buffer_size);
         else if(opts.buffer)
                 return buffer_printer(g, indent);
         else if(opts.writer)
-                return write_printer(g, opts.writer, indent);
+                return write_printer(g, opts.writer, indent, opts.buffer_size);
         else if(opts.dom)
                 return dom_generator(g);
         else
                 return generator_set_callbacks(g, opts.callbacks, opts.ctx);
 
 }
+
+jsonpg_generator jsonpg_generator_new_opt(jsonpg_generator_opts opts)
+{
+        if(!generator_opts_valid(opts))
+                return NULL;
+
+        return generator_create(arena_new(opts.allocator), opts);
+}
+
+jsonpg_generator jsonpg_generator_init_opt(
+                void *memory, 
+                size_t size, 
+                jsonpg_generator_opts opts)
+{
+        if(!generator_opts_valid(opts))
+                return NULL;
+
+        return generator_create(
+                        arena_init(opts.allocator, memory, size, !opts.allow_heap), 
+                        opts);
+}
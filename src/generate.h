@@ -12,7 +12,8 @@ struct jsonpg_generator_s {
         struct stack_s stack;
 };
 
-static jsonpg_generator generator_new(uint16_t);
+static jsonpg_generator generator_new(arena, uint16_t);
+static jsonpg_generator generator_init(jsonpg_generator);
 static jsonpg_generator generator_set_callbacks(jsonpg_generator g, jsonpg_callbacks *callbacks, void *ctx);
 static jsonpg_generator generator_reset(jsonpg_generator);
 static void set_generator_error(jsonpg_generator, jsonpg_error_code);
@@ -0,0 +1,138 @@
+/*
+ * index.c
+ *   SIMD pre-pass over in-memory input
+ *
+ *   Most input bytes are either inside strings or are whitespace
+ *   and the state machine does nothing with them except loop back
+ *   to the same state. Runs of string bytes are skipped by scan_state,
+ *   the index records, for each byte, whether it ends a run of
+ *   whitespace so that the state machine can jump straight to the next
+ *   byte it has to look at, which matters for indented input.
+ *
+ *   The index only ever skips bytes the state machine would have accepted
+ *   without changing state, so all validation still happens in state.c
+ */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define INDEX_BLOCK 64
+
+#if defined(__AVX2__)
+
+static uint64_t index_classify(const uint8_t *in)
+{
+        uint64_t w = 0;
+        for(int i = 0 ; i < INDEX_BLOCK ; i += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+                __m256i space = _mm256_or_si256(
+                                _mm256_or_si256(
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                                _mm256_or_si256(
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+
+                w |= (uint64_t)(uint32_t)_mm256_movemask_epi8(space) << i;
+        }
+        return ~w;
+}
+
+#elif defined(__SSE2__)
+
+static uint64_t index_classify(const uint8_t *in)
+{
+        uint64_t w = 0;
+        for(int i = 0 ; i < INDEX_BLOCK ; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+                __m128i space = _mm_or_si128(
+                                _mm_or_si128(
+                                        _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                                _mm_or_si128(
+                                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+
+                w |= (uint64_t)(uint16_t)_mm_movemask_epi8(space) << i;
+        }
+        return ~w;
+}
+
+#endif
+
+/*
+ * Builds the index for the parser's current in-memory input
+ * If SIMD is not available, or memory cannot be allocated,
+ * then parsing continues without an index
+ */
+static void index_build(jsonpg_parser p)
+{
+        input_index ix = &p->index;
+        ix->input = NULL;
+
+#ifdef JSONPG_HAVE_INDEX
+        size_t count = p->last - p->input;
+        size_t words = (count + INDEX_BLOCK - 1) / INDEX_BLOCK;
+
+        if(words > ix->capacity) {
+                uint64_t *bits = ix->bits
+                        ? arena_realloc(p->arena, ix->bits, words * sizeof(uint64_t))
+                        : arena_alloc(p->arena, words * sizeof(uint64_t));
+                if(!bits)
+                        return;
+                ix->bits = bits;
+                ix->capacity = words;
+        }
+
+        uint8_t *in = p->input;
+        uint64_t *bits = ix->bits;
+        size_t full = count / INDEX_BLOCK;
+        for(size_t i = 0 ; i < full ; i++) {
+                bits[i] = index_classify(in);
+                in += INDEX_BLOCK;
+        }
+
+        size_t tail = count % INDEX_BLOCK;
+        if(tail) {
+                // pad with whitespace, which is not a stop
+                uint8_t block[INDEX_BLOCK];
+                memset(block, ' ', INDEX_BLOCK);
+                memcpy(block, in, tail);
+                bits[full] = index_classify(block);
+        }
+
+        ix->input = p->input;
+#endif
+}
+
+/*
+ * Returns the first position at or after current that is not
+ * whitespace, or last if there is none
+ */
+static uint8_t *index_skip(
+                input_index ix,
+                uint8_t *current,
+                const uint8_t *last)
+{
+        if(current >= last)
+                return (uint8_t *)last;
+
+        size_t pos = current - ix->input;
+        size_t w = pos / INDEX_BLOCK;
+        size_t words = (last - ix->input + INDEX_BLOCK - 1) / INDEX_BLOCK;
+        uint64_t bits = ix->bits[w] & (~0ULL << (pos % INDEX_BLOCK));
+
+        while(!bits) {
+                if(++w >= words)
+                        return (uint8_t *)last;
+                bits = ix->bits[w];
+        }
+
+        uint8_t *next = ix->input + w * INDEX_BLOCK + __builtin_ctzll(bits);
+        return next < last ? next : (uint8_t *)last;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#define JSONPG_HAVE_INDEX
+#endif
+
+// Bitmap index over in-memory input, 1 bit per input byte, built in a
+// single SIMD pass before parsing.
+// bits[n] marks the bytes that are not JSON whitespace for input
+// bytes 64n to 64n+63
+
+typedef struct input_index_s *input_index;
+
+struct input_index_s {
+        uint8_t *input;         // input the index was built for, NULL if none
+        uint64_t *bits;
+        size_t capacity;        // words allocated in bits
+};
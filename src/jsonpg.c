@@ -4,6 +4,8 @@
 #include "stack.h"
 #include "generate.h"
 #include "dom.h"
+#include "patch.h"
+#include "index.h"
 #include "parse.h"
 #include "state.h"
 
@@ -12,10 +14,17 @@
 #include "alloc.c"
 #include "strbuf.c"
 #include "utf8.c"
-#include "print.c"
+#include "scan.c"
 #include "stack.c"
 #include "error.c"
+#include "powers.c"
+#include "number.c"
+#include "print.c"
 #include "generate.c"
 #include "dom.c"
+#include "domfile.c"
+#include "index.c"
 #include "parse.c"
+#include "patch.c"
+#include "diff.c"
 #include "state.c"
@@ -13,6 +13,8 @@
 #define JSONPG_FLAG_OPTIONAL_COMMAS            0x40
 #define JSONPG_FLAG_IS_OBJECT                  0x80
 #define JSONPG_FLAG_IS_ARRAY                   0x100
+#define JSONPG_FLAG_INDEX                      0x200
+#define JSONPG_FLAG_RAW_NUMBERS                0x400
 
 typedef enum {
         JSONPG_NONE,
@@ -21,7 +23,9 @@ typedef enum {
         JSONPG_FALSE,
         JSONPG_TRUE,
         JSONPG_INTEGER,
+        JSONPG_UNSIGNED,        // integer > LONG_MAX
         JSONPG_REAL,
+        JSONPG_NUMBER,          // unconverted, see JSONPG_FLAG_RAW_NUMBERS
         JSONPG_STRING,
         JSONPG_KEY,
         JSONPG_BEGIN_ARRAY,
@@ -57,6 +61,7 @@ typedef struct {
 
 typedef union {
         long integer;
+        unsigned long uinteger;
         double real;
 } jsonpg_number_value;
 
@@ -78,7 +83,9 @@ typedef struct {
         int (*boolean)(void *ctx, bool is_true);
         int (*null)(void *ctx);
         int (*integer)(void *ctx, long integer);
+        int (*uinteger)(void *ctx, unsigned long uinteger);
         int (*real)(void *ctx, double real);
+        int (*number)(void *ctx, uint8_t *bytes, size_t length);
         int (*string)(void *ctx, uint8_t *bytes, size_t length);
         int (*key)(void *ctx, uint8_t *bytes , size_t length);
         int (*begin_array)(void *ctx);
@@ -93,14 +100,30 @@ typedef struct jsonpg_generator_s *jsonpg_generator;
 typedef struct jsonpg_dom_s       *jsonpg_dom;
 
 
+// Replace the process wide allocators, malloc/realloc/free by default
+// Should be called before any parsers or generators are created
 void jsonpg_set_allocators(
                 void *(*malloc)(size_t), 
                 void *(*realloc)(void *, size_t),
                 void (*free)(void *));
 
+// Allocator for an individual parser or generator, for example a
+// per-thread pool or a request scoped arena
+// The allocator must outlive any parser or generator that uses it
+// Without one memory comes from the process wide allocators
+// with freed memory cached per thread for reuse
+typedef struct {
+        void *(*alloc)(void *ctx, size_t size);
+        void *(*realloc)(void *ctx, void *p, size_t size);
+        void (*free)(void *ctx, void *p);
+        void *ctx;
+} jsonpg_allocator;
+
 typedef struct {
         uint16_t max_nesting;   // required to track array/object nesting
         uint16_t flags;          // mask of JSONPG_FLAG_... values above
+        bool allow_heap;        // see jsonpg_parser_init
+        jsonpg_allocator *allocator;    // NULL for the default
 } jsonpg_parser_opts;
 
 jsonpg_parser jsonpg_parser_new_opt(jsonpg_parser_opts);
@@ -108,9 +131,34 @@ jsonpg_parser jsonpg_parser_new_opt(jsonpg_parser_opts);
                 (jsonpg_parser_opts){ .max_nesting = 1024,  \
                                        __VA_ARGS__ })           
 
+// Create a parser in caller supplied memory, such as a stack buffer
+// All of the parser's memory comes from there, when it runs out
+// parsing fails with JSONPG_ERROR_ALLOC unless .allow_heap is set
+// in which case further memory is allocated as usual
+// Returns NULL if the memory is too small for the parser itself
+// jsonpg_parser_free must still be called if .allow_heap is set,
+// the caller's memory is never freed
+jsonpg_parser jsonpg_parser_init_opt(void *, size_t, jsonpg_parser_opts);
+#define jsonpg_parser_init(M, S, ...)   jsonpg_parser_init_opt(     \
+                (M), (S),                                           \
+                (jsonpg_parser_opts){ .max_nesting = 1024,          \
+                                       __VA_ARGS__ })           
+
 // Example: create a parser that will permit comments and trailing commas
 // jsonpg_parser_new(.flags = JSONPG_FLAG_COMMENTS 
 //                              | JSONPG_FLAG_TRAILING_COMMAS);
+//
+// JSONPG_FLAG_INDEX makes the parser build a SIMD index of .bytes/.string
+// input before parsing so that runs of string bytes and whitespace
+// can be skipped. It is ignored if SSE2/AVX2 is not available
+// and has no effect on .fd/.reader input
+//
+// JSONPG_FLAG_RAW_NUMBERS makes the parser return every number as
+// JSONPG_NUMBER with the number's JSON text as a string value, no
+// conversion is done so out of range numbers are not errors.
+// Printers write JSONPG_NUMBER values unchanged, callbacks without
+// .number get them converted to integer/uinteger/real.
+// Use jsonpg_convert_number to convert one when needed
 
 
 // Read JSON from somewhere custom
@@ -130,6 +178,7 @@ typedef struct {
         // See parser_opts above for desriptions
         uint16_t max_nesting;
         uint16_t flags;      
+        jsonpg_allocator *allocator;
 
         // Input options, specify one type only
         // If none are supplied then fd = 0 (stdin) is used
@@ -147,14 +196,25 @@ typedef struct {
         // Optional callbacks and callback ctx for SAX style parsing
         // This is a common use case so providing the options here
         // saves the caller having to create and free a generator themselves
-        // Ignored if a parser option is specified
+        // Values without a callback are skipped, except integers above
+        // LONG_MAX which go to .real if there is no .uinteger
         jsonpg_callbacks *callbacks;
         void *ctx;
 
         // Optional generator
-        // Ignored if callbacks/ctx or parser options are specified
+        // Ignored if callbacks/ctx are specified
         jsonpg_generator generator;
 
+        // Optional RFC 7386 merge patch applied to the input on its way
+        // to the callbacks or generator, the patched JSON is never held
+        // in memory. Ignored for pull parsing
+        jsonpg_dom merge_patch;
+
+        // If a parser is supplied with callbacks or a generator then it
+        // parses to them and is not freed, so that it can be used again
+        // If a parser is supplied without them then it is set up for
+        // pull parsing with jsonpg_parse_next
+
 } jsonpg_parse_opts;
 
 jsonpg_value jsonpg_parse_opt(jsonpg_parse_opts);
@@ -174,6 +234,11 @@ jsonpg_value jsonpg_parse_opt(jsonpg_parse_opts);
 jsonpg_type jsonpg_parse_next(jsonpg_parser);
 jsonpg_value jsonpg_parse_result(jsonpg_parser);
 
+// Convert the JSON text of a number, such as a JSONPG_NUMBER value,
+// returns a JSONPG_INTEGER, JSONPG_UNSIGNED or JSONPG_REAL value
+// or a JSONPG_ERROR value if the text is not a JSON number or is out of range
+jsonpg_value jsonpg_convert_number(uint8_t *bytes, size_t length);
+
 // Example, pull parsing from string
 //          allow single quotes to make JSON string creation simpler
 //
@@ -200,6 +265,8 @@ jsonpg_value jsonpg_parse_result(jsonpg_parser);
 typedef struct jsonpg_writer_s *jsonpg_writer;
 struct jsonpg_writer_s {
         // Like standard write function except first argument is supplied ctx
+        // Returns the count written (0 is also taken to mean all of it)
+        // or -1 on error, short writes are retried with the remainder
         ssize_t (*write)(void *, const void *, size_t);
         void *ctx;
 };
@@ -219,6 +286,18 @@ typedef struct {
         jsonpg_callbacks *callbacks;
         void *ctx;
 
+        // Output to fd or writer is collected in a buffer of this size
+        // and only written when the buffer is full, on jsonpg_generator_flush
+        // or on jsonpg_generator_free
+        // 0 = default size (16K)
+        size_t buffer_size;
+
+        // See jsonpg_generator_init
+        bool allow_heap;
+
+        // NULL for the default, see jsonpg_allocator
+        jsonpg_allocator *allocator;
+
         // Validation of JSON format, the correct nesting of arrays/objects
         // And the correct positioning of keys requires the nesting of
         // these items to be tracked
@@ -233,6 +312,14 @@ jsonpg_generator jsonpg_generator_new_opt(jsonpg_generator_opts);
                 (jsonpg_generator_opts){ .max_nesting = 1024,   \
                                          __VA_ARGS__ })           
 
+// Create a generator in caller supplied memory, as jsonpg_parser_init
+// The output buffer, buffer output and DOM all come from that memory
+jsonpg_generator jsonpg_generator_init_opt(void *, size_t, jsonpg_generator_opts);
+#define jsonpg_generator_init(M, S, ...)  jsonpg_generator_init_opt(    \
+                (M), (S),                                               \
+                (jsonpg_generator_opts){ .max_nesting = 1024,           \
+                                         __VA_ARGS__ })           
+
 // The lifetime of results is that of their generator.
 // A string or dom returned from these functions should not be used
 // once their generator has been freed
@@ -241,16 +328,157 @@ jsonpg_dom jsonpg_result_dom(jsonpg_generator);
 char *jsonpg_result_string(jsonpg_generator);
 size_t jsonpg_result_bytes(jsonpg_generator, uint8_t **);
 
+// Random access to a DOM
+// A cursor refers to a value in a DOM, or to nothing in which case
+// its type is JSONPG_NONE. Arrays and objects are JSONPG_BEGIN_ARRAY
+// and JSONPG_BEGIN_OBJECT values, moving past one is O(1)
+// Cursors must not be used once their DOM is reset or freed
+typedef struct {
+        jsonpg_dom dom;
+        uint64_t at;            // the value
+        uint64_t key;           // its key if an object member
+} jsonpg_cursor;
+
+jsonpg_cursor jsonpg_dom_root(jsonpg_dom);
+jsonpg_type jsonpg_cursor_type(jsonpg_cursor);
+jsonpg_value jsonpg_cursor_value(jsonpg_cursor);
+jsonpg_string_value jsonpg_cursor_key(jsonpg_cursor);
+
+// Number of elements of an array or members of an object, otherwise 0
+size_t jsonpg_cursor_count(jsonpg_cursor);
+
+// First element or member of an array or object, then the ones after it
+jsonpg_cursor jsonpg_cursor_first(jsonpg_cursor);
+jsonpg_cursor jsonpg_cursor_next(jsonpg_cursor);
+
+// Array element by index, object member by key
+// The first lookup in a large object builds a hash index of its keys
+// in the DOM, so lookups in one DOM from several threads must be
+// serialised. Later lookups in that object are O(1)
+jsonpg_cursor jsonpg_cursor_index(jsonpg_cursor, size_t);
+jsonpg_cursor jsonpg_cursor_get(jsonpg_cursor, uint8_t *, size_t);
+
+// A DOM is built in as few blocks of memory as possible, one if the
+// size of the input is known (bytes, string, DOM or a file's fd)
+// Compacting a DOM copies it into one block of exactly the right size
+// and frees the others, it can then be read with fewer cache misses
+// It also drops anything left behind by edits
+// Returns 0 on success, -1 if memory cannot be allocated in which case
+// the DOM is unchanged. Cursors must not be used after compacting
+int jsonpg_dom_compact(jsonpg_dom);
+
+// Save a DOM to a file that can be mapped back into memory, ready to
+// use without parsing it again. Returns 0 on success, -1 on failure
+// The file is only readable by a jsonpg built for the same byte order
+int jsonpg_dom_save(jsonpg_dom, int fd);
+
+// Map a file saved by jsonpg_dom_save, returns NULL if the file cannot
+// be opened or is not a DOM file. The DOM can be replayed with
+// jsonpg_parse(.dom = ...), navigated with cursors and edited, edits
+// are not written back to the file
+// Files are trusted, a damaged file can give undefined behaviour
+// jsonpg_dom_close unmaps the file and frees the DOM
+jsonpg_dom jsonpg_dom_open_mmap(const char *path);
+void jsonpg_dom_close(jsonpg_dom);
+
+// Edit a complete DOM in place
+// New values are scalars, or empty arrays and objects given as
+// JSONPG_BEGIN_ARRAY and JSONPG_BEGIN_OBJECT values
+// An edit only writes memory for the values it adds, anything it
+// replaces or removes is kept until the DOM is compacted
+// Cursors stay valid, except those to removed values and to the
+// values inside a replaced array or object
+// Each returns 0 on success, -1 if the cursor is not of the right
+// type, the index or key is not there or memory cannot be allocated
+
+// Replace the value at a cursor
+int jsonpg_dom_set(jsonpg_cursor, jsonpg_value);
+
+// Insert a value into an array before the element at index,
+// or append it if index is the array's count
+int jsonpg_dom_insert(jsonpg_cursor, size_t index, jsonpg_value);
+int jsonpg_dom_remove(jsonpg_cursor, size_t index);
+
+// Replace the value of an object's member with key, or add the member
+int jsonpg_dom_put(jsonpg_cursor, uint8_t *key, size_t length, jsonpg_value);
+int jsonpg_dom_delete(jsonpg_cursor, uint8_t *key, size_t length);
+
+// Apply an RFC 7386 JSON Merge Patch or an RFC 6902 JSON Patch to a DOM
+// The time taken depends on the size of the patch, not of the DOM,
+// although the first lookup in a large object indexes it
+// Returns 0 on success, -1 if the patch is not valid or cannot be
+// applied. A JSON Patch stops at the first operation that fails,
+// the operations before it are left applied
+int jsonpg_dom_merge_patch(jsonpg_dom, jsonpg_dom patch);
+int jsonpg_dom_apply_patch(jsonpg_dom, jsonpg_dom patch);
+
+// Example, apply a merge patch to a file while printing it
+// jsonpg_dom patch = ...;
+// jsonpg_generator g = jsonpg_generator_new(.fd = 1);
+// jsonpg_parse(.fd = fd, .merge_patch = patch, .generator = g);
+
+// Write an RFC 6902 JSON Patch that turns the first DOM into the second
+// to a generator, as an array of operations
+// Arrays and objects that are the same in both are found by hashing
+// them, the hashes are kept until the DOMs are next edited so that
+// diffing a DOM again only hashes the other one
+// Returns 0 on success, -1 if either DOM is empty or incomplete,
+// memory cannot be allocated or the generator fails
+int jsonpg_dom_diff(jsonpg_dom, jsonpg_dom, jsonpg_generator);
+
+// Store a hash of every array and object in a complete DOM so that
+// comparing them, and diffing the DOM, can tell they differ without
+// looking inside them. Hashes are dropped when the DOM is edited
+// Returns 0 on success, -1 if the DOM is incomplete or memory
+// cannot be allocated
+int jsonpg_dom_store_hashes(jsonpg_dom);
+
+// Hash of the value at a cursor, equal values have equal hashes
+// whatever the order of object members or the form of numbers
+// Arrays and objects use their stored hash, if any, or are hashed
+// from all of their values
+uint64_t jsonpg_dom_hash(jsonpg_cursor);
+
+// Whether the values at two cursors, in the same or different DOMs,
+// are equal as JSON. Arrays and objects are only compared in full if
+// their stored hashes are the same or they do not both have one
+bool jsonpg_dom_equal(jsonpg_cursor, jsonpg_cursor);
+
+// Example, find "statuses"[57]."user"."id"
+// jsonpg_cursor c = jsonpg_dom_root(jsonpg_result_dom(g));
+// c = jsonpg_cursor_get(c, (uint8_t *)"statuses", 8);
+// c = jsonpg_cursor_index(c, 57);
+// c = jsonpg_cursor_get(c, (uint8_t *)"user", 4);
+// c = jsonpg_cursor_get(c, (uint8_t *)"id", 2);
+// if(jsonpg_cursor_type(c) == JSONPG_INTEGER)
+//         id = jsonpg_cursor_value(c).number.integer;
+
 void jsonpg_parser_free(jsonpg_parser);
 void jsonpg_generator_free(jsonpg_generator);
 
+// Reuse parsers and generators without freeing their memory
+// A parser is reset whenever it is passed to jsonpg_parse
+// A generator is reset to start a new document: buffered fd or writer
+// output is flushed, buffer output is discarded, a DOM is emptied
+// and any error is cleared
+// Results from before the reset must not be used after it
+// jsonpg_generator_reset returns 0 on success or -1 if the flush fails
+void jsonpg_parser_reset(jsonpg_parser);
+int jsonpg_generator_reset(jsonpg_generator);
+
+// Write any buffered fd or writer output
+// Returns 0 on success, -1 on failure (see jsonpg_result_error)
+int jsonpg_generator_flush(jsonpg_generator);
+
 // Write JSON items to a generator
 // Macros to make this more concise can be found in
 // jsonpg_def_macros.h
 int jsonpg_null(jsonpg_generator);
 int jsonpg_boolean(jsonpg_generator, bool);
 int jsonpg_integer(jsonpg_generator, long);
+int jsonpg_uinteger(jsonpg_generator, unsigned long);
 int jsonpg_real(jsonpg_generator, double);
+int jsonpg_number(jsonpg_generator, uint8_t *, size_t);
 int jsonpg_string(jsonpg_generator, uint8_t *, size_t);
 int jsonpg_key(jsonpg_generator, uint8_t *, size_t);
 int jsonpg_begin_array(jsonpg_generator);
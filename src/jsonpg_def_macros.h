@@ -41,7 +41,9 @@
 #define false()         jsonpg_boolean((JSONPG_GEN), false)
 #define null()          jsonpg_null((JSONPG_GEN))
 #define integer(I)      jsonpg_integer((JSONPG_GEN), (I))
+#define uinteger(U)     jsonpg_uinteger((JSONPG_GEN), (U))
 #define real(R)         jsonpg_real((JSONPG_GEN), (R))
+#define number(B, C)    jsonpg_number((JSONPG_GEN), (B), (C))
 #define key_bytes(B, C) jsonpg_key((JSONPG_GEN), (B), (C))
 #define str_bytes(B, C) jsonpg_string((JSONPG_GEN), (B), (C))
 #define begin_object()  jsonpg_begin_object((JSONPG_GEN))
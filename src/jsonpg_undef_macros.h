@@ -12,7 +12,9 @@
 #undef is_false
 #undef is_null
 #undef integer
+#undef uinteger
 #undef real
+#undef number
 #undef key_bytes
 #undef str_bytes
 #undef begin_object
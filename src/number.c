@@ -0,0 +1,643 @@
+/*
+ * number.c
+ *   Conversion of number tokens delimited by the state machine
+ *   and formatting of numbers for printing
+ *
+ *   The state machine has already checked the JSON number syntax
+ *   so these only have to convert, and detect out of range values.
+ *   They never read outside of the token, which need not be followed
+ *   by a non-digit when parsing .bytes input
+ */
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <locale.h>
+
+#define NUMBER_INTEGER  0       // fits in long
+#define NUMBER_UNSIGNED 1       // only fits in unsigned long
+#define NUMBER_REAL     2       // normal double or zero
+#define NUMBER_SLOW     3       // needs number_strtod
+#define NUMBER_RANGE    -1      // does not fit
+
+#define NUMBER_MAX_DIGITS 19    // decimal digits that always fit in 64 bits
+
+// Converts 8 ASCII digits into their value, most significant first
+static uint64_t number_digits_8(const uint8_t *bytes)
+{
+        uint64_t v;
+        memcpy(&v, bytes, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        v -= 0x3030303030303030ULL;
+        // combine adjacent digits, then pairs, then quads
+        v = (v * 10 + (v >> 8)) & 0x00FF00FF00FF00FFULL;
+        v = (v * 100 + (v >> 16)) & 0x0000FFFF0000FFFFULL;
+        v = (v * 10000 + (v >> 32)) & 0x00000000FFFFFFFFULL;
+        return v;
+}
+
+// Magnitude of the digits from bytes to last
+// Returns 0 on success, -1 if it does not fit in 64 bits
+static int number_magnitude(const uint8_t *bytes, const uint8_t *last, uint64_t *result)
+{
+        uint64_t v = 0;
+
+        const uint8_t *safe = (last - bytes > NUMBER_MAX_DIGITS) 
+                ? bytes + NUMBER_MAX_DIGITS 
+                : last;
+        while(safe - bytes >= 8) {
+                v = v * 100000000 + number_digits_8(bytes);
+                bytes += 8;
+        }
+        while(bytes < safe)
+                v = v * 10 + (*bytes++ - '0');
+
+        while(bytes < last) {
+                if(__builtin_mul_overflow(v, 10, &v)
+                                || __builtin_add_overflow(v, *bytes++ - '0', &v))
+                        return -1;
+        }
+
+        *result = v;
+        return 0;
+}
+
+// Converts the integer token from bytes to last
+// Sets integer or uinteger depending on the NUMBER_ type returned
+static int number_integer(
+                const uint8_t *bytes,
+                const uint8_t *last,
+                long *integer,
+                unsigned long *uinteger)
+{
+        int negative = (*bytes == '-');
+        uint64_t m;
+        if(number_magnitude(bytes + negative, last, &m))
+                return NUMBER_RANGE;
+
+        if(negative) {
+                if(m > (uint64_t)INT64_MAX + 1)
+                        return NUMBER_RANGE;
+                *integer = (long)(0 - m);
+                return NUMBER_INTEGER;
+        }
+
+        if(m > INT64_MAX) {
+                *uinteger = m;
+                return NUMBER_UNSIGNED;
+        }
+        *integer = m;
+        return NUMBER_INTEGER;
+}
+
+// Exact powers of 10 for the fast path
+static const double number_exact_pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Mantissa, without the implicit bit, and biased exponent of a double
+typedef struct {
+        uint64_t mantissa;
+        int32_t power2;
+} number_binary;
+
+#define NUMBER_MANTISSA_BITS 52
+#define NUMBER_MIN_EXPONENT  -1023
+#define NUMBER_INFINITE      0x7FF
+
+// Eisel-Lemire: w * 10^q, correctly rounded, from a 128 bit
+// approximation of 5^q
+// Returns power2 < 0 if the approximation is not good enough to decide
+// See Lemire, "Number Parsing at a Gigabyte per Second"
+static number_binary number_eisel_lemire(int64_t q, uint64_t w)
+{
+        number_binary b = {0, 0};
+        if(w == 0 || q < NUMBER_MIN_POW10)
+                return b;
+        if(q > NUMBER_MAX_POW10) {
+                b.power2 = NUMBER_INFINITE;
+                return b;
+        }
+
+        int lz = __builtin_clzll(w);
+        w <<= lz;
+
+        const uint64_t *pow5 = number_pow5[q - NUMBER_MIN_POW10];
+        unsigned __int128 product = (unsigned __int128)w * pow5[0];
+        uint64_t high = product >> 64;
+        uint64_t low = product;
+
+        // only the top 55 bits are needed, if the bits below them are
+        // all ones then the truncated part of 5^q could carry into them
+        uint64_t mask = 0xFFFFFFFFFFFFFFFFULL >> (NUMBER_MANTISSA_BITS + 3);
+        if((high & mask) == mask) {
+                uint64_t second = ((unsigned __int128)w * pow5[1]) >> 64;
+                low += second;
+                if(second > low)
+                        high++;
+                if(low == 0xFFFFFFFFFFFFFFFFULL && (q < -27 || q > 55)) {
+                        b.power2 = -1;
+                        return b;
+                }
+        }
+
+        int upperbit = high >> 63;
+        int shift = upperbit + 64 - NUMBER_MANTISSA_BITS - 3;
+        b.mantissa = high >> shift;
+        // floor(log2(10^q)) = floor(q * log2(10)) for |q| < 1700
+        b.power2 = (((152170 + 65536) * (int32_t)q) >> 16) + 63
+                + upperbit - lz - NUMBER_MIN_EXPONENT;
+
+        if(b.power2 <= 0) {
+                // subnormal or zero
+                if(-b.power2 + 1 >= 64) {
+                        b.power2 = 0;
+                        b.mantissa = 0;
+                        return b;
+                }
+                b.mantissa >>= -b.power2 + 1;
+                b.mantissa += b.mantissa & 1;
+                b.mantissa >>= 1;
+                b.power2 = (b.mantissa < (1ULL << NUMBER_MANTISSA_BITS)) ? 0 : 1;
+                return b;
+        }
+
+        // exactly half way between two doubles rounds to even,
+        // only possible when 5^q fits in 64 bits
+        if(low <= 1 && q >= -4 && q <= 23 && (b.mantissa & 3) == 1
+                        && (b.mantissa << shift) == high)
+                b.mantissa &= ~1ULL;
+
+        b.mantissa += b.mantissa & 1;
+        b.mantissa >>= 1;
+        if(b.mantissa >= (2ULL << NUMBER_MANTISSA_BITS)) {
+                b.mantissa = 1ULL << NUMBER_MANTISSA_BITS;
+                b.power2++;
+        }
+        b.mantissa &= ~(1ULL << NUMBER_MANTISSA_BITS);
+        if(b.power2 >= NUMBER_INFINITE) {
+                b.power2 = NUMBER_INFINITE;
+                b.mantissa = 0;
+        }
+        return b;
+}
+
+static int number_binary_equal(number_binary b1, number_binary b2)
+{
+        return b1.mantissa == b2.mantissa && b1.power2 == b2.power2;
+}
+
+// Converts the real token from bytes to last, correctly rounded
+// Returns NUMBER_RANGE for results that are infinite, subnormal or
+// underflow to zero, as strtod would set ERANGE or return a 
+// non-normal value for them
+// Returns NUMBER_SLOW if the result cannot be decided without
+// more than 19 significant digits
+static int number_real(const uint8_t *bytes, const uint8_t *last, double *real)
+{
+        int negative = (*bytes == '-');
+        bytes += negative;
+
+        // up to 19 significant digits in w, the rest only affect 
+        // the exponent and whether the number was truncated
+        uint64_t w = 0;
+        int digits = 0;
+        int64_t q = 0;
+        int truncated = 0;
+
+        while(bytes < last && *bytes == '0')
+                bytes++;
+        while(bytes < last && *bytes >= '0' && *bytes <= '9') {
+                if(digits < NUMBER_MAX_DIGITS) {
+                        w = w * 10 + (*bytes - '0');
+                        digits++;
+                } else {
+                        truncated |= (*bytes != '0');
+                        q++;
+                }
+                bytes++;
+        }
+
+        if(bytes < last && *bytes == '.') {
+                bytes++;
+                if(!digits) {
+                        while(bytes < last && *bytes == '0') {
+                                bytes++;
+                                q--;
+                        }
+                }
+                while(last - bytes >= 8 && digits + 8 <= NUMBER_MAX_DIGITS) {
+                        uint64_t v;
+                        memcpy(&v, bytes, sizeof(v));
+                        // all 8 are digits if no byte < '0' or > '9'
+                        if(((v & 0xF0F0F0F0F0F0F0F0ULL)
+                                        | (((v + 0x0606060606060606ULL)
+                                                & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+                                        != 0x3333333333333333ULL)
+                                break;
+                        w = w * 100000000 + number_digits_8(bytes);
+                        digits += 8;
+                        q -= 8;
+                        bytes += 8;
+                }
+                while(bytes < last && *bytes >= '0' && *bytes <= '9') {
+                        if(digits < NUMBER_MAX_DIGITS) {
+                                w = w * 10 + (*bytes - '0');
+                                digits++;
+                                q--;
+                        } else {
+                                truncated |= (*bytes != '0');
+                        }
+                        bytes++;
+                }
+        }
+
+        if(bytes < last && (*bytes == 'e' || *bytes == 'E')) {
+                bytes++;
+                int negative_exp = (*bytes == '-');
+                if(*bytes == '-' || *bytes == '+')
+                        bytes++;
+                int64_t e = 0;
+                while(bytes < last) {
+                        // anything this big is 0 or infinity
+                        if(e < 100000)
+                                e = e * 10 + (*bytes - '0');
+                        bytes++;
+                }
+                q += negative_exp ? -e : e;
+        }
+
+        double d;
+        if(!truncated && w <= (1ULL << 53) && q >= -22 && q <= 22) {
+                // w and 10^|q| are exact doubles so IEEE rounding 
+                // of a single multiply or divide is correct
+                d = (double)w;
+                if(q < 0)
+                        d /= number_exact_pow10[-q];
+                else
+                        d *= number_exact_pow10[q];
+        } else {
+                number_binary b = number_eisel_lemire(q, w);
+                if(truncated && b.power2 >= 0) {
+                        // the true value is between w and w + 1
+                        if(!number_binary_equal(b, number_eisel_lemire(q, w + 1)))
+                                b.power2 = -1;
+                }
+                // strtod reports underflow for values that round
+                // up to the smallest normal, let it decide those
+                if(b.power2 < 0 || (b.power2 == 1 
+                                && !(b.mantissa & ((1ULL << NUMBER_MANTISSA_BITS) - 1))))
+                        return NUMBER_SLOW;
+                if(b.power2 == 0 && w != 0)
+                        return NUMBER_RANGE;
+                if(b.power2 == NUMBER_INFINITE)
+                        return NUMBER_RANGE;
+
+                uint64_t bits = b.mantissa 
+                        | ((uint64_t)b.power2 << NUMBER_MANTISSA_BITS);
+                memcpy(&d, &bits, sizeof(d));
+        }
+
+        *real = negative ? -d : d;
+        return NUMBER_REAL;
+}
+
+// Locale independent strtod for the rare numbers that number_real
+// cannot decide, number must be NUL terminated
+static int number_strtod(const char *number, double *real)
+{
+        static locale_t c_locale = (locale_t)0;
+        locale_t loc = __atomic_load_n(&c_locale, __ATOMIC_ACQUIRE);
+        if(!loc) {
+                locale_t new = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+                if(!new)
+                        return NUMBER_RANGE;
+                loc = (locale_t)0;
+                if(__atomic_compare_exchange_n(&c_locale, &loc, new, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                        loc = new;
+                else
+                        freelocale(new);
+        }
+
+        locale_t old = uselocale(loc);
+        errno = 0;
+        double d = strtod(number, NULL);
+        int range = errno;
+        uselocale(old);
+
+        if(range || !(d == 0 || isnormal(d)))
+                return NUMBER_RANGE;
+
+        *real = d;
+        return NUMBER_REAL;
+}
+
+static const uint8_t *number_skip_digits(const uint8_t *bytes, const uint8_t *last)
+{
+        while(bytes < last && *bytes >= '0' && *bytes <= '9')
+                bytes++;
+        return bytes;
+}
+
+// Checks bytes to last against the JSON number grammar
+// Returns NUMBER_INTEGER or NUMBER_REAL for the form of the number
+// or NUMBER_RANGE if it is not a JSON number
+static int number_check(const uint8_t *bytes, const uint8_t *last)
+{
+        const uint8_t *digits;
+        int result = NUMBER_INTEGER;
+
+        if(bytes < last && *bytes == '-')
+                bytes++;
+        if(bytes < last && *bytes == '0')
+                bytes++;
+        else if((digits = number_skip_digits(bytes, last)) > bytes)
+                bytes = digits;
+        else
+                return NUMBER_RANGE;
+
+        if(bytes < last && *bytes == '.') {
+                digits = number_skip_digits(++bytes, last);
+                if(digits == bytes)
+                        return NUMBER_RANGE;
+                bytes = digits;
+                result = NUMBER_REAL;
+        }
+
+        if(bytes < last && (*bytes == 'e' || *bytes == 'E')) {
+                bytes++;
+                if(bytes < last && (*bytes == '-' || *bytes == '+'))
+                        bytes++;
+                digits = number_skip_digits(bytes, last);
+                if(digits == bytes)
+                        return NUMBER_RANGE;
+                bytes = digits;
+                result = NUMBER_REAL;
+        }
+
+        return bytes == last ? result : NUMBER_RANGE;
+}
+
+jsonpg_value jsonpg_convert_number(uint8_t *bytes, size_t length)
+{
+        jsonpg_value v = { .type = JSONPG_ERROR };
+        const uint8_t *last = bytes + length;
+        int r;
+
+        switch(number_check(bytes, last)) {
+        case NUMBER_INTEGER:
+                r = number_integer(bytes, last,
+                                &v.number.integer, &v.number.uinteger);
+                if(r == NUMBER_INTEGER)
+                        v.type = JSONPG_INTEGER;
+                else if(r == NUMBER_UNSIGNED)
+                        v.type = JSONPG_UNSIGNED;
+                break;
+        case NUMBER_REAL:
+                r = number_real(bytes, last, &v.number.real);
+                if(r == NUMBER_SLOW) {
+                        char small[64];
+                        char *number = (length < sizeof(small))
+                                ? small
+                                : pg_alloc(length + 1);
+                        if(!number) {
+                                v.error = make_error(JSONPG_ERROR_ALLOC, 0);
+                                return v;
+                        }
+                        memcpy(number, bytes, length);
+                        number[length] = '\0';
+                        r = number_strtod(number, &v.number.real);
+                        if(number != small)
+                                pg_dealloc(number);
+                }
+                if(r == NUMBER_REAL)
+                        v.type = JSONPG_REAL;
+                break;
+        }
+
+        if(v.type == JSONPG_ERROR)
+                v.error = make_error(JSONPG_ERROR_NUMBER, 0);
+        return v;
+}
+
+// Upper 64 bits of g * cp, with the lowest bit set if any of the
+// discarded bits are, so that the result is rounded to odd
+static uint64_t number_round_to_odd(const uint64_t *g, uint64_t cp)
+{
+        unsigned __int128 x = (unsigned __int128)g[1] * cp;
+        unsigned __int128 y = (unsigned __int128)g[0] * cp + (uint64_t)(x >> 64);
+        uint64_t y0 = y;
+        uint64_t y1 = y >> 64;
+        return y1 | (y0 > 1);
+}
+
+// Shortest decimal, digits * 10^exponent, that converts back to the
+// finite, non-zero double with the given bits
+// See Giulietti, "The Schubfach way to render doubles"
+static uint64_t number_shortest(uint64_t bits, int32_t *exponent)
+{
+        uint64_t significand = bits & ((1ULL << NUMBER_MANTISSA_BITS) - 1);
+        int32_t biased = (bits >> NUMBER_MANTISSA_BITS) & NUMBER_INFINITE;
+        int32_t bias = -NUMBER_MIN_EXPONENT + NUMBER_MANTISSA_BITS;
+        uint64_t c;
+        int32_t q;
+
+        if(biased) {
+                c = significand | (1ULL << NUMBER_MANTISSA_BITS);
+                q = biased - bias;
+                // small integers are exact
+                if(q <= 0 && -q <= NUMBER_MANTISSA_BITS
+                                && !(c & ((1ULL << -q) - 1))) {
+                        *exponent = 0;
+                        return c >> -q;
+                }
+        } else {
+                c = significand;
+                q = 1 - bias;
+        }
+
+        int even = !(c & 1);
+        int lower_closer = (significand == 0 && biased > 1);
+
+        uint64_t cbl = 4 * c - 2 + lower_closer;
+        uint64_t cb = 4 * c;
+        uint64_t cbr = 4 * c + 2;
+
+        // k = floor(log10(2^q)), or floor(log10(3/4 2^q)) if lower_closer
+        int32_t k = (q * 1262611 - (lower_closer ? 524031 : 0)) >> 22;
+        // h = q + floor(log2(10^-k)) + 1, between 1 and 4
+        int32_t h = q + ((-k * 1741647) >> 19) + 1;
+
+        const uint64_t *g = number_pow10[-k - NUMBER_MIN_FORMAT_POW10];
+        uint64_t vbl = number_round_to_odd(g, cbl << h);
+        uint64_t vb = number_round_to_odd(g, cb << h);
+        uint64_t vbr = number_round_to_odd(g, cbr << h);
+
+        uint64_t lower = vbl + !even;
+        uint64_t upper = vbr - !even;
+
+        uint64_t s = vb / 4;
+        if(s >= 10) {
+                // one digit less, if only one of the candidates is in range
+                uint64_t sp = s / 10;
+                int up_inside = lower <= 40 * sp;
+                int wp_inside = 40 * sp + 40 <= upper;
+                if(up_inside != wp_inside) {
+                        *exponent = k + 1;
+                        return sp + wp_inside;
+                }
+        }
+
+        int u_inside = lower <= 4 * s;
+        int w_inside = 4 * s + 4 <= upper;
+        *exponent = k;
+        if(u_inside != w_inside)
+                return s + w_inside;
+
+        // both in range, pick the closest, ties to even
+        uint64_t mid = 4 * s + 2;
+        int round_up = vb > mid || (vb == mid && (s & 1));
+        return s + round_up;
+}
+
+static uint64_t number_int_pow10(int n)
+{
+        static const uint64_t pow10[] = {
+                1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+                1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL,
+                10000000000ULL, 100000000000ULL, 1000000000000ULL,
+                10000000000000ULL, 100000000000000ULL, 1000000000000000ULL,
+                10000000000000000ULL, 100000000000000000ULL,
+                1000000000000000000ULL, 10000000000000000000ULL
+        };
+        return pow10[n];
+}
+
+static const char number_digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+// Writes the count digits of value to buf, returns buf + count
+static char *number_write_digits(char *buf, uint64_t value, int count)
+{
+        char *p = buf + count;
+        while(p - buf >= 2) {
+                p -= 2;
+                memcpy(p, number_digit_pairs + 2 * (value % 100), 2);
+                value /= 100;
+        }
+        if(p > buf)
+                *--p = '0' + value;
+        return buf + count;
+}
+
+static int number_count_digits(uint64_t value)
+{
+        // bits * 1233 / 4096 is floor(log10(2^bits)), which is 
+        // the digit count or one less
+        value |= 1;
+        int bits = 64 - __builtin_clzll(value);
+        int count = (bits * 1233) >> 12;
+        return count + (value >= number_int_pow10(count));
+}
+
+// Writes value as decimal, buf must have room for NUMBER_INTEGER_MAX bytes
+// returns the length
+#define NUMBER_INTEGER_MAX 21
+static int number_format_uinteger(unsigned long value, char *buf)
+{
+        int count = number_count_digits(value);
+        number_write_digits(buf, value, count);
+        return count;
+}
+
+static int number_format_integer(long value, char *buf)
+{
+        if(value >= 0)
+                return number_format_uinteger(value, buf);
+        *buf = '-';
+        return 1 + number_format_uinteger(0 - (unsigned long)value, buf + 1);
+}
+
+// Writes the shortest representation of the finite double d that
+// converts back to d, in the style of printf %.16g but always with
+// a '.' or exponent so that it reads back as a real
+// buf must have room for NUMBER_REAL_MAX bytes, returns the length
+#define NUMBER_REAL_MAX 32
+static int number_format_real(double d, char *buf)
+{
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        char *p = buf;
+
+        if(bits >> 63)
+                *p++ = '-';
+        bits &= ~(1ULL << 63);
+        if(!bits) {
+                memcpy(p, "0.0", 3);
+                return p + 3 - buf;
+        }
+
+        int32_t exponent;
+        uint64_t digits = number_shortest(bits, &exponent);
+        while(digits % 10 == 0) {
+                digits /= 10;
+                exponent++;
+        }
+
+        int count = number_count_digits(digits);
+        int x = exponent + count - 1;   // exponent of first digit
+
+        if(x < -4 || x >= 16) {
+                // d.ddde+xx
+                char *first = p;
+                p = number_write_digits(p + 1, digits, count);
+                first[0] = first[1];
+                if(count > 1)
+                        first[1] = '.';
+                else
+                        p--;
+                *p++ = 'e';
+                *p++ = (x < 0) ? '-' : '+';
+                if(x < 0)
+                        x = -x;
+                if(x >= 100)
+                        *p++ = '0' + x / 100;
+                *p++ = '0' + (x / 10) % 10;
+                *p++ = '0' + x % 10;
+        } else if(x < 0) {
+                // 0.000ddd
+                *p++ = '0';
+                *p++ = '.';
+                for(int i = -1 ; i > x ; i--)
+                        *p++ = '0';
+                p = number_write_digits(p, digits, count);
+        } else if(count <= x + 1) {
+                // ddd000.0
+                p = number_write_digits(p, digits, count);
+                for(int i = count ; i <= x ; i++)
+                        *p++ = '0';
+                *p++ = '.';
+                *p++ = '0';
+        } else {
+                // ddd.ddd
+                p = number_write_digits(p, digits / number_int_pow10(count - x - 1), x + 1);
+                *p++ = '.';
+                p = number_write_digits(p, digits % number_int_pow10(count - x - 1), count - x - 1);
+        }
+
+        return p - buf;
+}
@@ -1,5 +1,6 @@
 #include <math.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #define MIN_STACK_SIZE 1024
 
@@ -96,32 +97,57 @@ static jsonpg_type end_array(jsonpg_parser p)
                 : set_result_error(p, JSONPG_ERROR_STACK_UNDERFLOW);
 }
 
+static jsonpg_type accept_number(jsonpg_parser p, token t)
+{
+        p->result.string.bytes = t->pos;
+        p->result.string.length = p->current - t->pos;
+        return JSONPG_NUMBER;
+}
+
 static jsonpg_type accept_integer(jsonpg_parser p, token t)
 {
-        errno = 0;
-        long integer = strtol((char *)t->pos, NULL, 10);
-        if(errno) 
+        if(p->flags & JSONPG_FLAG_RAW_NUMBERS)
+                return accept_number(p, t);
+
+        switch(number_integer(t->pos, p->current,
+                                &p->result.number.integer,
+                                &p->result.number.uinteger)) {
+        case NUMBER_INTEGER:
+                return JSONPG_INTEGER;
+        case NUMBER_UNSIGNED:
+                return JSONPG_UNSIGNED;
+        default:
                 return number_error(p);
-        p->result.number.integer = integer;
-        return JSONPG_INTEGER;
+        }
 }
 
 static jsonpg_type accept_real(jsonpg_parser p, token t)
 {
-        errno = 0;
-        double real = strtod((char *)t->pos, NULL);
-        if(errno) 
-                return number_error(p);
-
-        if(!(real == 0 || isnormal(real))) 
+        if(p->flags & JSONPG_FLAG_RAW_NUMBERS)
+                return accept_number(p, t);
+
+        int r = number_real(t->pos, p->current, &p->result.number.real);
+        if(r == NUMBER_SLOW) {
+                // strtod needs a terminated copy
+                uint8_t *number;
+                if(write_b(t->pos, p->current - t->pos) || write_c('\0'))
+                        return alloc_error(p);
+                get_content(&number);
+                r = number_strtod((char *)number, &p->result.number.real);
+                str_buf_reset(p->write_buf);
+        }
+        if(r != NUMBER_REAL)
                 return number_error(p);
 
-        p->result.number.real = real;
         return JSONPG_REAL;
 }
 
 static int set_string_value(jsonpg_parser p, token t)
 {
+        // Double quoted strings without escapes have been validated
+        // by the state machine and can be printed as they are
+        p->plain_string = !p->write_buf->count
+                && (t->type == token_string || t->type == token_key);
         if(p->write_buf->count) {
                 if(write_b(t->pos, p->current - t->pos))
                         return -1;
@@ -307,19 +333,17 @@ jsonpg_type jsonpg_parse_next(jsonpg_parser p)
                 return dom_parse_next(p);
 }
 
-static jsonpg_value parse(jsonpg_parser p, jsonpg_generator g)
+static jsonpg_value parse_result(jsonpg_generator g, int abort)
 {
-        jsonpg_type type;
-        int abort = 0;
-        while(!abort && JSONPG_EOF != (type = jsonpg_parse_next(p)))
-                abort = generate(g, type, &p->result);
-
         jsonpg_value val;
         if(abort) {
                 val.type = JSONPG_ERROR;
+                // A DOM generator only fails if it runs out of memory
                 val.error = g->error.code
                         ? g->error
-                        : make_error(JSONPG_ERROR_ABORT, 0);
+                        : make_error(g->callbacks == &dom_callbacks
+                                        ? JSONPG_ERROR_ALLOC
+                                        : JSONPG_ERROR_ABORT, 0);
         } else {
                 val = (jsonpg_value) { .type = JSONPG_EOF };
         }
@@ -327,6 +351,17 @@ static jsonpg_value parse(jsonpg_parser p, jsonpg_generator g)
         return val;
 }
 
+static jsonpg_value parse(jsonpg_parser p, jsonpg_generator g)
+{
+        jsonpg_type type;
+        int abort = 0;
+        while(!abort && JSONPG_EOF != (type = jsonpg_parse_next(p)))
+                abort = generate(g, type, &p->result,
+                                p->input && p->plain_string);
+
+        return parse_result(g, abort);
+}
+
 static void parser_set_bytes(
                 jsonpg_parser p, 
                 uint8_t *bytes, 
@@ -341,6 +376,11 @@ static void parser_set_bytes(
         p->token_ptr = 0;
         p->state = STATE_INITIAL;
 
+        if(p->flags & JSONPG_FLAG_INDEX)
+                index_build(p);
+        else
+                p->index.input = NULL;
+
         // Skip leading byte order mark
         p->current += utf8_bom_bytes(p->input, p->input_size);
 }
@@ -351,13 +391,17 @@ static jsonpg_type parser_set_reader(
                 void *ctx)
 {
         p->processed = 0;
-        p->input = p->current = arena_alloc(p->arena, BUF_SIZE);
-        if(!p->input)
-                return alloc_error(p);
+        if(!p->read_buf) {
+                p->read_buf = arena_alloc(p->arena, BUF_SIZE);
+                if(!p->read_buf)
+                        return alloc_error(p);
+        }
+        p->input = p->current = p->read_buf;
         p->input_size = BUF_SIZE;
 
         p->read_fn = read_fn;
         p->read_ctx = ctx;
+        p->index.input = NULL;
 
         int l = input_read(p, p->input);
         if(l < 0)
@@ -378,7 +422,7 @@ void parser_set_dom_info(jsonpg_parser p, dom_info di)
         p->dom_info = di;
 }
 
-jsonpg_parser parser_reset(jsonpg_parser p)
+static jsonpg_parser parser_reset(jsonpg_parser p)
 {
         p->write_buf = str_buf_reset(p->write_buf);
         
@@ -386,12 +430,18 @@ jsonpg_parser parser_reset(jsonpg_parser p)
         p->input = NULL;
         p->read_fn = NULL;
         p->read_ctx = NULL;
+        p->index.input = NULL;
 
         p->dom_info = (dom_info){};
 
         return p;
 }
 
+void jsonpg_parser_reset(jsonpg_parser p)
+{
+        parser_reset(p);
+}
+
 jsonpg_value jsonpg_parse_opt(jsonpg_parse_opts opts)
 {
         jsonpg_generator g;
@@ -402,7 +452,8 @@ jsonpg_value jsonpg_parse_opt(jsonpg_parse_opts opts)
         } else {
                 p = jsonpg_parser_new(
                                 .max_nesting = opts.max_nesting,
-                                .flags = opts.flags);
+                                .flags = opts.flags,
+                                .allocator = opts.allocator);
                 if(!p)
                         return make_error_return(JSONPG_ERROR_ALLOC, 0);
         }
@@ -419,8 +470,14 @@ jsonpg_value jsonpg_parse_opt(jsonpg_parse_opts opts)
                 return p->result;
         }
 
+        // DOM size needed if known, see dom_reserve
+        size_t dom_size_needed = 0;
+
         if(opts.fd > 0 || input_opt_count == 0) {
                 int fd = opts.fd > 0 ? opts.fd : 0;
+                struct stat st;
+                if(!fstat(fd, &st) && S_ISREG(st.st_mode))
+                        dom_size_needed = DOM_ESTIMATE(st.st_size);
                 if(parser_set_reader(p, read_fd, INT_TO_CTX(fd)))
                         return p->result;
         } else if(opts.reader) {
@@ -428,14 +485,17 @@ jsonpg_value jsonpg_parse_opt(jsonpg_parse_opts opts)
                         return p->result;
         } else if(opts.bytes) {
                  parser_set_bytes(p, opts.bytes, opts.count);
+                 dom_size_needed = DOM_ESTIMATE(opts.count);
         } else if(opts.string) {
                  parser_set_bytes(p, (uint8_t *)opts.string, strlen(opts.string));
+                 dom_size_needed = DOM_ESTIMATE(p->input_size);
         } else if(opts.dom) {
                 parser_set_dom_info(p, dom_parser_info(opts.dom));
+                dom_size_needed = dom_size(opts.dom);
         }
 
-        // Pull parsing, output opts ignored
-        if(opts.parser) {
+        // Pull parsing if a parser is supplied without any output opts
+        if(opts.parser && !opts.callbacks && !opts.generator) {
                 p->result.type = JSONPG_PULL;
                 return p->result;
         }
@@ -445,22 +505,24 @@ jsonpg_value jsonpg_parse_opt(jsonpg_parse_opts opts)
                 return p->result;
         }
 
+        // Callbacks need no validation so the generator
+        // needs no memory of its own
+        struct jsonpg_generator_s callbacks_g;
         if(opts.callbacks) {
-                g = generator_new(0);
-                if(!g) {
-                        alloc_error(p);
-                        return p->result;
-                }
+                g = generator_init(&callbacks_g);
                 generator_set_callbacks(g, opts.callbacks, opts.ctx);
         } else {
                 g = generator_reset(opts.generator);
+                if(g->callbacks == &dom_callbacks)
+                        dom_reserve(g->ctx, dom_size_needed);
         }
         
-        jsonpg_value result = parse(p, g);
+        jsonpg_value result = opts.merge_patch
+                ? parse_merge(p, g, opts.merge_patch)
+                : parse(p, g);
 
-        jsonpg_parser_free(p);
-        if(opts.callbacks)
-                jsonpg_generator_free(g);
+        if(!opts.parser)
+                jsonpg_parser_free(p);
 
         return result;
 }
@@ -470,7 +532,7 @@ static uint16_t get_stack_size(uint16_t stack_size)
         return stack_size > MIN_STACK_SIZE ? stack_size : MIN_STACK_SIZE;
 }
 
-jsonpg_parser jsonpg_parser_new_opt(jsonpg_parser_opts opts)
+static jsonpg_parser parser_create(arena a, jsonpg_parser_opts opts)
 {
         uint16_t stack_size = get_stack_size(opts.max_nesting);
         uint16_t flags = opts.flags;
@@ -478,42 +540,63 @@ jsonpg_parser jsonpg_parser_new_opt(jsonpg_parser_opts opts)
         size_t struct_bytes = sizeof(struct jsonpg_parser_s);
         // 1-8 => 1, 9-16 => 2, etc
         size_t stack_bytes = (stack_size + 7) / 8;
-        arena a = arena_new();
         if(!a)
                 return NULL;
         jsonpg_parser p = arena_alloc(a, struct_bytes + stack_bytes);
-        if(p) {
-                p->arena = a;
-                p->write_buf = str_buf_empty(a);
-                if(!p->write_buf) {
-                        jsonpg_parser_free(p);
-                        return NULL;
-                }
-
-                p->input = NULL;
+        if(!p) {
+                arena_free(a);
+                return NULL;
+        }
+        p->arena = a;
+        p->write_buf = str_buf_empty(a);
+        if(!p->write_buf) {
+                jsonpg_parser_free(p);
+                return NULL;
+        }
 
-                p->read_fn = NULL;
-                p->read_ctx = NULL;
+        p->input = NULL;
+        p->read_buf = NULL;
 
-                p->stack.size = stack_size;
-                p->stack.stack = (uint8_t *)(((void *)p) + struct_bytes);
-                p->flags = flags;
+        p->read_fn = NULL;
+        p->read_ctx = NULL;
 
-                if(flags & JSONPG_FLAG_IS_OBJECT) {
-                        p->stack.ptr = 0;
-                        push_stack(&p->stack, STACK_OBJECT);
-                        p->stack.ptr_min = 1;
-                } else if(flags & JSONPG_FLAG_IS_ARRAY) {
-                        p->stack.ptr = 0;
-                        push_stack(&p->stack, STACK_ARRAY);
-                        p->stack.ptr_min = 1;
-                } else {
-                        p->stack.ptr_min = 0;
-                }
+        p->index = (struct input_index_s){};
+        p->plain_string = false;
+
+        p->stack.size = stack_size;
+        p->stack.stack = (uint8_t *)(((void *)p) + struct_bytes);
+        p->flags = flags;
+
+        if(flags & JSONPG_FLAG_IS_OBJECT) {
+                p->stack.ptr = 0;
+                push_stack(&p->stack, STACK_OBJECT);
+                p->stack.ptr_min = 1;
+        } else if(flags & JSONPG_FLAG_IS_ARRAY) {
+                p->stack.ptr = 0;
+                push_stack(&p->stack, STACK_ARRAY);
+                p->stack.ptr_min = 1;
+        } else {
+                p->stack.ptr_min = 0;
         }
+
         return p;
 }
 
+jsonpg_parser jsonpg_parser_new_opt(jsonpg_parser_opts opts)
+{
+        return parser_create(arena_new(opts.allocator), opts);
+}
+
+jsonpg_parser jsonpg_parser_init_opt(
+                void *memory, 
+                size_t size, 
+                jsonpg_parser_opts opts)
+{
+        return parser_create(
+                        arena_init(opts.allocator, memory, size, !opts.allow_heap), 
+                        opts);
+}
+
 jsonpg_value jsonpg_parse_result(jsonpg_parser p)
 {
         return p->result;
@@ -48,6 +48,7 @@ struct jsonpg_parser_s {
         uint16_t flags;
         uint32_t input_size;
         uint8_t *input;   
+        uint8_t *read_buf;      // input buffer for fd/reader, kept for reuse
         uint8_t *current;
         uint8_t *last;
         size_t processed;
@@ -55,7 +56,9 @@ struct jsonpg_parser_s {
         ssize_t (*read_fn)(void *, void *, size_t);
         void *read_ctx;
         dom_info dom_info;
+        struct input_index_s index;
         jsonpg_value result;
+        bool plain_string;      // result string needs no escaping as JSON
         struct token_s tokens[TOKEN_MAX];
         struct stack_s stack;
 };
@@ -0,0 +1,598 @@
+/*
+ * patch.c
+ *   Applying RFC 7386 JSON Merge Patches and RFC 6902 JSON Patches
+ *
+ *   Patches are applied to a DOM with the editing functions in dom.c,
+ *   finding what to change with object lookups and array indexes, so
+ *   the time taken depends on the patch and not on the DOM.
+ *   A merge patch can also be applied to JSON as it is parsed,
+ *   see parse_merge
+ */
+
+// Writes the value at c, and any values in it, to a generator
+static int dom_generate(jsonpg_generator g, jsonpg_cursor c)
+{
+        dom_pos end = dom_pos_after(c.dom, c.at);
+        for(dom_pos pos = c.at ; pos != end ; pos = dom_pos_next(c.dom, pos)) {
+                jsonpg_value v = dom_node_value(dom_node_at(c.dom, pos));
+                if(generate(g, v.type, &v, false))
+                        return 1;
+        }
+        return 0;
+}
+
+static bool patch_string_is(jsonpg_string_value s, const char *string)
+{
+        size_t length = strlen(string);
+        return s.length == length && !memcmp(s.bytes, string, length);
+}
+
+static jsonpg_string_value cursor_key_string(jsonpg_cursor c)
+{
+        return dom_node_string(dom_node_at(c.dom, c.key));
+}
+
+/*
+ * Merge patches
+ */
+
+static int merge_patch(jsonpg_cursor target, jsonpg_cursor patch)
+{
+        if(cursor_type(patch) != JSONPG_BEGIN_OBJECT)
+                return dom_set(target, &(dom_edit){ .from = patch });
+
+        if(cursor_type(target) != JSONPG_BEGIN_OBJECT) {
+                if(dom_set(target, &(dom_edit){
+                                        .value.type = JSONPG_BEGIN_OBJECT }))
+                        return -1;
+                target = cursor_resolve(target);
+        }
+
+        for(jsonpg_cursor m = cursor_first(patch) ; m.at != DOM_NO_POS ; m = cursor_next(m)) {
+                jsonpg_string_value key = cursor_key_string(m);
+                jsonpg_cursor t = cursor_get(target, key.bytes, key.length);
+                switch(cursor_type(m)) {
+                case JSONPG_NULL:
+                        if(t.at != DOM_NO_POS
+                                        && jsonpg_dom_delete(target, key.bytes, key.length))
+                                return -1;
+                        break;
+                case JSONPG_BEGIN_OBJECT:
+                        // A new member is patched as an empty object
+                        if(t.at == DOM_NO_POS) {
+                                if(dom_put(target, key.bytes, key.length, &(dom_edit){
+                                                        .value.type = JSONPG_BEGIN_OBJECT }))
+                                        return -1;
+                                t = cursor_get(target, key.bytes, key.length);
+                        }
+                        if(merge_patch(t, m))
+                                return -1;
+                        break;
+                default:
+                        if(dom_put(target, key.bytes, key.length, &(dom_edit){ .from = m }))
+                                return -1;
+                }
+        }
+        return 0;
+}
+
+int jsonpg_dom_merge_patch(jsonpg_dom dom, jsonpg_dom patch)
+{
+        jsonpg_cursor root = jsonpg_dom_root(patch);
+        if(root.at == DOM_NO_POS || patch->open_count)
+                return -1;
+
+        return merge_patch(jsonpg_dom_root(dom), root);
+}
+
+/*
+ * Merge patching JSON as it is parsed
+ *
+ * Parse events pass through to the generator unless they are part of
+ * a value that the patch replaces or removes. Objects that the patch
+ * has members for are tracked so that the members it adds can be
+ * written at their end
+ */
+
+// An array or object being parsed
+struct merge_frame_s {
+        jsonpg_cursor patch;    // object patching it, if any
+        size_t used;            // its patch members seen start here in used
+};
+
+typedef struct merge_s {
+        jsonpg_generator g;
+        arena arena;
+        jsonpg_cursor root;     // the patch
+        jsonpg_cursor next;     // patch for the next value, if any
+        bool drop;              // drop the next value, the patch deletes it
+        size_t skip;            // nesting of a value being dropped
+        struct merge_frame_s *frames;
+        size_t frame_count;
+        size_t frame_size;
+        dom_pos *used;          // keys of patch members seen
+        size_t used_count;
+        size_t used_size;
+} *merge;
+
+// Grows an array in the arena to hold at least one more entry
+static void *merge_grow(merge m, void *array, size_t *size, size_t entry)
+{
+        size_t new_size = *size ? 2 * *size : 16;
+        void *grown = array
+                ? arena_realloc(m->arena, array, new_size * entry)
+                : arena_alloc(m->arena, new_size * entry);
+        if(grown)
+                *size = new_size;
+        return grown;
+}
+
+static int merge_alloc_error(merge m)
+{
+        m->g->error = make_error(JSONPG_ERROR_ALLOC, m->g->count);
+        return 1;
+}
+
+static int merge_push(merge m, jsonpg_cursor patch)
+{
+        if(m->frame_count == m->frame_size) {
+                void *frames = merge_grow(m, m->frames, &m->frame_size,
+                                sizeof(struct merge_frame_s));
+                if(!frames)
+                        return merge_alloc_error(m);
+                m->frames = frames;
+        }
+        m->frames[m->frame_count++] = (struct merge_frame_s){
+                .patch = patch,
+                .used = m->used_count
+        };
+        return 0;
+}
+
+// Writes a patch value as merged into nothing,
+// objects in it lose their null members
+static int merge_generate(jsonpg_generator g, jsonpg_cursor c)
+{
+        if(cursor_type(c) != JSONPG_BEGIN_OBJECT)
+                return dom_generate(g, c);
+
+        if(jsonpg_begin_object(g))
+                return 1;
+        for(jsonpg_cursor m = cursor_first(c) ; m.at != DOM_NO_POS ; m = cursor_next(m)) {
+                if(cursor_type(m) == JSONPG_NULL)
+                        continue;
+                jsonpg_string_value key = cursor_key_string(m);
+                if(jsonpg_key(g, key.bytes, key.length) || merge_generate(g, m))
+                        return 1;
+        }
+        return jsonpg_end_object(g);
+}
+
+static int merge_value(merge m, jsonpg_type type, jsonpg_value *value, bool plain)
+{
+        bool begin = type == JSONPG_BEGIN_ARRAY || type == JSONPG_BEGIN_OBJECT;
+        if(m->drop) {
+                m->drop = false;
+                m->skip = begin;
+                return 0;
+        }
+
+        jsonpg_cursor patch = m->frame_count ? m->next : m->root;
+        m->next = cursor_none(patch.dom);
+        if(patch.at == DOM_NO_POS
+                        || (type == JSONPG_BEGIN_OBJECT
+                                && cursor_type(patch) == JSONPG_BEGIN_OBJECT)) {
+                if(begin && merge_push(m, patch))
+                        return 1;
+                return generate(m->g, type, value, plain);
+        }
+
+        // Replaced by the patch
+        m->skip = begin;
+        return merge_generate(m->g, patch);
+}
+
+static int merge_key(merge m, jsonpg_value *value, bool plain)
+{
+        jsonpg_cursor patch = m->frames[m->frame_count - 1].patch;
+        jsonpg_cursor member = patch.at == DOM_NO_POS
+                ? patch
+                : cursor_get(patch, value->string.bytes, value->string.length);
+        if(member.at == DOM_NO_POS)
+                return generate(m->g, JSONPG_KEY, value, plain);
+
+        if(m->used_count == m->used_size) {
+                void *used = merge_grow(m, m->used, &m->used_size, sizeof(dom_pos));
+                if(!used)
+                        return merge_alloc_error(m);
+                m->used = used;
+        }
+        m->used[m->used_count++] = member.key;
+
+        if(cursor_type(member) == JSONPG_NULL) {
+                m->drop = true;
+                return 0;
+        }
+        m->next = member;
+        return generate(m->g, JSONPG_KEY, value, plain);
+}
+
+static int merge_pos_compare(const void *a, const void *b)
+{
+        dom_pos pa = *(const dom_pos *)a;
+        dom_pos pb = *(const dom_pos *)b;
+        return pa < pb ? -1 : pa > pb;
+}
+
+// Members of the patch not in the object are added at its end
+static int merge_end(merge m, jsonpg_type type, jsonpg_value *value)
+{
+        struct merge_frame_s frame = m->frames[--m->frame_count];
+        if(frame.patch.at != DOM_NO_POS) {
+                dom_pos *used = m->used + frame.used;
+                size_t count = m->used_count - frame.used;
+                if(count)
+                        qsort(used, count, sizeof(dom_pos), merge_pos_compare);
+                for(jsonpg_cursor c = cursor_first(frame.patch) ;
+                                c.at != DOM_NO_POS ;
+                                c = cursor_next(c)) {
+                        if(cursor_type(c) == JSONPG_NULL
+                                        || (count && bsearch(&c.key, used, count,
+                                                sizeof(dom_pos), merge_pos_compare)))
+                                continue;
+                        jsonpg_string_value key = cursor_key_string(c);
+                        if(jsonpg_key(m->g, key.bytes, key.length)
+                                        || merge_generate(m->g, c))
+                                return 1;
+                }
+                m->used_count = frame.used;
+        }
+        return generate(m->g, type, value, false);
+}
+
+static int merge_event(merge m, jsonpg_type type, jsonpg_value *value, bool plain)
+{
+        switch(type) {
+        case JSONPG_BEGIN_ARRAY:
+        case JSONPG_BEGIN_OBJECT:
+                if(m->skip) {
+                        m->skip++;
+                        return 0;
+                }
+                return merge_value(m, type, value, plain);
+        case JSONPG_END_ARRAY:
+        case JSONPG_END_OBJECT:
+                if(m->skip) {
+                        m->skip--;
+                        return 0;
+                }
+                return merge_end(m, type, value);
+        case JSONPG_ERROR:
+                return generate(m->g, type, value, false);
+        default:
+                if(m->skip)
+                        return 0;
+                if(type == JSONPG_KEY)
+                        return merge_key(m, value, plain);
+                return merge_value(m, type, value, plain);
+        }
+}
+
+static jsonpg_value parse_merge(jsonpg_parser p, jsonpg_generator g, jsonpg_dom patch)
+{
+        struct merge_s m = {
+                .g = g,
+                .arena = p->arena,
+                .root = jsonpg_dom_root(patch),
+                .next = cursor_none(patch)
+        };
+        if(m.root.at == DOM_NO_POS || patch->open_count)
+                return make_error_return(JSONPG_ERROR_OPT, 0);
+
+        jsonpg_type type;
+        int abort = 0;
+        while(!abort && JSONPG_EOF != (type = jsonpg_parse_next(p)))
+                abort = merge_event(&m, type, &p->result,
+                                p->input && p->plain_string);
+
+        if(m.used)
+                arena_dealloc(m.arena, m.used);
+        if(m.frames)
+                arena_dealloc(m.arena, m.frames);
+
+        return parse_result(g, abort);
+}
+
+/*
+ * JSON Patches
+ *
+ * Paths are RFC 6901 JSON Pointers. Operations are applied in order
+ * and a patch stops at the first one that fails
+ */
+
+// Next reference token of a JSON pointer, tokens with escapes are
+// unescaped into buf, which has room for all of the pointer
+// Returns 1 for a token, 0 at the end and -1 if the pointer is not valid
+static int pointer_next(
+                jsonpg_string_value *pointer,
+                uint8_t **buf,
+                jsonpg_string_value *token)
+{
+        if(!pointer->length)
+                return 0;
+        if(pointer->bytes[0] != '/')
+                return -1;
+
+        uint8_t *start = pointer->bytes + 1;
+        uint8_t *end = pointer->bytes + pointer->length;
+        uint8_t *slash = memchr(start, '/', end - start);
+        if(!slash)
+                slash = end;
+
+        *token = (jsonpg_string_value){ start, slash - start };
+        if(memchr(start, '~', slash - start)) {
+                uint8_t *out = *buf;
+                for(uint8_t *b = start ; b < slash ; b++) {
+                        if(*b != '~')
+                                *out++ = *b;
+                        else if(++b < slash && (*b == '0' || *b == '1'))
+                                *out++ = *b == '0' ? '~' : '/';
+                        else
+                                return -1;
+                }
+                *token = (jsonpg_string_value){ *buf, out - *buf };
+                *buf = out;
+        }
+
+        *pointer = (jsonpg_string_value){ slash, end - slash };
+        return 1;
+}
+
+// Array index of a token, "-" is the index after the last element
+static bool pointer_index(jsonpg_string_value token, size_t count, size_t *index)
+{
+        if(token.length == 1 && token.bytes[0] == '-') {
+                *index = count;
+                return true;
+        }
+        if(!token.length || token.length > 18
+                        || (token.bytes[0] == '0' && token.length > 1))
+                return false;
+
+        size_t n = 0;
+        for(size_t i = 0 ; i < token.length ; i++) {
+                if(token.bytes[i] < '0' || token.bytes[i] > '9')
+                        return false;
+                n = 10 * n + token.bytes[i] - '0';
+        }
+        *index = n;
+        return true;
+}
+
+static jsonpg_cursor pointer_child(jsonpg_cursor c, jsonpg_string_value token)
+{
+        size_t index;
+        switch(cursor_type(c)) {
+        case JSONPG_BEGIN_OBJECT:
+                return cursor_get(c, token.bytes, token.length);
+        case JSONPG_BEGIN_ARRAY:
+                if(pointer_index(token, cursor_count(c), &index))
+                        return cursor_index(c, index);
+                return cursor_none(c.dom);
+        default:
+                return cursor_none(c.dom);
+        }
+}
+
+// Finds the array or object holding the value that a pointer refers
+// to and the pointer's last token. The root has no parent
+static int pointer_parent(
+                jsonpg_dom dom,
+                jsonpg_string_value pointer,
+                uint8_t *buf,
+                jsonpg_cursor *parent,
+                jsonpg_string_value *last)
+{
+        jsonpg_cursor c = jsonpg_dom_root(dom);
+        jsonpg_string_value token, next;
+        if(pointer_next(&pointer, &buf, &token) <= 0)
+                return -1;
+
+        for( ; ; ) {
+                int r = pointer_next(&pointer, &buf, &next);
+                if(r < 0)
+                        return -1;
+                if(!r) {
+                        *parent = c;
+                        *last = token;
+                        return 0;
+                }
+                c = pointer_child(c, token);
+                if(c.at == DOM_NO_POS)
+                        return -1;
+                token = next;
+        }
+}
+
+static jsonpg_cursor pointer_value(jsonpg_dom dom, jsonpg_string_value pointer, uint8_t *buf)
+{
+        if(!pointer.length)
+                return jsonpg_dom_root(dom);
+
+        jsonpg_cursor parent;
+        jsonpg_string_value last;
+        if(pointer_parent(dom, pointer, buf, &parent, &last))
+                return cursor_none(dom);
+        return pointer_child(parent, last);
+}
+
+typedef struct {
+        jsonpg_string_value op;
+        jsonpg_string_value path;
+        jsonpg_string_value from;
+        jsonpg_cursor value;
+        uint8_t *path_buf;      // for unescaping the path and from
+        uint8_t *from_buf;
+} patch_op;
+
+static int patch_add(jsonpg_dom dom, patch_op *op, dom_edit *e)
+{
+        if(!op->path.length)
+                return dom_set(jsonpg_dom_root(dom), e);
+
+        jsonpg_cursor parent;
+        jsonpg_string_value last;
+        if(pointer_parent(dom, op->path, op->path_buf, &parent, &last))
+                return -1;
+
+        size_t index;
+        switch(cursor_type(parent)) {
+        case JSONPG_BEGIN_OBJECT:
+                return dom_put(parent, last.bytes, last.length, e);
+        case JSONPG_BEGIN_ARRAY:
+                if(!pointer_index(last, cursor_count(parent), &index))
+                        return -1;
+                return dom_insert(parent, index, e);
+        default:
+                return -1;
+        }
+}
+
+static int patch_remove(jsonpg_dom dom, jsonpg_string_value path, uint8_t *buf)
+{
+        jsonpg_cursor parent;
+        jsonpg_string_value last;
+        if(pointer_parent(dom, path, buf, &parent, &last))
+                return -1;
+
+        size_t index;
+        switch(cursor_type(parent)) {
+        case JSONPG_BEGIN_OBJECT:
+                return jsonpg_dom_delete(parent, last.bytes, last.length);
+        case JSONPG_BEGIN_ARRAY:
+                if(!pointer_index(last, cursor_count(parent), &index))
+                        return -1;
+                return jsonpg_dom_remove(parent, index);
+        default:
+                return -1;
+        }
+}
+
+// A value cannot be moved into itself
+static bool patch_path_within(jsonpg_string_value path, jsonpg_string_value from)
+{
+        return path.length > from.length
+                && path.bytes[from.length] == '/'
+                && !memcmp(path.bytes, from.bytes, from.length);
+}
+
+static int patch_move(jsonpg_dom dom, patch_op *op)
+{
+        jsonpg_cursor from = pointer_value(dom, op->from, op->from_buf);
+        if(from.at == DOM_NO_POS || patch_path_within(op->path, op->from))
+                return -1;
+        if(op->path.length == op->from.length
+                        && !memcmp(op->path.bytes, op->from.bytes, op->from.length))
+                return 0;
+
+        // Removing the value overwrites its first item so it is
+        // copied first, ending with a jump so the copy has an end
+        if(!dom_edit_start(dom))
+                return -1;
+        dom_pos copy = dom_add_edit(dom, &(dom_edit){ .from = from });
+        if(copy == DOM_NO_POS
+                        || !dom_add_jump(dom, DOM_NO_POS)
+                        || patch_remove(dom, op->from, op->from_buf))
+                return -1;
+
+        return patch_add(dom, op, &(dom_edit){
+                        .from = { .dom = dom, .at = copy, .key = DOM_NO_POS } });
+}
+
+static int patch_operation(jsonpg_dom dom, patch_op *op)
+{
+        jsonpg_cursor c;
+        if(patch_string_is(op->op, "add")) {
+                if(op->value.at == DOM_NO_POS)
+                        return -1;
+                return patch_add(dom, op, &(dom_edit){ .from = op->value });
+        } else if(patch_string_is(op->op, "remove")) {
+                return patch_remove(dom, op->path, op->path_buf);
+        } else if(patch_string_is(op->op, "replace")) {
+                c = pointer_value(dom, op->path, op->path_buf);
+                if(op->value.at == DOM_NO_POS || c.at == DOM_NO_POS)
+                        return -1;
+                return dom_set(c, &(dom_edit){ .from = op->value });
+        } else if(patch_string_is(op->op, "move")) {
+                if(!op->from.bytes)
+                        return -1;
+                return patch_move(dom, op);
+        } else if(patch_string_is(op->op, "copy")) {
+                if(!op->from.bytes)
+                        return -1;
+                c = pointer_value(dom, op->from, op->from_buf);
+                if(c.at == DOM_NO_POS)
+                        return -1;
+                return patch_add(dom, op, &(dom_edit){ .from = c });
+        } else if(patch_string_is(op->op, "test")) {
+                c = pointer_value(dom, op->path, op->path_buf);
+                if(op->value.at == DOM_NO_POS || c.at == DOM_NO_POS)
+                        return -1;
+                return cursor_equal(c, op->value) ? 0 : -1;
+        }
+        return -1;
+}
+
+static int patch_apply(jsonpg_dom dom, jsonpg_cursor c)
+{
+        if(cursor_type(c) != JSONPG_BEGIN_OBJECT)
+                return -1;
+
+        patch_op op = { .value = cursor_none(c.dom) };
+        bool has_op = false, has_path = false;
+        for(c = cursor_first(c) ; c.at != DOM_NO_POS ; c = cursor_next(c)) {
+                jsonpg_string_value key = cursor_key_string(c);
+                jsonpg_value v = dom_node_value(dom_node_at(c.dom, c.at));
+                if(patch_string_is(key, "value")) {
+                        op.value = c;
+                } else if(patch_string_is(key, "op") && v.type == JSONPG_STRING) {
+                        op.op = v.string;
+                        has_op = true;
+                } else if(patch_string_is(key, "path") && v.type == JSONPG_STRING) {
+                        op.path = v.string;
+                        has_path = true;
+                } else if(patch_string_is(key, "from") && v.type == JSONPG_STRING) {
+                        op.from = v.string;
+                }
+        }
+        if(!has_op || !has_path)
+                return -1;
+
+        // Pointers with escapes need somewhere to unescape their tokens
+        uint8_t *buf = NULL;
+        if((op.path.length && memchr(op.path.bytes, '~', op.path.length))
+                        || (op.from.length && memchr(op.from.bytes, '~', op.from.length))) {
+                buf = arena_alloc(dom->arena, op.path.length + op.from.length);
+                if(!buf)
+                        return -1;
+                op.path_buf = buf;
+                op.from_buf = buf + op.path.length;
+        }
+
+        int r = patch_operation(dom, &op);
+        if(buf)
+                arena_dealloc(dom->arena, buf);
+        return r;
+}
+
+int jsonpg_dom_apply_patch(jsonpg_dom dom, jsonpg_dom patch)
+{
+        jsonpg_cursor ops = jsonpg_dom_root(patch);
+        if(cursor_type(ops) != JSONPG_BEGIN_ARRAY || patch->open_count)
+                return -1;
+
+        for(ops = cursor_first(ops) ; ops.at != DOM_NO_POS ; ops = cursor_next(ops))
+                if(patch_apply(dom, ops))
+                        return -1;
+        return 0;
+}
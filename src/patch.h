@@ -0,0 +1,3 @@
+#pragma once
+
+static jsonpg_value parse_merge(jsonpg_parser, jsonpg_generator, jsonpg_dom);
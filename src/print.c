@@ -2,8 +2,17 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <math.h>
+#include <errno.h>
+#include <sys/uio.h>
 
-static char number_buffer[32];
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Default size of the output buffer for fd and writer output
+#define PRINT_BUFFER_SIZE 16384
 
 typedef struct print_ctx_s *print_ctx;
 typedef ssize_t (*write_fn)(void *, const void *, size_t);
@@ -17,6 +26,10 @@ struct print_ctx_s {
         char *indent;
         write_fn write;
         void *write_ctx;
+        int fd;                 // output fd, -1 if writing via write()
+        uint8_t *out;           // output buffer, NULL if unbuffered
+        size_t out_size;
+        size_t out_count;
         jsonpg_generator g;
 };
 
@@ -25,86 +38,220 @@ static void set_print_error(print_ctx ctx, jsonpg_error_code code)
         set_generator_error(ctx->g, code);
 }
 
+/*
+ * Writes all of the iovecs to the output fd or writer
+ * Partial writes are retried until everything has been written
+ */
+static int write_iov(print_ctx ctx, struct iovec *iov, int iovcnt)
+{
+        while(iovcnt) {
+                ssize_t w;
+                if(ctx->fd >= 0) {
+                        w = writev(ctx->fd, iov, iovcnt);
+                        if(w < 0 && errno == EINTR)
+                                continue;
+                } else {
+                        // writers may return 0 or the count for a full write
+                        w = ctx->write(ctx->write_ctx, iov->iov_base, iov->iov_len);
+                        if(!w)
+                                w = iov->iov_len;
+                }
+                if(w < 0) {
+                        set_print_error(ctx, JSONPG_ERROR_FILE_WRITE);
+                        return -1;
+                }
+                while(iovcnt && w >= iov->iov_len) {
+                        w -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if(iovcnt) {
+                        iov->iov_base = (uint8_t *)iov->iov_base + w;
+                        iov->iov_len -= w;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Writes any buffered output followed by count bytes
+ */
+static int print_drain(print_ctx ctx, const void *bytes, size_t count)
+{
+        struct iovec iov[2];
+        int iovcnt = 0;
+        if(ctx->out_count) {
+                iov[iovcnt].iov_base = ctx->out;
+                iov[iovcnt++].iov_len = ctx->out_count;
+        }
+        if(count) {
+                iov[iovcnt].iov_base = (void *)bytes;
+                iov[iovcnt++].iov_len = count;
+        }
+        ctx->out_count = 0;
+        return write_iov(ctx, iov, iovcnt);
+}
+
+static int print_flush(print_ctx ctx)
+{
+        return print_drain(ctx, NULL, 0);
+}
+
+/*
+ * All output goes through here
+ * Bytes are collected in the output buffer and only written when it is full,
+ * writes that would not fit in an empty buffer go out together with the
+ * buffered output in a single writev
+ */
+static int print_write(print_ctx ctx, const void *bytes, size_t count)
+{
+        if(!ctx->out) {
+                // Only buffer output is unbuffered
+                if(ctx->write(ctx->write_ctx, bytes, count) < 0) {
+                        set_print_error(ctx, JSONPG_ERROR_ALLOC);
+                        return -1;
+                }
+                return 0;
+        }
+
+        if(count <= ctx->out_size - ctx->out_count) {
+                memcpy(ctx->out + ctx->out_count, bytes, count);
+                ctx->out_count += count;
+                return 0;
+        }
+        if(count >= ctx->out_size)
+                return print_drain(ctx, bytes, count);
+
+        if(print_flush(ctx))
+                return -1;
+        memcpy(ctx->out, bytes, count);
+        ctx->out_count = count;
+        return 0;
+}
+
+/*
+ * Writes the escape sequence for a control character, '"' or '\'
+ */
+static int write_escape(print_ctx ctx, uint8_t c)
+{
+        static const char hex[] = "0123456789ABCDEF";
+        char e[6] = "\\";
+        int w = 2;
+        switch(c) {
+        case '\b':
+                e[1] = 'b';
+                break;
+        case '\t':
+                e[1] = 't';
+                break;
+        case '\n':
+                e[1] = 'n';
+                break;
+        case '\f':
+                e[1] = 'f';
+                break;
+        case '\r':
+                e[1] = 'r';
+                break;
+        case '"':
+        case '\\':
+                e[1] = c;
+                break;
+        default:
+                memcpy(e + 1, "u00", 3);
+                e[4] = hex[c >> 4];
+                e[5] = hex[c & 0xF];
+                w = 6;
+        }
+        return print_write(ctx, e, w);
+}
+
+// Bytes that end a run of plain ASCII in write_utf8
+static const bool print_stop[256] = {
+        [0x00 ... 0x1F] = true,
+        ['"'] = true,
+        ['\\'] = true,
+        [0x80 ... 0xFF] = true
+};
+
+/*
+ * Returns the first byte from s that is a control character, '"', '\'
+ * or non-ASCII, or last if there are none
+ */
+static uint8_t *print_scan(uint8_t *s, uint8_t *last)
+{
+#if defined(__AVX2__)
+        while(last - s >= 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)s);
+                // signed compare catches both < 0x20 and >= 0x80
+                __m256i stop = _mm256_or_si256(
+                                _mm256_or_si256(
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+                                _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v));
+                uint32_t mask = _mm256_movemask_epi8(stop);
+                if(mask)
+                        return s + __builtin_ctz(mask);
+                s += 32;
+        }
+#elif defined(__SSE2__)
+        while(last - s >= 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)s);
+                // signed compare catches both < 0x20 and >= 0x80
+                __m128i stop = _mm_or_si128(
+                                _mm_or_si128(
+                                        _mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                                _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)));
+                uint32_t mask = _mm_movemask_epi8(stop);
+                if(mask)
+                        return s + __builtin_ctz(mask);
+                s += 16;
+        }
+#endif
+        while(s < last && !print_stop[*s])
+                s++;
+        return s;
+}
+
+/*
+ * Writes a string escaping control characters, '"' and '\'
+ *
+ * Runs of bytes that need no escaping are found 16/32 bytes at a time
+ * and written in one go, non-ASCII runs are checked with utf8_valid
+ */
 static int write_utf8(print_ctx ctx, uint8_t *bytes, size_t count) 
 {
         uint8_t *s = bytes;
-        uint8_t *last_s = s;
-
-        char e[3] = "\\_";
-        char u[7] = "\\u0000";
-        char *print_p;
-        int print_w = 0;
-
-        while((s - bytes) < count) {
-                if(*s < 0x20) {
-                        print_p = e;
-                        print_w = 2;
-                        switch(*s) {
-                        case '\b':
-                                e[1] = 'b';
-                                break;
-                        case '\t':
-                                e[1] = 't';
-                                break;
-                        case '\n':
-                                e[1] = 'n';
-                                break;
-                        case '\f':
-                                e[1] = 'f';
-                                break;
-                        case '\r':
-                                e[1] = 'r';
-                                break;
-                        default:
-                                snprintf(u + 4, 3, "%.2X", (int)*s);
-                                print_p = u;
-                                print_w = 6;
-                        }
-                        s++;
-                } else if(*s < 0x80) {
-                        print_p = e;
-                        print_w = 2;
-                        switch(*s) {
-                        case '"':
-                                e[1] = '"';
-                                break;
-                        case '\\':
-                                e[1] = '\\';
-                                break;
-                        default:
-                                print_p = NULL;
-                        }
-                        s++;
-                } else {
-                        print_p = NULL;
-                        int v = valid_utf8_sequence(s, count - (s - bytes));
-                        if(!v) {
+        uint8_t *last = bytes + count;
+
+        while(s < last) {
+                uint8_t *run = s;
+                s = print_scan(s, last);
+                if(s < last && *s >= 0x80) {
+                        uint8_t *utf8 = s;
+                        s = scan_range(s, last, 0x20, 0xFF, '"', '\\', '\\');
+                        if(!utf8_valid(utf8, s - utf8)) {
                                 set_print_error(ctx, JSONPG_ERROR_UTF8);
                                 return -1;
                         }
-                        s += v;
-                }
-                if(print_p) {
-                        // We have to print an escape sequence 
-                        // first print stuff we skipped
-                        if(ctx->write(ctx->write_ctx, last_s, s - last_s - 1))
-                                return -1;
-                        last_s = s;
-                        if(ctx->write(ctx->write_ctx, print_p, print_w))
-                                return -1;
                 }
+                if(print_write(ctx, run, s - run))
+                        return -1;
+                if(s < last && write_escape(ctx, *s++))
+                        return -1;
         }
-        return ctx->write(ctx->write_ctx, last_s, s - last_s);
+        return 0;
 }
 
 static int write_c(print_ctx ctx, char c)
 {
-        return ctx->write(ctx->write_ctx, &c, 1);
+        return print_write(ctx, &c, 1);
 }
 
 static int write_s(print_ctx ctx, char *s)
 {
-        return ctx->write(ctx->write_ctx, s, strlen(s));
+        return print_write(ctx, s, strlen(s));
 }
 
 static int print_indent(print_ctx ctx)
@@ -191,14 +338,23 @@ static int print_null(void *ctx)
 
 static int print_integer(void *ctx, long l) 
 {
-        print_prefix(ctx);
-        int r = snprintf(number_buffer, sizeof(number_buffer), "%ld", l);
-        if(r < 0) {
-                set_print_error(ctx, JSONPG_ERROR_NUMBER);
+        print_ctx pctx = ctx;
+        char buf[NUMBER_INTEGER_MAX];
+        int len = number_format_integer(l, buf);
+        if(print_prefix(ctx)
+                        || print_write(pctx, buf, len))
                 return -1;
-        }
+        return 0;
+}
 
-        write_s(ctx, number_buffer);
+static int print_uinteger(void *ctx, unsigned long u) 
+{
+        print_ctx pctx = ctx;
+        char buf[NUMBER_INTEGER_MAX];
+        int len = number_format_uinteger(u, buf);
+        if(print_prefix(ctx)
+                        || print_write(pctx, buf, len))
+                return -1;
         return 0;
 }
 
@@ -208,22 +364,23 @@ static int print_real(void *ctx, double d)
                 set_print_error(ctx, JSONPG_ERROR_NUMBER);
                 return -1;
         }
-        print_prefix(ctx);
-        int r = snprintf(number_buffer, sizeof(number_buffer), "%.16g", d);
-        if(r < 0) {
-                set_print_error(ctx, JSONPG_ERROR_NUMBER);
-                return -1;
-        }
-
-        if(write_s(ctx, number_buffer))
+        print_ctx pctx = ctx;
+        char buf[NUMBER_REAL_MAX];
+        int len = number_format_real(d, buf);
+        if(print_prefix(ctx)
+                        || print_write(pctx, buf, len))
                 return -1;
 
-        // real number without decimal point or exponent
-        // add .0 at the end to preserve type at next JSON decode
-        if(r == strcspn(number_buffer, ".e"))
-                if(write_s(ctx, ".0"))
-                        return -1;
+        return 0;
+}
 
+// Raw number text, already checked by jsonpg_number
+static int print_number(void *ctx, uint8_t *bytes, size_t length)
+{
+        print_ctx pctx = ctx;
+        if(print_prefix(ctx)
+                        || print_write(pctx, bytes, length))
+                return -1;
         return 0;
 }
 
@@ -237,6 +394,24 @@ static int print_string(void *ctx, uint8_t *bytes, size_t length)
         return 0;
 }
 
+static int print_plain_string(void *ctx, uint8_t *bytes, size_t length)
+{
+        if(print_prefix(ctx)
+                        || write_c(ctx, '"')
+                        || print_write(ctx, bytes, length)
+                        || write_c(ctx, '"'))
+                return -1;
+        return 0;
+}
+
+static int print_plain_key(void *ctx, uint8_t *bytes, size_t length)
+{
+        if(print_plain_string(ctx, bytes, length)
+                        || print_key_suffix(ctx))
+                return -1;
+        return 0;
+}
+
 static int print_key(void *ctx, uint8_t *bytes, size_t length) 
 {
         if(print_string(ctx, bytes, length)
@@ -284,7 +459,9 @@ static jsonpg_callbacks printer_callbacks = {
         .boolean = print_boolean,
         .null = print_null,
         .integer = print_integer,
+        .uinteger = print_uinteger,
         .real = print_real,
+        .number = print_number,
         .string = print_string,
         .key = print_key,
         .begin_array = print_begin_array,
@@ -296,14 +473,17 @@ static jsonpg_callbacks printer_callbacks = {
 
 static jsonpg_generator print_generator(
                 jsonpg_generator g,
+                int fd,
                 write_fn write, 
                 void *write_ctx, 
-                int indent)
+                int indent,
+                size_t buffer_size)
 {
         print_ctx ctx = arena_alloc(
                         g->arena,
                         sizeof(struct print_ctx_s) + indent + 1);
-        if(!ctx) {
+        uint8_t *out = buffer_size ? arena_alloc(g->arena, buffer_size) : NULL;
+        if(!ctx || (buffer_size && !out)) {
                 jsonpg_generator_free(g);
                 return NULL;
         }
@@ -324,8 +504,12 @@ static jsonpg_generator print_generator(
                 ctx->pretty = false;
         }
         ctx->nl = 0;
+        ctx->fd = fd;
         ctx->write = write;
         ctx->write_ctx = write_ctx;
+        ctx->out = out;
+        ctx->out_size = buffer_size;
+        ctx->out_count = 0;
 
         // For reporting generator errors
         ctx->g = g;
@@ -333,21 +517,42 @@ static jsonpg_generator print_generator(
         return g;
 }
 
-static ssize_t write_fd(void *ctx, const void *bytes, size_t count)
+static ssize_t write_buffer(void *ctx, const void *bytes, size_t count)
 {
-        int fd = CTX_TO_INT(ctx);
-        const uint8_t *start = bytes;
-        size_t size = count;
-        while(size) {
-                size_t w = write(fd, start, size);
-                if(w < 0) {
-                        set_print_error(ctx, JSONPG_ERROR_FILE_WRITE);
-                        return -1;
-                }
-                start += w;
-                size -= w;
-        }
-        return 0;
+        str_buf sbuf = ctx;
+        return str_buf_append(sbuf, bytes, count);
+}
+
+/*
+ * Writes any buffered output and starts a new document,
+ * output collected in a buffer is discarded
+ */
+static int print_reset(print_ctx ctx)
+{
+        int r = 0;
+        if(ctx->out && ctx->out_count)
+                r = print_flush(ctx);
+        else if(ctx->write == write_buffer)
+                str_buf_reset(ctx->write_ctx);
+
+        ctx->level = 0;
+        ctx->comma = 0;
+        ctx->key = 0;
+        ctx->nl = 0;
+
+        return r;
+}
+
+int jsonpg_generator_flush(jsonpg_generator g)
+{
+        if(g->callbacks != &printer_callbacks)
+                return 0;
+
+        print_ctx ctx = g->ctx;
+        if(!ctx->out || !ctx->out_count)
+                return 0;
+
+        return print_flush(ctx);
 }
 
 char *jsonpg_result_string(jsonpg_generator g)
@@ -358,32 +563,44 @@ char *jsonpg_result_string(jsonpg_generator g)
 
 size_t jsonpg_result_bytes(jsonpg_generator g, uint8_t **bytes)
 {
-        return str_buf_content(g->ctx, bytes);
+        print_ctx ctx = g->ctx;
+        return str_buf_content(ctx->write_ctx, bytes);
 }
 
-static ssize_t write_buffer(void *ctx, const void *bytes, size_t count)
+
+static size_t print_buffer_size(size_t buffer_size)
 {
-        str_buf sbuf = ctx;
-        return str_buf_append(sbuf, bytes, count);
+        return buffer_size ? buffer_size : PRINT_BUFFER_SIZE;
 }
 
-static jsonpg_generator file_printer(jsonpg_generator g, int fd, int indent)
+static jsonpg_generator file_printer(
+                jsonpg_generator g,
+                int fd,
+                int indent,
+                size_t buffer_size)
 {
-        return print_generator(g, write_fd, INT_TO_CTX(fd), indent);
+        return print_generator(g, fd, NULL, NULL, indent,
+                        print_buffer_size(buffer_size));
 }
 
 static jsonpg_generator buffer_printer(jsonpg_generator g, int indent)
 {
         str_buf sbuf = str_buf_new(g->arena, 0);
-        if(!sbuf)
+        if(!sbuf) {
+                jsonpg_generator_free(g);
                 return NULL;
+        }
 
-        return print_generator(g, write_buffer, sbuf, indent);
+        // Already writing to memory, so no need for an output buffer
+        return print_generator(g, -1, write_buffer, sbuf, indent, 0);
 }
 
-static jsonpg_generator write_printer(jsonpg_generator g, jsonpg_writer writer, int indent)
+static jsonpg_generator write_printer(
+                jsonpg_generator g,
+                jsonpg_writer writer,
+                int indent,
+                size_t buffer_size)
 {
-        return print_generator(g, writer->write, writer->ctx, indent);
-
+        return print_generator(g, -1, writer->write, writer->ctx, indent,
+                        print_buffer_size(buffer_size));
 }
-
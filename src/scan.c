@@ -0,0 +1,83 @@
+/*
+ * scan.c
+ *   SIMD scanning for states that loop back to themselves
+ *
+ *   gen_state emits a call to one of these for every state whose
+ *   transitions map a long run of bytes back to the same state
+ *   (string, sq_string, comments, ...) so that the state machine
+ *   only has to look at the byte that ends the run.
+ */
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Returns the first byte from current that is outside the range lo-hi
+ * or is one of x1, x2, x3, or last if all bytes up to last qualify
+ *
+ * Unused exclusions should repeat one of the others
+ */
+static uint8_t *scan_range(
+                uint8_t *current,
+                const uint8_t *last,
+                uint8_t lo,
+                uint8_t hi,
+                uint8_t x1,
+                uint8_t x2,
+                uint8_t x3)
+{
+#if defined(__AVX2__)
+        __m256i vlo = _mm256_set1_epi8(lo);
+        __m256i vhi = _mm256_set1_epi8(hi);
+        __m256i v1 = _mm256_set1_epi8(x1);
+        __m256i v2 = _mm256_set1_epi8(x2);
+        __m256i v3 = _mm256_set1_epi8(x3);
+        while(last - current >= 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)current);
+                __m256i in = _mm256_and_si256(
+                                _mm256_cmpeq_epi8(_mm256_max_epu8(v, vlo), v),
+                                _mm256_cmpeq_epi8(_mm256_min_epu8(v, vhi), v));
+                __m256i out = _mm256_or_si256(
+                                _mm256_or_si256(
+                                        _mm256_cmpeq_epi8(v, v1),
+                                        _mm256_cmpeq_epi8(v, v2)),
+                                _mm256_cmpeq_epi8(v, v3));
+                uint32_t ok = _mm256_movemask_epi8(_mm256_andnot_si256(out, in));
+                if(ok != 0xFFFFFFFF)
+                        return current + __builtin_ctz(~ok);
+                current += 32;
+        }
+#elif defined(__SSE2__)
+        __m128i vlo = _mm_set1_epi8(lo);
+        __m128i vhi = _mm_set1_epi8(hi);
+        __m128i v1 = _mm_set1_epi8(x1);
+        __m128i v2 = _mm_set1_epi8(x2);
+        __m128i v3 = _mm_set1_epi8(x3);
+        while(last - current >= 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)current);
+                __m128i in = _mm_and_si128(
+                                _mm_cmpeq_epi8(_mm_max_epu8(v, vlo), v),
+                                _mm_cmpeq_epi8(_mm_min_epu8(v, vhi), v));
+                __m128i out = _mm_or_si128(
+                                _mm_or_si128(
+                                        _mm_cmpeq_epi8(v, v1),
+                                        _mm_cmpeq_epi8(v, v2)),
+                                _mm_cmpeq_epi8(v, v3));
+                uint32_t ok = _mm_movemask_epi8(_mm_andnot_si128(out, in));
+                if(ok != 0xFFFF)
+                        return current + __builtin_ctz(~ok);
+                current += 16;
+        }
+#endif
+        while(current < last) {
+                uint8_t c = *current;
+                if(c < lo || c > hi || c == x1 || c == x2 || c == x3)
+                        break;
+                current++;
+        }
+        return current;
+}
@@ -43,11 +43,6 @@ typedef enum {
         config_optional_commas = JSONPG_FLAG_OPTIONAL_COMMAS
 } config_flags;
 
-uint8_t state_map[][256] = {
-<= map
-
-};
-
 typedef enum {
 <= enums
 ,
@@ -55,6 +50,55 @@ typedef enum {
         state_error   = STATE_ERROR
 } state;
 
+// Skip the rest of a run of bytes that a state maps back to itself
+static inline uint8_t *scan_state(state s, uint8_t *current, const uint8_t *last)
+{
+        switch(s) {
+<= scans
+
+        default:
+                return current;
+        }
+}
+
+// Define JSONPG_BYTE_CLASSES to index the state map by byte class,
+// which is a fraction of the size of the full [state][byte] map
+#ifdef JSONPG_BYTE_CLASSES
+
+// Bytes that every state treats the same share a class, so the
+// state map only needs one column per class
+<= class_count
+
+
+static const uint8_t byte_class[256] = {
+<= classes
+
+};
+
+static const uint8_t state_map[][BYTE_CLASSES] = {
+<= class_map
+
+};
+
+static inline state next_state(state s, uint8_t c)
+{
+        return state_map[s][byte_class[c]];
+}
+
+#else
+
+uint8_t state_map[][256] = {
+<= map
+
+};
+
+static inline state next_state(state s, uint8_t c)
+{
+        return state_map[s][c];
+}
+
+#endif
+
 #ifdef JSONPG_DEBUG
 char *states[256] = {
 <= enum_names
@@ -87,7 +131,7 @@ jsonpg_type parse_next(jsonpg_parser p) {
         while(1) {
                 const uint8_t *last = p->last;
                 while(p->current < last) {
-                        state current_state = state_map[p->state][*p->current];
+                        state current_state = next_state(p->state, *p->current);
 
                         JSONPG_LOG("State change: %s [%02X:%c] => %s\n", 
                                         states[p->state],
@@ -100,7 +144,12 @@ jsonpg_type parse_next(jsonpg_parser p) {
                         //if(!(current_state & 0x80)) {
                         if(current_state == jump_state) {
                                 p->state = current_state;
-                                p->current++;
+                                p->current = scan_state(current_state,
+                                                p->current + 1, last);
+                                // The rest of a run of whitespace
+                                if(current_state == state_whitespace && p->index.input)
+                                        p->current = index_skip(&p->index,
+                                                        p->current, last);
                                 continue;
                         }
                         
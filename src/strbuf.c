@@ -109,8 +109,11 @@ static size_t str_buf_content(str_buf sbuf, uint8_t **bytes)
 static char *str_buf_content_str(str_buf sbuf)
 {
         if(sbuf->count) {
-                if(sbuf->bytes[sbuf->count])
-                        str_buf_append_c(sbuf, '\0');
+                // Terminate without counting the terminator so that
+                // the buffer can still be appended to
+                if(str_buf_append_c(sbuf, '\0'))
+                        return NULL;
+                sbuf->count--;
                 return (char *)sbuf->bytes;
         }
         return "";
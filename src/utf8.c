@@ -11,6 +11,12 @@
 #include <stdint.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 #define REPLACEMENT_CHARACTER "\xEF\xBD\xBD"
 int replacement_length = 3;
 
@@ -187,6 +193,246 @@ static int write_utf8_sequence(uint8_t *bytes, size_t count, str_buf write_buf)
         return len;
 }
 
+#if defined(__AVX2__) || defined(__SSSE3__)
+
+/*
+ * SIMD validation of runs of utf-8 bytes
+ *
+ * Each byte is checked against the byte before it using three
+ * 16 entry lookup tables: the high and low nibbles of the previous byte
+ * and the high nibble of the current byte
+ * Each table entry holds a bit per error that the nibble allows, so any
+ * bit set in all three is an error in that pair of bytes
+ *
+ * The 3rd and 4th bytes of 3 and 4 byte sequences are checked by
+ * looking 2 and 3 bytes back for their lead bytes
+ *
+ * (John Keiser and Daniel Lemire, "Validating UTF-8 In Less Than One
+ * Instruction Per Byte", Software: Practice and Experience 51(5), 2021)
+ */
+#define UTF8_TOO_SHORT   0x01   // 11______ 0_______ or 11______ 11______
+#define UTF8_TOO_LONG    0x02   // 0_______ 10______
+#define UTF8_OVERLONG_3  0x04   // 11100000 100_____
+#define UTF8_TOO_LARGE   0x08   // 11110100 1001____ and higher
+#define UTF8_SURROGATE   0x10   // 11101101 101_____
+#define UTF8_OVERLONG_2  0x20   // 1100000_ 10______
+#define UTF8_TOO_LARGE_1000 0x40 // 11110101 1000____ and higher
+#define UTF8_OVERLONG_4  0x40   // 11110000 1000____
+#define UTF8_TWO_CONTS   0x80   // 10______ 10______
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define UTF8_BYTE_1_HIGH                                                \
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,     \
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,     \
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, \
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,                               \
+        UTF8_TOO_SHORT,                                                 \
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,              \
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000           \
+                | UTF8_OVERLONG_4
+
+#define UTF8_BYTE_1_LOW                                                 \
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4, \
+        UTF8_CARRY | UTF8_OVERLONG_2,                                   \
+        UTF8_CARRY,                                                     \
+        UTF8_CARRY,                                                     \
+        UTF8_CARRY | UTF8_TOO_LARGE,                                    \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,              \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,              \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,              \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,              \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,              \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,              \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,              \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,              \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE, \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,              \
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+
+#define UTF8_BYTE_2_HIGH                                                \
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS                \
+                | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4, \
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS                \
+                | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,                     \
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS                \
+                | UTF8_SURROGATE | UTF8_TOO_LARGE,                      \
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS                \
+                | UTF8_SURROGATE | UTF8_TOO_LARGE,                      \
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+
+#endif
+
+#if defined(__AVX2__)
+
+#define UTF8_BLOCK 32
+
+static __m256i utf8_block_errors(__m256i in, __m256i prev_in)
+{
+        const __m256i lo_nibble = _mm256_set1_epi8(0x0F);
+        const __m256i byte_1_high = _mm256_setr_epi8(
+                        UTF8_BYTE_1_HIGH, UTF8_BYTE_1_HIGH);
+        const __m256i byte_1_low = _mm256_setr_epi8(
+                        UTF8_BYTE_1_LOW, UTF8_BYTE_1_LOW);
+        const __m256i byte_2_high = _mm256_setr_epi8(
+                        UTF8_BYTE_2_HIGH, UTF8_BYTE_2_HIGH);
+
+        // previous bytes across the 128 bit lane boundary
+        __m256i shifted = _mm256_permute2x128_si256(prev_in, in, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(in, shifted, 15);
+        __m256i prev2 = _mm256_alignr_epi8(in, shifted, 14);
+        __m256i prev3 = _mm256_alignr_epi8(in, shifted, 13);
+
+        __m256i special = _mm256_and_si256(
+                        _mm256_and_si256(
+                                _mm256_shuffle_epi8(byte_1_high,
+                                        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lo_nibble)),
+                                _mm256_shuffle_epi8(byte_1_low,
+                                        _mm256_and_si256(prev1, lo_nibble))),
+                        _mm256_shuffle_epi8(byte_2_high,
+                                _mm256_and_si256(_mm256_srli_epi16(in, 4), lo_nibble)));
+
+        // High bit set where a 3rd or 4th byte is due
+        __m256i must23 = _mm256_and_si256(
+                        _mm256_or_si256(
+                                _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80)),
+                                _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80))),
+                        _mm256_set1_epi8(0x80));
+
+        return _mm256_xor_si256(must23, special);
+}
+
+static bool utf8_valid(const uint8_t *bytes, size_t count)
+{
+        __m256i prev = _mm256_setzero_si256();
+        __m256i errors = _mm256_setzero_si256();
+        size_t i = 0;
+        for( ; i + UTF8_BLOCK <= count ; i += UTF8_BLOCK) {
+                __m256i in = _mm256_loadu_si256((const __m256i *)(bytes + i));
+                errors = _mm256_or_si256(errors, utf8_block_errors(in, prev));
+                prev = in;
+        }
+
+        // Always finish with a zero padded block, as there is then at
+        // least one ASCII byte to show up any sequence cut short at the end
+        uint8_t block[UTF8_BLOCK] = { 0 };
+        memcpy(block, bytes + i, count - i);
+        __m256i in = _mm256_loadu_si256((const __m256i *)block);
+        errors = _mm256_or_si256(errors, utf8_block_errors(in, prev));
+
+        return _mm256_testz_si256(errors, errors);
+}
+
+#elif defined(__SSSE3__)
+
+#define UTF8_BLOCK 16
+
+static __m128i utf8_block_errors(__m128i in, __m128i prev_in)
+{
+        const __m128i lo_nibble = _mm_set1_epi8(0x0F);
+        const __m128i byte_1_high = _mm_setr_epi8(UTF8_BYTE_1_HIGH);
+        const __m128i byte_1_low = _mm_setr_epi8(UTF8_BYTE_1_LOW);
+        const __m128i byte_2_high = _mm_setr_epi8(UTF8_BYTE_2_HIGH);
+
+        __m128i prev1 = _mm_alignr_epi8(in, prev_in, 15);
+        __m128i prev2 = _mm_alignr_epi8(in, prev_in, 14);
+        __m128i prev3 = _mm_alignr_epi8(in, prev_in, 13);
+
+        __m128i special = _mm_and_si128(
+                        _mm_and_si128(
+                                _mm_shuffle_epi8(byte_1_high,
+                                        _mm_and_si128(_mm_srli_epi16(prev1, 4), lo_nibble)),
+                                _mm_shuffle_epi8(byte_1_low,
+                                        _mm_and_si128(prev1, lo_nibble))),
+                        _mm_shuffle_epi8(byte_2_high,
+                                _mm_and_si128(_mm_srli_epi16(in, 4), lo_nibble)));
+
+        // High bit set where a 3rd or 4th byte is due
+        __m128i must23 = _mm_and_si128(
+                        _mm_or_si128(
+                                _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80)),
+                                _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80))),
+                        _mm_set1_epi8(0x80));
+
+        return _mm_xor_si128(must23, special);
+}
+
+static bool utf8_valid(const uint8_t *bytes, size_t count)
+{
+        __m128i prev = _mm_setzero_si128();
+        __m128i errors = _mm_setzero_si128();
+        size_t i = 0;
+        for( ; i + UTF8_BLOCK <= count ; i += UTF8_BLOCK) {
+                __m128i in = _mm_loadu_si128((const __m128i *)(bytes + i));
+                errors = _mm_or_si128(errors, utf8_block_errors(in, prev));
+                prev = in;
+        }
+
+        // Always finish with a zero padded block, as there is then at
+        // least one ASCII byte to show up any sequence cut short at the end
+        uint8_t block[UTF8_BLOCK] = { 0 };
+        memcpy(block, bytes + i, count - i);
+        __m128i in = _mm_loadu_si128((const __m128i *)block);
+        errors = _mm_or_si128(errors, utf8_block_errors(in, prev));
+
+        return 0xFFFF == _mm_movemask_epi8(
+                        _mm_cmpeq_epi8(errors, _mm_setzero_si128()));
+}
+
+#else
+
+/*
+ * Validates a run of utf-8 bytes, skipping ASCII 8 bytes at a time
+ *
+ * Second byte ranges are from the Unicode standard, table 3-7, which
+ * rules out overlong encodings, surrogates and codepoints > 0x10FFFF
+ */
+static bool utf8_valid(const uint8_t *bytes, size_t count)
+{
+        const uint8_t *s = bytes;
+        const uint8_t *last = bytes + count;
+        while(s < last) {
+                uint64_t word;
+                if(last - s >= 8) {
+                        memcpy(&word, s, 8);
+                        if(!(word & 0x8080808080808080ULL)) {
+                                s += 8;
+                                continue;
+                        }
+                }
+                uint8_t c = *s;
+                size_t left = last - s;
+                if(c <= _1_BYTE_MAX) {
+                        s++;
+                } else if(c >= 0xC2 && c <= 0xDF) {
+                        if(left < 2 || !IS_CONTINUATION(s[1]))
+                                return false;
+                        s += 2;
+                } else if(c >= 0xE0 && c <= 0xEF) {
+                        uint8_t lo = c == 0xE0 ? 0xA0 : 0x80;
+                        uint8_t hi = c == 0xED ? 0x9F : 0xBF;
+                        if(left < 3 || s[1] < lo || s[1] > hi
+                                        || !IS_CONTINUATION(s[2]))
+                                return false;
+                        s += 3;
+                } else if(c >= 0xF0 && c <= 0xF4) {
+                        uint8_t lo = c == 0xF0 ? 0x90 : 0x80;
+                        uint8_t hi = c == 0xF4 ? 0x8F : 0xBF;
+                        if(left < 4 || s[1] < lo || s[1] > hi
+                                        || !IS_CONTINUATION(s[2])
+                                        || !IS_CONTINUATION(s[3]))
+                                return false;
+                        s += 4;
+                } else {
+                        return false;
+                }
+        }
+        return true;
+}
+
+#endif
+
 /*
  * Counts the number of characters that match the byte order mark
  * Returns the length of the BOM if all bytes match, or 0
@@ -41,6 +41,15 @@ int test_integer(void *ctx, long l)
         test_end();
 }
 
+int test_uinteger(void *ctx, unsigned long u)
+{
+        test_start();
+
+        uinteger(u);
+
+        test_end();
+}
+
 int test_real(void *ctx, double d)
 {
         test_start();
@@ -111,6 +120,21 @@ void *ctx_generator(void) {
 }
 
 jsonpg_callbacks test_callbacks = {
+        .null = test_null,
+        .boolean = test_boolean,
+        .integer = test_integer,
+        .uinteger = test_uinteger,
+        .real = test_real,
+        .string = test_string,
+        .key = test_key,
+        .begin_object = test_begin_object,
+        .end_object = test_end_object,
+        .begin_array = test_begin_array,
+        .end_array = test_end_array
+};
+
+// Integers above LONG_MAX reach these as reals
+jsonpg_callbacks test_real_callbacks = {
         .null = test_null,
         .boolean = test_boolean,
         .integer = test_integer,
@@ -129,6 +153,42 @@ void fail(char *msg)
         exit(1);
 }
 
+// Parse the input once to be thrown away, so that the solution
+// parses with a parser that has been used and reset
+void use_parser(jsonpg_parser p, int fd, uint8_t *buf, size_t length)
+{
+        jsonpg_generator g = jsonpg_generator_new(.buffer = true);
+        if(buf) {
+                jsonpg_parse(.parser = p, .bytes = buf, .count = length,
+                                .generator = g);
+        } else {
+                jsonpg_parse(.parser = p, .fd = fd, .generator = g);
+                lseek(fd, 0, SEEK_SET);
+        }
+        jsonpg_generator_free(g);
+        jsonpg_parser_reset(p);
+}
+
+// Parse a DOM to a generator, or save it and parse the mapped file
+jsonpg_value parse_dom(jsonpg_dom dom, bool map_dom, jsonpg_generator g)
+{
+        if(!map_dom)
+                return jsonpg_parse(.dom = dom, .generator = g);
+
+        char name[] = "/tmp/jsonpg_test_XXXXXX";
+        int fd = mkstemp(name);
+        if(fd < 0 || jsonpg_dom_save(dom, fd))
+                fail("Failed to save DOM\n");
+        close(fd);
+        jsonpg_dom mapped = jsonpg_dom_open_mmap(name);
+        unlink(name);
+        if(!mapped)
+                fail("Failed to map DOM\n");
+        jsonpg_value res = jsonpg_parse(.dom = mapped, .generator = g);
+        jsonpg_dom_close(mapped);
+        return res;
+}
+
 jsonpg_value parse_solution(int soln, FILE *fh)
 {
         // Input - 
@@ -145,9 +205,26 @@ jsonpg_value parse_solution(int soln, FILE *fh)
         //         fd (13 - 20)
         //         buffer (21 - 28)
         //
+        // Output (not JSON, with validation) -
+        //      callback without uinteger (29 - 30)
+        //      callback with raw numbers (37 - 38)
+        //
+        // Output (not pretty, with validation) -
+        //      fd with index (31 - 32)
+        //      fd with a reused parser (33 - 34)
+        //      fd with a reused parser in caller memory (35 - 36)
+        //
+        // Output (not JSON, with validation) -
+        //      dom saved to a file and mapped (39 - 40)
+        //
         bool create_dom = false;
+        bool map_dom = false;
         bool parse_callback = false;
         bool buffered = false;
+        jsonpg_callbacks *callbacks = &test_callbacks;
+        uint16_t flags = 0;
+        jsonpg_parser parser = NULL;
+        static uint8_t parser_memory[4096];
         int in_fd = fileno(fh);
         jsonpg_generator g = NULL;
         jsonpg_generator ctx_g = NULL;
@@ -200,11 +277,34 @@ jsonpg_value parse_solution(int soln, FILE *fh)
                                 .buffer = true,
                                 .indent = 4,
                                 .max_nesting = 0);
-        } else {
+        } else if(soln < 29) {
                 buffered = true;
                 g = jsonpg_generator_new(
                                 .buffer = true,
                                 .max_nesting = 0);
+        } else if(soln < 31) {
+                parse_callback = true;
+                callbacks = &test_real_callbacks;
+        } else if(soln < 33) {
+                flags = JSONPG_FLAG_INDEX;
+                g = jsonpg_generator_new(.fd = fileno(stdout));
+        } else if(soln < 35) {
+                parser = jsonpg_parser_new();
+                g = jsonpg_generator_new(.fd = fileno(stdout));
+        } else if(soln < 37) {
+                parser = jsonpg_parser_init(parser_memory, 
+                                sizeof(parser_memory), 
+                                .allow_heap = true);
+                if(!parser)
+                        fail("Failed to create parser in memory\n");
+                g = jsonpg_generator_new(.fd = fileno(stdout));
+        } else if(soln < 39) {
+                parse_callback = true;
+                flags = JSONPG_FLAG_RAW_NUMBERS;
+        } else {
+                create_dom = true;
+                map_dom = true;
+                g = jsonpg_generator_new(.dom = true);
         }
 
         int parse_type = soln % 2;
@@ -215,17 +315,22 @@ jsonpg_value parse_solution(int soln, FILE *fh)
                         res = jsonpg_parse(.fd = in_fd, .generator = g);
                         if(res.type == JSONPG_EOF) {
                                 ctx_g = ctx_generator();
-                                res = jsonpg_parse(
-                                                .dom = jsonpg_result_dom(g),
-                                                .generator = ctx_g);
+                                res = parse_dom(jsonpg_result_dom(g), 
+                                                map_dom, ctx_g);
                         }
                 } else if(parse_callback) {
                         ctx_g = ctx_generator();
                         res = jsonpg_parse(.fd = in_fd,
-                                        .callbacks = &test_callbacks,
+                                        .flags = flags,
+                                        .callbacks = callbacks,
                                         .ctx = ctx_g);
                 } else {
-                        res = jsonpg_parse(.fd = in_fd, .generator = g);
+                        if(parser)
+                                use_parser(parser, in_fd, NULL, 0);
+                        res = jsonpg_parse(.fd = in_fd, 
+                                        .parser = parser,
+                                        .flags = flags,
+                                        .generator = g);
                 }
         } else {
                 fseek(fh, 0L, SEEK_END);
@@ -241,18 +346,22 @@ jsonpg_value parse_solution(int soln, FILE *fh)
                         res = jsonpg_parse(.bytes = buf, .count = length, .generator = g);
                         ctx_g = ctx_generator();
                         if(res.type == JSONPG_EOF) {
-                                res = jsonpg_parse(
-                                                .dom = jsonpg_result_dom(g),
-                                                .generator = ctx_g);
+                                res = parse_dom(jsonpg_result_dom(g), 
+                                                map_dom, ctx_g);
                         }
                 } else if(parse_callback) {
                         ctx_g = ctx_generator();
                         res = jsonpg_parse(.bytes = buf, .count = length,
-                                        .callbacks = &test_callbacks,
+                                        .flags = flags,
+                                        .callbacks = callbacks,
                                         .ctx = ctx_g);
                 } else {
+                        if(parser)
+                                use_parser(parser, -1, buf, length);
                         res = jsonpg_parse(.bytes = buf, 
                                         .count = length, 
+                                        .parser = parser,
+                                        .flags = flags,
                                         .generator = g);
                 }
                 free(buf);
@@ -262,6 +371,8 @@ jsonpg_value parse_solution(int soln, FILE *fh)
 
         jsonpg_generator_free(g);
         jsonpg_generator_free(ctx_g);
+        if(parser)
+                jsonpg_parser_free(parser);
 
         return res;     
 }
@@ -282,6 +393,18 @@ void usage(char *progname)
         //         fd (13 - 20)
         //         buffer (21 - 28)
         //
+        // Output (not JSON, with validation) -
+        //      callback without uinteger (29 - 30)
+        //      callback with raw numbers (37 - 38)
+        //
+        // Output (not pretty, with validation) -
+        //      fd with index (31 - 32)
+        //      fd with a reused parser (33 - 34)
+        //      fd with a reused parser in caller memory (35 - 36)
+        //
+        // Output (not JSON, with validation) -
+        //      dom saved to a file and mapped (39 - 40)
+        //
         printf("%s [-s <solution number>] <json filename>\n\n", progname);
         printf("Where solution number (default: 24) is:\n");
         printf("  N - parse/generate route [Stringified | Prettified : Validated | Not Validated]\n"); 
@@ -313,6 +436,18 @@ void usage(char *progname)
         printf(" 26 - byte buffer => buffer => stdout             [P:N]\n");
         printf(" 27 - file => buffer => stdout                    [S:N]\n");
         printf(" 28 - byte buffer => buffer => stdout             [S:N]\n");
+        printf(" 29 - file => parse/reals => stdout               [S:V]\n");
+        printf(" 30 - byte buffer => parse/reals => stdout        [S:V]\n");
+        printf(" 31 - file => index => stdout                     [S:V]\n");
+        printf(" 32 - byte buffer => index => stdout              [S:V]\n");
+        printf(" 33 - file => reused parser => stdout             [S:V]\n");
+        printf(" 34 - byte buffer => reused parser => stdout      [S:V]\n");
+        printf(" 35 - file => parser in memory => stdout          [S:V]\n");
+        printf(" 36 - byte buffer => parser in memory => stdout   [S:V]\n");
+        printf(" 37 - file => parse/raw numbers => stdout         [S:V]\n");
+        printf(" 38 - byte buffer => parse/raw numbers => stdout  [S:V]\n");
+        printf(" 39 - file => dom => mapped file => stdout        [S:V]\n");
+        printf(" 40 - byte buffer => dom => mapped file => stdout [S:V]\n");
 }
                 
 int main(int argc, char *argv[]) {
@@ -327,7 +462,7 @@ int main(int argc, char *argv[]) {
                 }
         } else if(4 == argc && 0 == strcmp("-s", argv[1])) {
                 long l = strtol(argv[2], NULL, 10);
-                if(l > 0 && l < 29)
+                if(l > 0 && l < 41)
                         soln = l;
         }
 
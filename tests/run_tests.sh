@@ -4,7 +4,13 @@ root_dir="json"
 input_dir="${root_dir}/input"
 passed_dir="${root_dir}/passed"
 pretty_dir="${root_dir}/pretty"
+reals_dir="${root_dir}/reals"
 failed_dir="${root_dir}/failed"
+diff_dir="${root_dir}/diff"
+equal_dir="${root_dir}/equal"
+merge_dir="${root_dir}/merge"
+patch_dir="${root_dir}/patch"
+edit_dir="${root_dir}/edit"
 pcount=0
 fcount=0
 passed="\e[1;32m"
@@ -25,7 +31,7 @@ fi
 
 for infile in ${input_dir}/*.json; do
         file=$(basename $infile)
-        for s in {1..28}; do
+        for s in {1..40}; do
                 outdir=$passed_dir
                 for p in 13 14 17 18 21 22 25 26; do
                         if [ $s -eq $p ]; then
@@ -33,6 +39,10 @@ for infile in ${input_dir}/*.json; do
                                 break
                         fi
                 done
+                # Callbacks without uinteger get large integers as reals
+                if [ $s -gt 28 -a $s -lt 31 -a -f "${reals_dir}/${file}" ]; then
+                        outdir=$reals_dir
+                fi
                 outfile="${outdir}/${file}"
 #                echo "Parse -s $s $infile and compare with $outfile"
                 if ./jsonpg -s $s $infile > temp.json 2>/dev/null; then
@@ -58,6 +68,106 @@ for infile in ${input_dir}/*.json; do
         
 done
 
+# Number conversion must match strtod exactly, needs tests.c built as ./tests
+if [ -x ./tests ]; then
+        if ./tests -n ${input_dir}/[yi]_number_*.json ${input_dir}/number_*.json > /dev/null; then
+                ((++pcount))
+        else
+                ((++fcount))
+                failed_msg "Number conversion differs from strtod"
+        fi
+fi
+
+# DOMs saved and mapped back must print, edit and compact like parsed
+# ones, and must not map once damaged
+if [ -x ./tests ]; then
+        if ./tests -o ${input_dir}/y_*.json ${input_dir}/pass*.json ${input_dir}/twitter.json > /dev/null; then
+                ((++pcount))
+        else
+                ((++fcount))
+                failed_msg "Mapped DOMs differ from parsed DOMs"
+        fi
+fi
+
+# Pairs named y_ are equal and n_ differ, either way round and with
+# or without stored hashes
+if [ -x ./tests ]; then
+        for a in ${equal_dir}/*_a.json; do
+                file=$(basename ${a%_a.json})
+                ./tests -q $a "${a%_a.json}_b.json" > /dev/null
+                result=$?
+                if [ $result -eq 0 -a "${file:0:2}" = "y_" ] \
+                                || [ $result -eq 1 -a "${file:0:2}" = "n_" ]; then
+                        ((++pcount))
+                else
+                        ((++fcount))
+                        failed_msg "Unexpected comparison: $file"
+                fi
+        done
+fi
+
+# Merge patches are applied while parsing (-m) and to a DOM (-M), JSON
+# Patches to a DOM (-j), cases without an expected result must fail
+if [ -x ./tests ]; then
+        for doc in ${merge_dir}/*_doc.json ${patch_dir}/*_doc.json; do
+                name=${doc%_doc.json}
+                expected="${name}_expected.json"
+                modes="-j"
+                if [ $(dirname $doc) = $merge_dir ]; then
+                        modes="-m -M"
+                fi
+                for mode in $modes; do
+                        if ./tests $mode "${name}_patch.json" $doc > temp.json 2>/dev/null; then
+                                if [ ! -f $expected ]; then
+                                        ((++fcount))
+                                        failed_msg "Unexpected pass: $mode $(basename $name)"
+                                elif ! ./tests -q temp.json $expected > /dev/null; then
+                                        ((++fcount))
+                                        failed_msg "Unexpected output: $mode $(basename $name)"
+                                else
+                                        ((++pcount))
+                                fi
+                        else
+                                if [ -f $expected ]; then
+                                        ((++fcount))
+                                        failed_msg "Unexpected fail: $mode $(basename $name)"
+                                else
+                                        ((++pcount))
+                                fi
+                        fi
+                done
+        done
+fi
+
+# Edited DOMs must print as expected before and after compacting
+if [ -x ./tests ]; then
+        for doc in ${edit_dir}/*_doc.json; do
+                name=${doc%_doc.json}
+                if ./tests -E "${name}_edits.json" $doc > temp.json \
+                                && diff -w temp.json "${name}_expected.json" > /dev/null; then
+                        ((++pcount))
+                else
+                        ((++fcount))
+                        failed_msg "Unexpected edit output: $(basename $name)"
+                fi
+        done
+fi
+
+# Diffs applied as patches must turn each file into the other
+if [ -x ./tests ]; then
+        for from in ${diff_dir}/*_from.json; do
+                to="${from%_from.json}_to.json"
+                for pair in "$from $to" "$to $from"; do
+                        if ./tests -r $pair > /dev/null; then
+                                ((++pcount))
+                        else
+                                ((++fcount))
+                                failed_msg "Diff round trip failed: $pair"
+                        fi
+                done
+        done
+fi
+
 if [ -f temp.json ]; then
         rm temp.json
 fi
@@ -3,6 +3,11 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <locale.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "../src/jsonpg.h"
 
@@ -15,7 +20,9 @@ char *type_name(jsonpg_type type) {
                 "False",
                 "True",
                 "Integer",
+                "Unsigned",
                 "Real",
+                "Number",
                 "String",
                 "Key",
                 "[",
@@ -28,11 +35,1036 @@ char *type_name(jsonpg_type type) {
         return names[type];
 }
 
+static uint8_t *read_file(char *name, size_t *length)
+{
+        FILE *fh = fopen(name, "rb");
+        if(!fh) {
+                perror("Failed to open file");
+                exit(1);
+        }
+        fseek(fh, 0L, SEEK_END);
+        *length = ftell(fh);
+        rewind(fh);
+        uint8_t *buf = malloc(*length + 1);
+        if(!buf) {
+                perror("Failed to allocate buffer");
+                exit(1);
+        }
+        fread(buf, *length, 1, fh);
+        fclose(fh);
+        return buf;
+}
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Pull every event from the parser and throw it away
+static double bench_parse(uint8_t *buf, size_t length, long times, uint16_t flags)
+{
+        jsonpg_parser p = jsonpg_parser_new(.flags = flags);
+        double start = now();
+        for(int i = 0 ; i < times ; i++) {
+                jsonpg_type type;
+                jsonpg_parse(.parser = p, .bytes = buf, .count = length);
+                while(JSONPG_EOF != (type = jsonpg_parse_next(p))) {
+                        if(type == JSONPG_ERROR) {
+                                fprintf(stderr, "Parse failed\n");
+                                exit(1);
+                        }
+                }
+        }
+        double secs = now() - start;
+        jsonpg_parser_free(p);
+        return (length * times) / secs / 1e6;
+}
+
+// Build and free a DOM of the input
+static double bench_dom(uint8_t *buf, size_t length, long times)
+{
+        double start = now();
+        for(int i = 0 ; i < times ; i++) {
+                jsonpg_generator g = jsonpg_generator_new(.dom = true);
+                if(JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length,
+                                        .generator = g).type) {
+                        fprintf(stderr, "Parse failed\n");
+                        exit(1);
+                }
+                jsonpg_generator_free(g);
+        }
+        double secs = now() - start;
+        return (length * times) / secs / 1e6;
+}
+
+// Stringify the input to a buffer reusing one parser and generator
+static double bench_reuse(uint8_t *buf, size_t length, long times)
+{
+        jsonpg_parser p = jsonpg_parser_new();
+        jsonpg_generator g = jsonpg_generator_new(.buffer = true);
+        double start = now();
+        for(int i = 0 ; i < times ; i++) {
+                jsonpg_generator_reset(g);
+                if(JSONPG_EOF != jsonpg_parse(.parser = p, 
+                                        .bytes = buf, .count = length,
+                                        .generator = g).type) {
+                        fprintf(stderr, "Parse failed\n");
+                        exit(1);
+                }
+        }
+        double secs = now() - start;
+        jsonpg_generator_free(g);
+        jsonpg_parser_free(p);
+        return (length * times) / secs / 1e6;
+}
+
+// Print a DOM of the input to a buffer, so only printing is timed
+static double bench_print(uint8_t *buf, size_t length, long times)
+{
+        jsonpg_generator dom = jsonpg_generator_new(.dom = true);
+        if(JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length, 
+                                .generator = dom).type) {
+                fprintf(stderr, "Parse failed\n");
+                exit(1);
+        }
+        double start = now();
+        for(int i = 0 ; i < times ; i++) {
+                jsonpg_generator g = jsonpg_generator_new(.buffer = true);
+                if(JSONPG_EOF != jsonpg_parse(.dom = jsonpg_result_dom(dom),
+                                        .generator = g).type) {
+                        fprintf(stderr, "Print failed\n");
+                        exit(1);
+                }
+                jsonpg_generator_free(g);
+        }
+        double secs = now() - start;
+        jsonpg_generator_free(dom);
+        return (length * times) / secs / 1e6;
+}
+
+// Stringify just the string values of the input, so only escaping is timed
+static double bench_strings(uint8_t *buf, size_t length, long times)
+{
+        jsonpg_generator dom = jsonpg_generator_new(.dom = true);
+        jsonpg_generator strings = jsonpg_generator_new(.buffer = true);
+        jsonpg_parser p = jsonpg_parser_new();
+        jsonpg_type type;
+        size_t count = 0;
+        jsonpg_begin_array(strings);
+        jsonpg_parse(.parser = p, .bytes = buf, .count = length);
+        while(JSONPG_EOF != (type = jsonpg_parse_next(p))) {
+                if(type == JSONPG_ERROR) {
+                        fprintf(stderr, "Parse failed\n");
+                        exit(1);
+                }
+                if(type == JSONPG_STRING) {
+                        jsonpg_value v = jsonpg_parse_result(p);
+                        jsonpg_string(strings, v.string.bytes, v.string.length);
+                        count += v.string.length;
+                }
+        }
+        jsonpg_end_array(strings);
+        jsonpg_parser_free(p);
+        uint8_t *array;
+        size_t array_length = jsonpg_result_bytes(strings, &array);
+        if(JSONPG_EOF != jsonpg_parse(.bytes = array, .count = array_length,
+                                .generator = dom).type) {
+                fprintf(stderr, "Parse failed\n");
+                exit(1);
+        }
+        double start = now();
+        for(int i = 0 ; i < times ; i++) {
+                jsonpg_generator g = jsonpg_generator_new(.buffer = true);
+                if(JSONPG_EOF != jsonpg_parse(.dom = jsonpg_result_dom(dom),
+                                        .generator = g).type) {
+                        fprintf(stderr, "Print failed\n");
+                        exit(1);
+                }
+                jsonpg_generator_free(g);
+        }
+        double secs = now() - start;
+        jsonpg_generator_free(strings);
+        jsonpg_generator_free(dom);
+        return (count * times) / secs / 1e6;
+}
+
+// Open a saved DOM of the input and read its root, compare with dom
+static double bench_mmap(uint8_t *buf, size_t length, long times)
+{
+        char name[] = "/tmp/jsonpg_bench_XXXXXX";
+        int fd = mkstemp(name);
+        jsonpg_generator g = jsonpg_generator_new(.dom = true);
+        if(fd < 0 
+                        || JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length,
+                                .generator = g).type
+                        || jsonpg_dom_save(jsonpg_result_dom(g), fd)) {
+                fprintf(stderr, "Save failed\n");
+                exit(1);
+        }
+        close(fd);
+        jsonpg_generator_free(g);
+
+        double start = now();
+        for(int i = 0 ; i < times ; i++) {
+                jsonpg_dom dom = jsonpg_dom_open_mmap(name);
+                if(!dom || JSONPG_NONE == jsonpg_cursor_type(jsonpg_dom_root(dom))) {
+                        fprintf(stderr, "Open failed\n");
+                        exit(1);
+                }
+                jsonpg_dom_close(dom);
+        }
+        double secs = now() - start;
+        unlink(name);
+        return (length * times) / secs / 1e6;
+}
+
+struct lookup_s {
+        jsonpg_cursor object;
+        jsonpg_string_value key;
+};
+
+// Collect every key of every object at or below c
+static size_t lookup_keys(jsonpg_cursor c, struct lookup_s *keys, size_t count)
+{
+        jsonpg_type type = jsonpg_cursor_type(c);
+        if(type != JSONPG_BEGIN_ARRAY && type != JSONPG_BEGIN_OBJECT)
+                return count;
+        for(jsonpg_cursor m = jsonpg_cursor_first(c) ; 
+                        jsonpg_cursor_type(m) != JSONPG_NONE ;
+                        m = jsonpg_cursor_next(m)) {
+                if(type == JSONPG_BEGIN_OBJECT) {
+                        if(keys)
+                                keys[count] = (struct lookup_s){
+                                        c, jsonpg_cursor_key(m) };
+                        count++;
+                }
+                count = lookup_keys(m, keys, count);
+        }
+        return count;
+}
+
+// Look up every key of every object in the input, result is lookups/s
+static double bench_lookup(uint8_t *buf, size_t length, long times)
+{
+        jsonpg_generator dom = jsonpg_generator_new(.dom = true);
+        if(JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length, 
+                                .generator = dom).type) {
+                fprintf(stderr, "Parse failed\n");
+                exit(1);
+        }
+        jsonpg_cursor root = jsonpg_dom_root(jsonpg_result_dom(dom));
+        size_t count = lookup_keys(root, NULL, 0);
+        struct lookup_s *keys = malloc(count * sizeof(struct lookup_s));
+        lookup_keys(root, keys, 0);
+        double start = now();
+        for(int i = 0 ; i < times ; i++) {
+                for(size_t k = 0 ; k < count ; k++) {
+                        jsonpg_cursor c = jsonpg_cursor_get(keys[k].object,
+                                        keys[k].key.bytes, keys[k].key.length);
+                        if(jsonpg_cursor_type(c) == JSONPG_NONE) {
+                                fprintf(stderr, "Lookup failed\n");
+                                exit(1);
+                        }
+                }
+        }
+        double secs = now() - start;
+        free(keys);
+        jsonpg_generator_free(dom);
+        return (count * times) / secs / 1e6;
+}
+
+// Replace the value of every scalar member of every object in the
+// input with a string, result is edits/s
+static double bench_edit(uint8_t *buf, size_t length, long times)
+{
+        jsonpg_generator dom = jsonpg_generator_new(.dom = true);
+        if(JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length, 
+                                .generator = dom).type) {
+                fprintf(stderr, "Parse failed\n");
+                exit(1);
+        }
+        jsonpg_cursor root = jsonpg_dom_root(jsonpg_result_dom(dom));
+        size_t count = lookup_keys(root, NULL, 0);
+        struct lookup_s *keys = malloc(count * sizeof(struct lookup_s));
+        lookup_keys(root, keys, 0);
+        size_t scalars = 0;
+        for(size_t k = 0 ; k < count ; k++) {
+                jsonpg_type type = jsonpg_cursor_type(jsonpg_cursor_get(
+                                        keys[k].object,
+                                        keys[k].key.bytes, keys[k].key.length));
+                if(type != JSONPG_BEGIN_ARRAY && type != JSONPG_BEGIN_OBJECT)
+                        keys[scalars++] = keys[k];
+        }
+        jsonpg_value value = {
+                .type = JSONPG_STRING,
+                .string = { (uint8_t *)"edited", 6 }
+        };
+        double start = now();
+        for(int i = 0 ; i < times ; i++) {
+                for(size_t k = 0 ; k < scalars ; k++) {
+                        if(jsonpg_dom_put(keys[k].object, keys[k].key.bytes,
+                                                keys[k].key.length, value)) {
+                                fprintf(stderr, "Edit failed\n");
+                                exit(1);
+                        }
+                }
+        }
+        double secs = now() - start;
+        free(keys);
+        jsonpg_generator_free(dom);
+        return (scalars * times) / secs / 1e6;
+}
+
+// Diff the input with a copy of it that has synthetic edits: every
+// 10th member is replaced or deleted if it is a scalar, or if it is
+// an array it loses its first element and gains one in its middle
+// The first diff hashes both DOMs, result is MB/s of input
+static double bench_diff(uint8_t *buf, size_t length, long times)
+{
+        jsonpg_generator a = jsonpg_generator_new(.dom = true);
+        jsonpg_generator b = jsonpg_generator_new(.dom = true);
+        if(JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length, 
+                                .generator = a).type
+                        || JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length, 
+                                .generator = b).type) {
+                fprintf(stderr, "Parse failed\n");
+                exit(1);
+        }
+        jsonpg_cursor root = jsonpg_dom_root(jsonpg_result_dom(b));
+        size_t count = lookup_keys(root, NULL, 0);
+        struct lookup_s *keys = malloc(count * sizeof(struct lookup_s));
+        lookup_keys(root, keys, 0);
+        jsonpg_value value = {
+                .type = JSONPG_STRING,
+                .string = { (uint8_t *)"edited", 6 }
+        };
+        // Last first so nothing is edited after what holds it is
+        for(size_t k = count ; k-- ; ) {
+                if(k % 10)
+                        continue;
+                jsonpg_cursor c = jsonpg_cursor_get(keys[k].object,
+                                keys[k].key.bytes, keys[k].key.length);
+                size_t n = jsonpg_cursor_count(c);
+                switch(jsonpg_cursor_type(c)) {
+                case JSONPG_BEGIN_ARRAY:
+                        if(n > 1 && (jsonpg_dom_remove(c, 0)
+                                        || jsonpg_dom_insert(c, n / 2, value)))
+                                exit(1);
+                        break;
+                case JSONPG_BEGIN_OBJECT:
+                        break;
+                default:
+                        if(k % 20 ? jsonpg_dom_delete(keys[k].object,
+                                                keys[k].key.bytes, keys[k].key.length)
+                                        : jsonpg_dom_put(keys[k].object,
+                                                keys[k].key.bytes, keys[k].key.length,
+                                                value))
+                                exit(1);
+                }
+        }
+        double start = now();
+        for(int i = 0 ; i < times ; i++) {
+                jsonpg_generator g = jsonpg_generator_new(.buffer = true);
+                if(jsonpg_dom_diff(jsonpg_result_dom(a), jsonpg_result_dom(b), g)) {
+                        fprintf(stderr, "Diff failed\n");
+                        exit(1);
+                }
+                jsonpg_generator_free(g);
+        }
+        double secs = now() - start;
+        free(keys);
+        jsonpg_generator_free(b);
+        jsonpg_generator_free(a);
+        return (length * times) / secs / 1e6;
+}
+
+// Hash the whole input, and compare it with a copy of itself, which
+// looks inside everything as the stored hashes are all the same
+// Results are MB/s of input
+static void bench_equal(uint8_t *buf, size_t length, long times,
+                double *hash, double *equal)
+{
+        jsonpg_generator a = jsonpg_generator_new(.dom = true);
+        jsonpg_generator b = jsonpg_generator_new(.dom = true);
+        if(JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length, 
+                                .generator = a).type
+                        || JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length, 
+                                .generator = b).type) {
+                fprintf(stderr, "Parse failed\n");
+                exit(1);
+        }
+        jsonpg_cursor ra = jsonpg_dom_root(jsonpg_result_dom(a));
+        jsonpg_cursor rb = jsonpg_dom_root(jsonpg_result_dom(b));
+        uint64_t h = 0;
+        double start = now();
+        for(int i = 0 ; i < times ; i++)
+                h ^= jsonpg_dom_hash(ra);
+        *hash = (length * times) / (now() - start) / 1e6;
+
+        if(jsonpg_dom_store_hashes(jsonpg_result_dom(a))
+                        || jsonpg_dom_store_hashes(jsonpg_result_dom(b))
+                        || h != (times & 1 ? jsonpg_dom_hash(rb) : 0)) {
+                fprintf(stderr, "Hash failed\n");
+                exit(1);
+        }
+        start = now();
+        for(int i = 0 ; i < times ; i++) {
+                if(!jsonpg_dom_equal(ra, rb)) {
+                        fprintf(stderr, "Equal failed\n");
+                        exit(1);
+                }
+        }
+        *equal = (length * times) / (now() - start) / 1e6;
+        jsonpg_generator_free(b);
+        jsonpg_generator_free(a);
+}
+
+// Allocator shared by every thread, serialised by a single lock
+static void *locked_alloc(void *ctx, size_t size)
+{
+        pthread_mutex_lock(ctx);
+        void *p = malloc(size);
+        pthread_mutex_unlock(ctx);
+        return p;
+}
+
+static void *locked_realloc(void *ctx, void *p, size_t size)
+{
+        pthread_mutex_lock(ctx);
+        void *np = realloc(p, size);
+        pthread_mutex_unlock(ctx);
+        return np;
+}
+
+static void locked_free(void *ctx, void *p)
+{
+        pthread_mutex_lock(ctx);
+        free(p);
+        pthread_mutex_unlock(ctx);
+}
+
+// Plain malloc/free, bypassing the per-thread chunk cache
+static void *malloc_alloc(void *ctx, size_t size)
+{
+        return malloc(size);
+}
+
+static void *malloc_realloc(void *ctx, void *p, size_t size)
+{
+        return realloc(p, size);
+}
+
+static void malloc_free(void *ctx, void *p)
+{
+        free(p);
+}
+
+struct thread_bench_s {
+        uint8_t *buf;
+        size_t length;
+        long times;
+        jsonpg_allocator *allocator;
+};
+
+// Build and free a DOM of the input with the given allocator
+static void *thread_dom(void *arg)
+{
+        struct thread_bench_s *tb = arg;
+        for(int i = 0 ; i < tb->times ; i++) {
+                jsonpg_generator g = jsonpg_generator_new(
+                                .dom = true, 
+                                .allocator = tb->allocator);
+                if(JSONPG_EOF != jsonpg_parse(.bytes = tb->buf, .count = tb->length,
+                                        .generator = g,
+                                        .allocator = tb->allocator).type) {
+                        fprintf(stderr, "Parse failed\n");
+                        exit(1);
+                }
+                jsonpg_generator_free(g);
+        }
+        return NULL;
+}
+
+// Total throughput of N threads each building DOMs of the input
+static double bench_threads(
+                uint8_t *buf,
+                size_t length,
+                long times,
+                int threads,
+                jsonpg_allocator *allocator)
+{
+        pthread_t ids[threads];
+        struct thread_bench_s tb = { buf, length, times, allocator };
+        double start = now();
+        for(int i = 0 ; i < threads ; i++)
+                pthread_create(&ids[i], NULL, thread_dom, &tb);
+        for(int i = 0 ; i < threads ; i++)
+                pthread_join(ids[i], NULL);
+        double secs = now() - start;
+        return (length * times * threads) / secs / 1e6;
+}
+
+// Scaling of concurrent parsers, 1 to max threads, with a single
+// locked allocator, plain malloc and the default per-thread cache
+static void bench_concurrent(int max, long times, char *name)
+{
+        pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        jsonpg_allocator global = { 
+                locked_alloc, locked_realloc, locked_free, &lock };
+        jsonpg_allocator plain = { 
+                malloc_alloc, malloc_realloc, malloc_free, NULL };
+        size_t length;
+        uint8_t *buf = read_file(name, &length);
+        printf("%-8s %12s %12s %12s\n", 
+                        "threads", "global MB/s", "malloc MB/s", "cache MB/s");
+        for(int n = 1 ; n <= max ; n *= 2)
+                printf("%-8d %12.1f %12.1f %12.1f\n", n,
+                                bench_threads(buf, length, times, n, &global),
+                                bench_threads(buf, length, times, n, &plain),
+                                bench_threads(buf, length, times, n, NULL));
+        free(buf);
+}
+
+static void bench(long times, char *name)
+{
+        static struct {
+                char *name;
+                uint16_t flags;
+        } runs[] = {
+                { "parse", 0 },
+                { "index", JSONPG_FLAG_INDEX },
+                { "raw numbers", JSONPG_FLAG_RAW_NUMBERS }
+        };
+        size_t length;
+        uint8_t *buf = read_file(name, &length);
+#ifdef JSONPG_BYTE_CLASSES
+        printf("State map: byte classes\n");
+#else
+        printf("State map: full\n");
+#endif
+        for(int i = 0 ; i < sizeof(runs) / sizeof(runs[0]) ; i++)
+                printf("%-16s %8.1f MB/s\n", 
+                                runs[i].name,
+                                bench_parse(buf, length, times, runs[i].flags));
+        printf("%-16s %8.1f MB/s\n", "dom", bench_dom(buf, length, times));
+        printf("%-16s %8.1f MB/s\n", "print", bench_print(buf, length, times));
+        printf("%-16s %8.1f MB/s\n", "reuse", bench_reuse(buf, length, times));
+        printf("%-16s %8.1f MB/s\n", "strings", bench_strings(buf, length, times));
+        printf("%-16s %8.1f M/s\n", "lookup", bench_lookup(buf, length, times));
+        printf("%-16s %8.1f M/s\n", "edit", bench_edit(buf, length, times));
+        printf("%-16s %8.1f MB/s\n", "diff", bench_diff(buf, length, times));
+        double hash, equal;
+        bench_equal(buf, length, times, &hash, &equal);
+        printf("%-16s %8.1f MB/s\n", "hash", hash);
+        printf("%-16s %8.1f MB/s\n", "equal", equal);
+        printf("%-16s %8.1f MB/s\n", "mmap", bench_mmap(buf, length, times));
+        free(buf);
+}
+
+// Print the value at a path such as statuses/57/user/id
+// Path segments are object keys, or array indexes for arrays
+// The file can be JSON or a DOM file saved by -d
+static int query(char *path, char *name)
+{
+        jsonpg_generator g = NULL;
+        jsonpg_dom dom = jsonpg_dom_open_mmap(name);
+        if(!dom) {
+                size_t length;
+                uint8_t *buf = read_file(name, &length);
+                g = jsonpg_generator_new(.dom = true);
+                if(JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length, 
+                                        .generator = g).type) {
+                        fprintf(stderr, "Parse failed\n");
+                        exit(1);
+                }
+                free(buf);
+                dom = jsonpg_result_dom(g);
+        }
+
+        jsonpg_cursor c = jsonpg_dom_root(dom);
+        for(char *seg = strtok(path, "/") ; seg ; seg = strtok(NULL, "/")) {
+                if(jsonpg_cursor_type(c) == JSONPG_BEGIN_ARRAY)
+                        c = jsonpg_cursor_index(c, strtoul(seg, NULL, 10));
+                else
+                        c = jsonpg_cursor_get(c, (uint8_t *)seg, strlen(seg));
+        }
+
+        jsonpg_value v = jsonpg_cursor_value(c);
+        switch(v.type) {
+        case JSONPG_NONE:
+                printf("Not found\n");
+                break;
+        case JSONPG_INTEGER:
+                printf("%ld\n", v.number.integer);
+                break;
+        case JSONPG_UNSIGNED:
+                printf("%lu\n", v.number.uinteger);
+                break;
+        case JSONPG_REAL:
+                printf("%.17g\n", v.number.real);
+                break;
+        case JSONPG_NUMBER:
+        case JSONPG_STRING:
+                printf("%.*s\n", (int)v.string.length, v.string.bytes);
+                break;
+        case JSONPG_BEGIN_ARRAY:
+        case JSONPG_BEGIN_OBJECT:
+                printf("%s with %zu items\n", 
+                                type_name(v.type), jsonpg_cursor_count(c));
+                break;
+        default:
+                printf("%s\n", type_name(v.type));
+        }
+        if(g)
+                jsonpg_generator_free(g);
+        else
+                jsonpg_dom_close(dom);
+        return v.type == JSONPG_NONE;
+}
+
+// Parse a JSON file into a DOM generator, exits on failure
+static jsonpg_generator parse_dom(char *name)
+{
+        size_t length;
+        uint8_t *buf = read_file(name, &length);
+        jsonpg_generator g = jsonpg_generator_new(.dom = true);
+        if(JSONPG_EOF != jsonpg_parse(.bytes = buf, .count = length, 
+                                .generator = g).type) {
+                fprintf(stderr, "Parse failed\n");
+                exit(1);
+        }
+        free(buf);
+        return g;
+}
+
+// Save the DOM of a JSON file to a DOM file
+static int save_dom(char *name, char *dom_name)
+{
+        jsonpg_generator g = parse_dom(name);
+
+        int fd = open(dom_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0 || jsonpg_dom_save(jsonpg_result_dom(g), fd)) {
+                perror("Failed to save DOM");
+                exit(1);
+        }
+        close(fd);
+        jsonpg_generator_free(g);
+        return 0;
+}
+
+// Print a JSON file with a merge patch applied as it is parsed
+static int merge_patch(char *patch_name, char *name)
+{
+        jsonpg_generator patch = parse_dom(patch_name);
+        int fd = open(name, O_RDONLY);
+        if(fd < 0) {
+                perror("Failed to open file");
+                exit(1);
+        }
+        jsonpg_generator g = jsonpg_generator_new(.fd = fileno(stdout), .indent = 2);
+        jsonpg_value res = jsonpg_parse(.fd = fd, 
+                        .merge_patch = jsonpg_result_dom(patch), 
+                        .generator = g);
+        jsonpg_generator_free(g);
+        jsonpg_generator_free(patch);
+        close(fd);
+        if(res.type == JSONPG_ERROR) {
+                fprintf(stderr, "Merge failed\n");
+                return 1;
+        }
+        return 0;
+}
+
+// Print a JSON file with a merge patch applied to its DOM
+static int merge_patch_dom(char *patch_name, char *name)
+{
+        jsonpg_generator patch = parse_dom(patch_name);
+        jsonpg_generator dom = parse_dom(name);
+        int r = jsonpg_dom_merge_patch(jsonpg_result_dom(dom), jsonpg_result_dom(patch));
+        if(r) {
+                fprintf(stderr, "Merge failed\n");
+        } else {
+                jsonpg_generator g = jsonpg_generator_new(.fd = fileno(stdout), .indent = 2);
+                jsonpg_parse(.dom = jsonpg_result_dom(dom), .generator = g);
+                jsonpg_generator_free(g);
+        }
+        jsonpg_generator_free(dom);
+        jsonpg_generator_free(patch);
+        return r != 0;
+}
+
+// Print a JSON file with a JSON Patch applied to its DOM
+static int apply_patch(char *patch_name, char *name)
+{
+        jsonpg_generator patch = parse_dom(patch_name);
+        jsonpg_generator dom = parse_dom(name);
+        int r = jsonpg_dom_apply_patch(jsonpg_result_dom(dom), jsonpg_result_dom(patch));
+        if(r) {
+                fprintf(stderr, "Patch failed\n");
+        } else {
+                jsonpg_generator g = jsonpg_generator_new(.fd = fileno(stdout), .indent = 2);
+                jsonpg_parse(.dom = jsonpg_result_dom(dom), .generator = g);
+                jsonpg_generator_free(g);
+        }
+        jsonpg_generator_free(dom);
+        jsonpg_generator_free(patch);
+        return r != 0;
+}
+
+// Print the JSON Patch that turns one JSON file into another
+static int diff_files(char *from_name, char *to_name)
+{
+        jsonpg_generator from = parse_dom(from_name);
+        jsonpg_generator to = parse_dom(to_name);
+        jsonpg_generator g = jsonpg_generator_new(.fd = fileno(stdout), .indent = 2);
+        int r = jsonpg_dom_diff(jsonpg_result_dom(from), jsonpg_result_dom(to), g);
+        jsonpg_generator_free(g);
+        jsonpg_generator_free(to);
+        jsonpg_generator_free(from);
+        if(r)
+                fprintf(stderr, "Diff failed\n");
+        return r != 0;
+}
+
+// Follow a JSON Pointer, without escapes, from a cursor
+static jsonpg_cursor edit_target(jsonpg_cursor c, jsonpg_string_value path)
+{
+        uint8_t *p = path.bytes, *end = path.bytes + path.length;
+        while(p < end && *p == '/') {
+                uint8_t *token = ++p;
+                size_t index = 0;
+                for( ; p < end && *p != '/' ; p++)
+                        index = 10 * index + (*p - '0');
+                if(jsonpg_cursor_type(c) == JSONPG_BEGIN_ARRAY)
+                        c = jsonpg_cursor_index(c, index);
+                else
+                        c = jsonpg_cursor_get(c, token, p - token);
+        }
+        return c;
+}
+
+static char *print_dom(jsonpg_dom dom)
+{
+        jsonpg_generator g = jsonpg_generator_new(.buffer = true);
+        jsonpg_parse(.dom = dom, .generator = g);
+        char *s = strdup(jsonpg_result_string(g));
+        jsonpg_generator_free(g);
+        return s;
+}
+
+// Apply the edits in a JSON file to the DOM of another and print it,
+// it must print the same after it is compacted
+// Edits are arrays of an operation, a JSON Pointer to the value it
+// edits and its arguments, those that fail are printed first
+//   ["set", path, value]
+//   ["insert", path, index, value]
+//   ["remove", path, index]
+//   ["put", path, key, value]
+//   ["delete", path, key]
+//   ["get", path], fails if there is nothing at path
+static int edit_dom(char *edits_name, char *name)
+{
+        jsonpg_generator edits = parse_dom(edits_name);
+        jsonpg_generator g = parse_dom(name);
+        jsonpg_dom dom = jsonpg_result_dom(g);
+        jsonpg_cursor e = jsonpg_cursor_first(jsonpg_dom_root(jsonpg_result_dom(edits)));
+        for( ; jsonpg_cursor_type(e) != JSONPG_NONE ; e = jsonpg_cursor_next(e)) {
+                jsonpg_string_value op = jsonpg_cursor_value(jsonpg_cursor_index(e, 0)).string;
+                jsonpg_string_value path = jsonpg_cursor_value(jsonpg_cursor_index(e, 1)).string;
+                jsonpg_value arg = jsonpg_cursor_value(jsonpg_cursor_index(e, 2));
+                jsonpg_value value = jsonpg_cursor_value(jsonpg_cursor_index(e, 3));
+                jsonpg_cursor c = edit_target(jsonpg_dom_root(dom), path);
+                int r = -1;
+                if(op.length == 3 && !memcmp(op.bytes, "set", 3))
+                        r = jsonpg_dom_set(c, arg);
+                else if(op.length == 6 && !memcmp(op.bytes, "insert", 6))
+                        r = jsonpg_dom_insert(c, arg.number.integer, value);
+                else if(op.length == 6 && !memcmp(op.bytes, "remove", 6))
+                        r = jsonpg_dom_remove(c, arg.number.integer);
+                else if(op.length == 3 && !memcmp(op.bytes, "put", 3))
+                        r = jsonpg_dom_put(c, arg.string.bytes, arg.string.length, value);
+                else if(op.length == 6 && !memcmp(op.bytes, "delete", 6))
+                        r = jsonpg_dom_delete(c, arg.string.bytes, arg.string.length);
+                else if(op.length == 3 && !memcmp(op.bytes, "get", 3))
+                        r = jsonpg_cursor_type(c) == JSONPG_NONE ? -1 : 0;
+                if(r)
+                        printf("%.*s %.*s failed\n", (int)op.length, op.bytes,
+                                        (int)path.length, path.bytes);
+        }
+
+        char *edited = print_dom(dom);
+        int r = 0;
+        if(jsonpg_dom_compact(dom)) {
+                fprintf(stderr, "Compact failed\n");
+                r = 1;
+        } else {
+                char *compacted = print_dom(dom);
+                if(strcmp(edited, compacted)) {
+                        fprintf(stderr, "Compacted DOM differs\n");
+                        r = 1;
+                }
+                free(compacted);
+        }
+        printf("%s\n", edited);
+        free(edited);
+        jsonpg_generator_free(g);
+        jsonpg_generator_free(edits);
+        return r;
+}
+
+// Compare two JSON files either way round, with and without stored
+// hashes, which must all agree and equal files must hash the same
+// Returns 0 if they are equal, 1 if they differ, 2 if results disagree
+static int equal_files(char *a_name, char *b_name)
+{
+        jsonpg_generator a = parse_dom(a_name);
+        jsonpg_generator b = parse_dom(b_name);
+        jsonpg_cursor ra = jsonpg_dom_root(jsonpg_result_dom(a));
+        jsonpg_cursor rb = jsonpg_dom_root(jsonpg_result_dom(b));
+        bool equal = jsonpg_dom_equal(ra, rb);
+        int r = equal ? 0 : 1;
+        if(jsonpg_dom_equal(rb, ra) != equal
+                        || (equal && jsonpg_dom_hash(ra) != jsonpg_dom_hash(rb))) {
+                r = 2;
+        } else if(jsonpg_dom_store_hashes(jsonpg_result_dom(a))
+                        || jsonpg_dom_store_hashes(jsonpg_result_dom(b))) {
+                fprintf(stderr, "Hash failed\n");
+                r = 2;
+        } else if(jsonpg_dom_equal(ra, rb) != equal
+                        || jsonpg_dom_equal(rb, ra) != equal) {
+                r = 2;
+        }
+        printf("%s\n", r == 0 ? "Equal" : r == 1 ? "Differ" : "Disagree");
+        jsonpg_generator_free(b);
+        jsonpg_generator_free(a);
+        return r;
+}
+
+// Diff two JSON files and apply the patch to the first, which must
+// then equal the second compared either way round
+// Returns 1 if it does not
+static int diff_round_trip(char *from_name, char *to_name)
+{
+        jsonpg_generator from = parse_dom(from_name);
+        jsonpg_generator to = parse_dom(to_name);
+        jsonpg_generator patch = jsonpg_generator_new(.dom = true);
+        jsonpg_dom from_dom = jsonpg_result_dom(from);
+        jsonpg_cursor a = jsonpg_dom_root(from_dom);
+        jsonpg_cursor b = jsonpg_dom_root(jsonpg_result_dom(to));
+        int r = 0;
+        if(jsonpg_dom_equal(a, b) && jsonpg_dom_hash(a) != jsonpg_dom_hash(b)) {
+                fprintf(stderr, "Equal with different hashes\n");
+                r = 1;
+        } else if(jsonpg_dom_diff(from_dom, jsonpg_result_dom(to), patch)) {
+                fprintf(stderr, "Diff failed\n");
+                r = 1;
+        } else if(jsonpg_dom_apply_patch(from_dom, jsonpg_result_dom(patch))) {
+                fprintf(stderr, "Patch failed\n");
+                r = 1;
+        } else {
+                a = jsonpg_dom_root(from_dom);
+                if(!jsonpg_dom_equal(a, b) || !jsonpg_dom_equal(b, a)) {
+                        fprintf(stderr, "Patched %s differs from %s\n",
+                                        from_name, to_name);
+                        r = 1;
+                }
+        }
+        jsonpg_generator_free(patch);
+        jsonpg_generator_free(to);
+        jsonpg_generator_free(from);
+        return r;
+}
+
+// The same edit to a parsed and a mapped DOM, appending to the root
+// if it is an array or object or otherwise replacing it
+static int edit_root(jsonpg_dom dom)
+{
+        jsonpg_cursor root = jsonpg_dom_root(dom);
+        jsonpg_value value = {
+                .type = JSONPG_STRING,
+                .string = { (uint8_t *)"edited", 6 }
+        };
+        switch(jsonpg_cursor_type(root)) {
+        case JSONPG_BEGIN_ARRAY:
+                return jsonpg_dom_insert(root, jsonpg_cursor_count(root), value);
+        case JSONPG_BEGIN_OBJECT:
+                return jsonpg_dom_put(root, (uint8_t *)"edited", 6, value);
+        default:
+                return jsonpg_dom_set(root, value);
+        }
+}
+
+// Save the DOM of a JSON file, once edited, and map it back, it must
+// print the same as the parsed DOM, also once both are edited again and
+// the mapped one is compacted. The file must not map once truncated or
+// without its magic
+// Returns 1 if any of that fails
+static int check_mmap(char *name)
+{
+        char dom_name[] = "/tmp/jsonpg_mmap_XXXXXX";
+        int fd = mkstemp(dom_name);
+        jsonpg_generator g = parse_dom(name);
+        jsonpg_dom dom = jsonpg_result_dom(g);
+        if(fd < 0 || edit_root(dom) || jsonpg_dom_save(dom, fd)) {
+                fprintf(stderr, "Save failed\n");
+                exit(1);
+        }
+        off_t size = lseek(fd, 0, SEEK_END);
+
+        char *fail = NULL;
+        char *parsed = print_dom(dom);
+        jsonpg_dom mapped = jsonpg_dom_open_mmap(dom_name);
+        if(!mapped) {
+                fail = "map";
+        } else {
+                char *printed = print_dom(mapped);
+                if(strcmp(parsed, printed))
+                        fail = "print";
+                free(printed);
+                free(parsed);
+
+                if(!fail && (edit_root(dom) || edit_root(mapped)))
+                        fail = "edit";
+                parsed = print_dom(dom);
+                printed = print_dom(mapped);
+                if(!fail && strcmp(parsed, printed))
+                        fail = "edited print";
+                free(printed);
+
+                if(!fail && jsonpg_dom_compact(mapped))
+                        fail = "compact";
+                printed = print_dom(mapped);
+                if(!fail && strcmp(parsed, printed))
+                        fail = "compacted print";
+                free(printed);
+                jsonpg_dom_close(mapped);
+        }
+        free(parsed);
+        mapped = NULL;
+
+        if(!fail && (ftruncate(fd, size - 1)
+                                || (mapped = jsonpg_dom_open_mmap(dom_name)))) {
+                jsonpg_dom_close(mapped);
+                fail = "truncated";
+        }
+        if(!fail && (ftruncate(fd, size)
+                                || pwrite(fd, "X", 1, 0) != 1
+                                || (mapped = jsonpg_dom_open_mmap(dom_name)))) {
+                jsonpg_dom_close(mapped);
+                fail = "bad magic";
+        }
+
+        close(fd);
+        unlink(dom_name);
+        jsonpg_generator_free(g);
+        if(fail)
+                printf("%s: mapped DOM %s failed\n", name, fail);
+        return fail != NULL;
+}
+
+// Compare the parser's conversion of the first number in a file
+// with strtod/strtol in the C locale, reals must be bit identical
+// Returns 1 if they differ
+static int check_number(char *name)
+{
+        size_t length;
+        uint8_t *buf = read_file(name, &length);
+        buf[length] = '\0';
+
+        char *start = strpbrk((char *)buf, "-0123456789");
+        if(!start) {
+                free(buf);
+                return 0;
+        }
+        char *number = strndup(start, strspn(start, "+-.0123456789eE"));
+        bool is_real = strpbrk(number, ".eE");
+
+        jsonpg_value expect = {};
+        errno = 0;
+        if(is_real) {
+                expect.number.real = strtod(number, NULL);
+                expect.type = (errno || !(expect.number.real == 0 
+                                        || isnormal(expect.number.real)))
+                        ? JSONPG_ERROR
+                        : JSONPG_REAL;
+        } else {
+                expect.number.integer = strtol(number, NULL, 10);
+                expect.type = JSONPG_INTEGER;
+                if(errno && *number != '-') {
+                        errno = 0;
+                        expect.number.uinteger = strtoul(number, NULL, 10);
+                        expect.type = JSONPG_UNSIGNED;
+                }
+                if(errno)
+                        expect.type = JSONPG_ERROR;
+        }
+
+        jsonpg_parser p = jsonpg_parser_new();
+        jsonpg_parse(.parser = p, .bytes = buf, .count = length);
+        jsonpg_type type;
+        do {
+                type = jsonpg_parse_next(p);
+        } while(type == JSONPG_BEGIN_ARRAY || type == JSONPG_BEGIN_OBJECT
+                        || type == JSONPG_KEY);
+        jsonpg_value v = jsonpg_parse_result(p);
+        v.type = type;
+        jsonpg_parser_free(p);
+
+        // raw numbers converted later must give the same result
+        p = jsonpg_parser_new(.flags = JSONPG_FLAG_RAW_NUMBERS);
+        jsonpg_parse(.parser = p, .bytes = buf, .count = length);
+        do {
+                type = jsonpg_parse_next(p);
+        } while(type == JSONPG_BEGIN_ARRAY || type == JSONPG_BEGIN_OBJECT
+                        || type == JSONPG_KEY);
+        jsonpg_value raw = jsonpg_parse_result(p);
+        raw.type = type;
+        if(type == JSONPG_NUMBER)
+                raw = jsonpg_convert_number(raw.string.bytes, raw.string.length);
+        jsonpg_parser_free(p);
+
+        int failed = 0;
+        jsonpg_value *values[] = { &v, &raw };
+        for(int i = 0 ; i < 2 ; i++) {
+                jsonpg_value *value = values[i];
+                if(value->type != expect.type
+                                || (value->type != JSONPG_ERROR
+                                        && 0 != memcmp(&value->number, 
+                                                &expect.number, 
+                                                sizeof(value->number)))) {
+                        printf("%s: %s %sparsed as %s %a, expected %s %a\n",
+                                        name, number, i ? "raw " : "",
+                                        type_name(value->type), value->number.real,
+                                        type_name(expect.type), expect.number.real);
+                        failed = 1;
+                }
+        }
+
+        free(number);
+        free(buf);
+        return failed;
+}
+
 int main(int argc, char *argv[])
 {
         jsonpg_generator g;
         jsonpg_value res;
-        if(argc == 2) {
+        if(argc > 2 && 0 == strcmp("-n", argv[1])) {
+                setlocale(LC_ALL, "C");
+                int failed = 0;
+                for(int i = 2 ; i < argc ; i++)
+                        failed += check_number(argv[i]);
+                printf("Numbers: %d failed, %d passed\n", failed, argc - 2 - failed);
+                return failed != 0;
+        } else if(argc > 2 && 0 == strcmp("-o", argv[1])) {
+                int failed = 0;
+                for(int i = 2 ; i < argc ; i++)
+                        failed += check_mmap(argv[i]);
+                printf("Mapped DOMs: %d failed, %d passed\n", failed, argc - 2 - failed);
+                return failed != 0;
+        } else if(argc == 2) {
                 int fd = open(argv[1], O_RDONLY, "rb");
                 if(fd == -1) {
                         perror("Failed to open file");
@@ -57,8 +1089,45 @@ int main(int argc, char *argv[])
                                 exit(1);
                         }
                 }
+        } else if(argc == 5 && 0 == strcmp("-c", argv[1])) {
+                errno = 0;
+                long threads = strtol(argv[2], NULL, 10);
+                long times = strtol(argv[3], NULL, 10);
+                if(errno || threads < 1) {
+                        perror("Not a number");
+                        exit(1);
+                }
+                bench_concurrent(threads, times, argv[4]);
+                return 0;
         } else if(argc == 4) {
-                if(0 == strcmp("-t", argv[1])) {
+                if(0 == strcmp("-b", argv[1])) {
+                        errno = 0;
+                        long times = strtol(argv[2], NULL, 10);
+                        if(errno) {
+                                perror("Not a number");
+                                exit(1);
+                        }
+                        bench(times, argv[3]);
+                        return 0;
+                } else if(0 == strcmp("-p", argv[1])) {
+                        return query(argv[2], argv[3]);
+                } else if(0 == strcmp("-d", argv[1])) {
+                        return save_dom(argv[2], argv[3]);
+                } else if(0 == strcmp("-m", argv[1])) {
+                        return merge_patch(argv[2], argv[3]);
+                } else if(0 == strcmp("-M", argv[1])) {
+                        return merge_patch_dom(argv[2], argv[3]);
+                } else if(0 == strcmp("-j", argv[1])) {
+                        return apply_patch(argv[2], argv[3]);
+                } else if(0 == strcmp("-x", argv[1])) {
+                        return diff_files(argv[2], argv[3]);
+                } else if(0 == strcmp("-E", argv[1])) {
+                        return edit_dom(argv[2], argv[3]);
+                } else if(0 == strcmp("-q", argv[1])) {
+                        return equal_files(argv[2], argv[3]);
+                } else if(0 == strcmp("-r", argv[1])) {
+                        return diff_round_trip(argv[2], argv[3]);
+                } else if(0 == strcmp("-t", argv[1])) {
                         errno = 0;
                         long times = strtol(argv[2], NULL, 10);
                         if(errno) {